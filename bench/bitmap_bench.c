@@ -0,0 +1,174 @@
+// Bitmap engine microbenchmark: free sector counting and search on freshly formatted images with a pseudo-random
+// allocation pattern. The bit-by-bit reference mirrors how the bitmap was scanned before the word-parallel engine.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "ccos_format.h"
+#include "ccos_image.h"
+#include "ccos_private.h"
+
+typedef struct {
+  const char* name;
+  size_t size;
+} bench_image_t;
+
+static const bench_image_t images[] = {
+    {"360K", 360 * 1024},
+    {"720K", 720 * 1024},
+    {"max (65528 sectors)", 65528 * 512},
+};
+
+static int is_allocated_reference(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list, size_t block) {
+  size_t bitmask_blocks = ccos_get_bitmask_sectors(disk);
+  size_t bitmask_index = block / bitmask_blocks;
+  size_t local_block = block - bitmask_index * bitmask_blocks;
+  uint8_t* bitmask_bytes = ccos_get_bitmask_bytes(bitmask_list->bitmask_blocks[bitmask_index]);
+
+  return (bitmask_bytes[local_block / 8] & (1u << (local_block % 8))) != 0;
+}
+
+static size_t count_free_reference(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list, size_t block_count) {
+  size_t free_count = 0;
+  for (size_t block = 0; block < block_count; block++) {
+    if (!is_allocated_reference(disk, bitmask_list, block)) {
+      free_count++;
+    }
+  }
+
+  return free_count;
+}
+
+static size_t find_free_reference(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list, size_t block_count) {
+  for (size_t block = 0; block < block_count; block++) {
+    if (!is_allocated_reference(disk, bitmask_list, block)) {
+      return block;
+    }
+  }
+
+  return block_count;
+}
+
+static size_t find_run_reference(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list, size_t block_count,
+                                 size_t count) {
+  size_t run_length = 0;
+  for (size_t block = 0; block < block_count; block++) {
+    run_length = is_allocated_reference(disk, bitmask_list, block) ? 0 : run_length + 1;
+    if (run_length == count) {
+      return block + 1 - count;
+    }
+  }
+
+  return block_count;
+}
+
+static double elapsed_ns(clock_t start, size_t iterations) {
+  return (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / (double)iterations;
+}
+
+static void report(const char* image, const char* operation, double reference_ns, double engine_ns) {
+  printf("%-20s %-28s %12.0f %12.0f %8.1fx\n", image, operation, reference_ns, engine_ns, reference_ns / engine_ns);
+}
+
+static int bench_image(const bench_image_t* image, size_t iterations) {
+  ccos_disk_t* disk = NULL;
+  if (ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, image->size, &disk) != 0) {
+    fprintf(stderr, "Unable to create %s image!\n", image->name);
+    return -1;
+  }
+
+  ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
+  size_t block_count = ccos_disk_size(disk) / ccos_disk_sector_size(disk);
+
+  // Allocate about a half of the image in short random runs.
+  srand(1);
+  ccos_begin_bitmask_update(disk);
+  for (size_t block = 0; block < block_count; block += 1 + rand() % 16) {
+    size_t run = 1 + rand() % 16;
+    for (size_t i = 0; i < run && block < block_count; ++i, ++block) {
+      if (!is_allocated_reference(disk, &bitmask_list, block)) {
+        ccos_mark_sector(disk, &bitmask_list, (uint16_t)block, 1);
+      }
+    }
+  }
+  ccos_commit_bitmask_update(disk, &bitmask_list);
+
+  volatile size_t sink = 0;
+  size_t free_count = 0;
+
+  clock_t start = clock();
+  for (size_t i = 0; i < iterations; ++i) {
+    sink += count_free_reference(disk, &bitmask_list, block_count);
+  }
+  double reference_ns = elapsed_ns(start, iterations);
+
+  start = clock();
+  for (size_t i = 0; i < iterations; ++i) {
+    ccos_get_free_sectors_count(disk, &bitmask_list, &free_count);
+    sink += free_count;
+  }
+  report(image->name, "count free sectors", reference_ns, elapsed_ns(start, iterations));
+
+  if (count_free_reference(disk, &bitmask_list, block_count) != free_count) {
+    fprintf(stderr, "Free sectors count mismatch on %s image!\n", image->name);
+    ccos_disk_free(disk);
+    return -1;
+  }
+
+  // Runs longer than any run left by the random pattern: the whole bitmap is walked.
+  start = clock();
+  for (size_t i = 0; i < iterations; ++i) {
+    sink += find_run_reference(disk, &bitmask_list, block_count, 64);
+  }
+  reference_ns = elapsed_ns(start, iterations);
+
+  uint16_t run_start = 0;
+  start = clock();
+  for (size_t i = 0; i < iterations; ++i) {
+    sink += ccos_find_free_run(disk, &bitmask_list, 64, CCOS_FIT_BEST, &run_start);
+  }
+  report(image->name, "find 64-block run (best fit)", reference_ns, elapsed_ns(start, iterations));
+
+  // Worst case search: the only free sector is the last one.
+  uint16_t last = ccos_get_free_sector(disk, &bitmask_list);
+  while (last != CCOS_INVALID_BLOCK) {
+    ccos_mark_sector(disk, &bitmask_list, last, 1);
+    last = ccos_get_free_sector(disk, &bitmask_list);
+  }
+  ccos_mark_sector(disk, &bitmask_list, (uint16_t)(block_count - 1), 0);
+
+  start = clock();
+  for (size_t i = 0; i < iterations; ++i) {
+    sink += find_free_reference(disk, &bitmask_list, block_count);
+  }
+  reference_ns = elapsed_ns(start, iterations);
+
+  start = clock();
+  for (size_t i = 0; i < iterations; ++i) {
+    ccos_disk_allocator(disk)->cursor = 0;
+    sink += ccos_get_free_sector(disk, &bitmask_list);
+  }
+  report(image->name, "find free sector (full scan)", reference_ns, elapsed_ns(start, iterations));
+
+  ccos_disk_free(disk);
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  size_t iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000;
+  if (iterations == 0) {
+    fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  printf("%-20s %-28s %12s %12s %9s\n", "image", "operation", "bitwise, ns", "engine, ns", "speedup");
+  for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); ++i) {
+    if (bench_image(&images[i], iterations) != 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
@@ -2,7 +2,18 @@
 
 #include "ccos_structure.h"
 
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 typedef enum {
   CCOS_DISK_SECTOR_FORMAT_256,
@@ -15,6 +26,16 @@ struct ccos_disk_t_ {
   uint16_t bitmap_fid;
   size_t   size;
   uint8_t* data;
+  bool mapped;                 // data is mapped from the image file rather than allocated
+  char* write_back_path;       // image file to write the data to on free, when it can't be mapped
+  uint64_t* dirty;             // bit per sector changed since the image was opened or flushed, NULL if none was
+  bool all_dirty;              // all sectors are treated as changed, e.g. for a new image
+  ccos_allocator_t allocator;
+  ccos_file_tail_t file_tail;
+  ccos_bitmap_summary_t bitmap_summary;
+  ccos_file_sectors_t file_sectors[CCOS_FILE_SECTORS_CACHE_SIZE];
+  ccos_parsed_dir_t dir_cache[CCOS_DIR_CACHE_SIZE];
+  ccos_image_names_t image_names;
 };
 
 static uint16_t ccos_disk_sector_format_size(ccos_disk_sector_format_t sector_format) {
@@ -48,6 +69,13 @@ static ccos_disk_t* ccos_disk_new(ccos_disk_sector_format_t sector_format, uint8
   disk->bitmap_fid = bitmap;
   disk->size = size;
   disk->data = data;
+  disk->file_tail.file_id = CCOS_INVALID_BLOCK;
+  for (size_t i = 0; i < CCOS_FILE_SECTORS_CACHE_SIZE; ++i) {
+    disk->file_sectors[i].file_id = CCOS_INVALID_BLOCK;
+  }
+  for (size_t i = 0; i < CCOS_DIR_CACHE_SIZE; ++i) {
+    disk->dir_cache[i].dir_id = CCOS_INVALID_BLOCK;
+  }
 
   return disk;
 }
@@ -60,12 +88,139 @@ ccos_disk_t* ccos_disk_new_extdisk(uint8_t* data, size_t size, uint16_t superblo
   return ccos_disk_new(CCOS_DISK_SECTOR_FORMAT_512, data, size, superblock, bitmap);
 }
 
-void ccos_disk_free(ccos_disk_t* disk) {
+#ifdef _WIN32
+
+// No mmap() here, so the image is read into memory, and written back on free in the shared mode.
+ccos_disk_t* ccos_disk_open_file(const char* path, ccos_disk_map_mode_t mode, uint16_t sector_size,
+                                 uint16_t superblock, uint16_t bitmap) {
+  if (path == NULL || (sector_size != BUBBLES_SECTOR_SIZE && sector_size != EXTDISK_SECTOR_SIZE)) {
+    return NULL;
+  }
+
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Unable to open %s: %s!\n", path, strerror(errno));
+    return NULL;
+  }
+
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t* data = size > 0 ? malloc(size) : NULL;
+  if (data == NULL || fread(data, sizeof(uint8_t), size, f) != (size_t)size) {
+    fprintf(stderr, "Unable to read %s!\n", path);
+    free(data);
+    fclose(f);
+    return NULL;
+  }
+
+  fclose(f);
+
+  char* write_back_path = NULL;
+  if (mode == CCOS_DISK_MAP_SHARED && (write_back_path = strdup(path)) == NULL) {
+    free(data);
+    return NULL;
+  }
+
+  ccos_disk_sector_format_t format = sector_size == BUBBLES_SECTOR_SIZE ? CCOS_DISK_SECTOR_FORMAT_256
+                                                                        : CCOS_DISK_SECTOR_FORMAT_512;
+  ccos_disk_t* disk = ccos_disk_new(format, data, size, superblock, bitmap);
+  if (disk == NULL) {
+    free(write_back_path);
+    free(data);
+    return NULL;
+  }
+
+  disk->write_back_path = write_back_path;
+  return disk;
+}
+
+#else
+
+ccos_disk_t* ccos_disk_open_file(const char* path, ccos_disk_map_mode_t mode, uint16_t sector_size,
+                                 uint16_t superblock, uint16_t bitmap) {
+  if (path == NULL || (sector_size != BUBBLES_SECTOR_SIZE && sector_size != EXTDISK_SECTOR_SIZE)) {
+    return NULL;
+  }
+
+  int fd = open(path, mode == CCOS_DISK_MAP_SHARED ? O_RDWR : O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "Unable to open %s: %s!\n", path, strerror(errno));
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size <= 0 || (uint64_t)st.st_size > SIZE_MAX) {
+    fprintf(stderr, "Unable to get size of %s!\n", path);
+    close(fd);
+    return NULL;
+  }
+
+  // Private mapping is copy-on-write: pages are read from the file as they are touched, and changes never reach it.
+  size_t size = (size_t)st.st_size;
+  int flags = mode == CCOS_DISK_MAP_SHARED ? MAP_SHARED : MAP_PRIVATE;
+  void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Unable to map %s: %s!\n", path, strerror(errno));
+    return NULL;
+  }
+
+  ccos_disk_sector_format_t format = sector_size == BUBBLES_SECTOR_SIZE ? CCOS_DISK_SECTOR_FORMAT_256
+                                                                        : CCOS_DISK_SECTOR_FORMAT_512;
+  ccos_disk_t* disk = ccos_disk_new(format, data, size, superblock, bitmap);
   if (disk == NULL) {
+    munmap(data, size);
+    return NULL;
+  }
+
+  disk->mapped = true;
+  return disk;
+}
+
+#endif
+
+static void release_disk_data(ccos_disk_t* disk) {
+#ifndef _WIN32
+  if (disk->mapped) {
+    munmap(disk->data, disk->size);
     return;
   }
+#endif
+
+  if (disk->write_back_path != NULL) {
+    FILE* f = fopen(disk->write_back_path, "r+b");
+    if (f == NULL || fwrite(disk->data, sizeof(uint8_t), disk->size, f) != disk->size) {
+      fprintf(stderr, "Unable to write image back to %s!\n", disk->write_back_path);
+    }
+
+    if (f != NULL) {
+      fclose(f);
+    }
+
+    free(disk->write_back_path);
+  }
 
   free(disk->data);
+}
+
+void ccos_disk_free(ccos_disk_t* disk) {
+  if (disk == NULL) {
+    return;
+  }
+
+  for (size_t i = 0; i < CCOS_FILE_SECTORS_CACHE_SIZE; ++i) {
+    free(disk->file_sectors[i].blocks);
+  }
+  for (size_t i = 0; i < CCOS_DIR_CACHE_SIZE; ++i) {
+    ccos_free_parsed_dir(&disk->dir_cache[i]);
+  }
+  free(disk->image_names.slots);
+  free(disk->bitmap_summary.free_count);
+  free(disk->bitmap_summary.nonfull);
+  free(disk->bitmap_summary.nonempty);
+  free(disk->dirty);
+  release_disk_data(disk);
   free(disk);
 }
 
@@ -89,6 +244,169 @@ uint16_t ccos_disk_bitmap(const ccos_disk_t* disk) {
   return disk == NULL ? 0 : disk->bitmap_fid;
 }
 
+ccos_allocator_t* ccos_disk_allocator(ccos_disk_t* disk) {
+  return disk == NULL ? NULL : &disk->allocator;
+}
+
+ccos_file_tail_t* ccos_disk_file_tail(ccos_disk_t* disk) {
+  return disk == NULL ? NULL : &disk->file_tail;
+}
+
+ccos_file_sectors_t* ccos_disk_file_sectors(ccos_disk_t* disk) {
+  return disk == NULL ? NULL : disk->file_sectors;
+}
+
+ccos_parsed_dir_t* ccos_disk_dir_cache(ccos_disk_t* disk) {
+  return disk == NULL ? NULL : disk->dir_cache;
+}
+
+ccos_image_names_t* ccos_disk_image_names(ccos_disk_t* disk) {
+  return disk == NULL ? NULL : &disk->image_names;
+}
+
+ccos_bitmap_summary_t* ccos_disk_bitmap_summary(ccos_disk_t* disk) {
+  return disk == NULL ? NULL : &disk->bitmap_summary;
+}
+
+void ccos_disk_mark_dirty(ccos_disk_t* disk, const void* data, size_t size) {
+  if (disk == NULL || disk->all_dirty || size == 0) {
+    return;
+  }
+
+  const uint8_t* bytes = (const uint8_t*)data;
+  if (bytes < disk->data || bytes >= disk->data + disk->size) {
+    return;
+  }
+
+  size_t sector_size = ccos_disk_sector_size(disk);
+  size_t sector_count = disk->size / sector_size;
+  if (disk->dirty == NULL) {
+    disk->dirty = calloc((sector_count + 63) / 64, sizeof(uint64_t));
+    if (disk->dirty == NULL) {
+      // Not knowing which sectors are changed, flush them all.
+      disk->all_dirty = true;
+      return;
+    }
+  }
+
+  size_t offset = (size_t)(bytes - disk->data);
+  size_t end = offset + size < disk->size ? offset + size : disk->size;
+  for (size_t sector = offset / sector_size; sector < (end + sector_size - 1) / sector_size; ++sector) {
+    disk->dirty[sector / 64] |= 1ull << (sector % 64);
+  }
+}
+
+void ccos_disk_mark_all_dirty(ccos_disk_t* disk) {
+  if (disk == NULL) {
+    return;
+  }
+
+  free(disk->dirty);
+  disk->dirty = NULL;
+  disk->all_dirty = true;
+}
+
+static bool is_dirty_sector(const ccos_disk_t* disk, size_t sector) {
+  return disk->all_dirty || (disk->dirty != NULL && (disk->dirty[sector / 64] >> (sector % 64) & 1u));
+}
+
+#ifdef _WIN32
+
+typedef FILE* image_file_t;
+#define INVALID_IMAGE_FILE NULL
+
+static image_file_t open_image_file(const char* path, bool create) {
+  FILE* f = fopen(path, "r+b");
+  return f != NULL || !create ? f : fopen(path, "wb");
+}
+
+static bool write_image_range(image_file_t f, const uint8_t* data, size_t offset, size_t size) {
+  return fseek(f, (long)offset, SEEK_SET) == 0 && fwrite(data + offset, sizeof(uint8_t), size, f) == size;
+}
+
+static bool close_image_file(image_file_t f) {
+  return fclose(f) == 0;
+}
+
+#else
+
+typedef int image_file_t;
+#define INVALID_IMAGE_FILE (-1)
+
+static image_file_t open_image_file(const char* path, bool create) {
+  return open(path, create ? O_WRONLY | O_CREAT : O_WRONLY, 0666);
+}
+
+static bool write_image_range(image_file_t fd, const uint8_t* data, size_t offset, size_t size) {
+  while (size > 0) {
+    ssize_t written = pwrite(fd, data + offset, size, (off_t)offset);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (written <= 0) {
+      return false;
+    }
+
+    offset += (size_t)written;
+    size -= (size_t)written;
+  }
+
+  return true;
+}
+
+static bool close_image_file(image_file_t fd) {
+  return close(fd) == 0;
+}
+
+#endif
+
+ccos_error_t ccos_disk_flush(ccos_disk_t* disk, const char* path) {
+  if (disk == NULL || path == NULL) {
+    return CCOS_EINVAL;
+  }
+
+  if (!disk->all_dirty && disk->dirty == NULL) {
+    return CCOS_OK;
+  }
+
+  // Writing only some of the sectors into a new file would leave the rest of the image missing.
+  image_file_t f = open_image_file(path, disk->all_dirty);
+  if (f == INVALID_IMAGE_FILE) {
+    fprintf(stderr, "Unable to open %s for writing: %s!\n", path, strerror(errno));
+    return errno == ENOENT ? CCOS_ENOENT : CCOS_EIO;
+  }
+
+  // Adjacent dirty sectors are written at once.
+  size_t sector_size = ccos_disk_sector_size(disk);
+  size_t sector_count = disk->size / sector_size;
+  bool ok = true;
+  for (size_t sector = 0; sector < sector_count && ok;) {
+    if (!is_dirty_sector(disk, sector)) {
+      sector++;
+      continue;
+    }
+
+    size_t end = sector + 1;
+    while (end < sector_count && is_dirty_sector(disk, end)) {
+      end++;
+    }
+
+    ok = write_image_range(f, disk->data, sector * sector_size, (end - sector) * sector_size);
+    sector = end;
+  }
+
+  if (!close_image_file(f) || !ok) {
+    fprintf(stderr, "Unable to write image to %s: %s!\n", path, strerror(errno));
+    return CCOS_EIO;
+  }
+
+  free(disk->dirty);
+  disk->dirty = NULL;
+  disk->all_dirty = false;
+  return CCOS_OK;
+}
+
 void* ccos_disk_read(ccos_disk_t* disk, uint16_t sector) {
   uint16_t sector_size = ccos_disk_sector_size(disk);
   if (disk == NULL || disk->data == NULL || sector_size == 0) {
@@ -5,11 +5,18 @@
 extern "C" {
 #endif
 
+#include "ccos_error.h"
+
 #include <stdint.h>
 #include <stddef.h>
 
 typedef struct ccos_disk_t_ ccos_disk_t;
 
+typedef enum {
+  CCOS_DISK_MAP_PRIVATE,       // changes are kept in memory, the image file stays as is
+  CCOS_DISK_MAP_SHARED,        // changes are written to the image file
+} ccos_disk_map_mode_t;
+
 typedef struct {
   uint8_t major;
   uint8_t minor;
@@ -45,12 +52,45 @@ ccos_disk_t* ccos_disk_new_bubble(uint8_t* data, size_t size, uint16_t superbloc
 ccos_disk_t* ccos_disk_new_extdisk(uint8_t* data, size_t size, uint16_t superblock, uint16_t bitmap);
 
 /**
- * @brief      Free a disk handle and the image data owned by it.
+ * @brief      Create a disk handle for the image file, mapping it into memory instead of reading it.
+ *
+ * Image pages are loaded as they are accessed. Where mmap() is unavailable, the image is read into memory, and in the
+ * shared mode it's written back to the file by ccos_disk_free().
+ *
+ * @param[in]  path         Path to the image file. Its size must be non-zero and a multiple of the sector size.
+ * @param[in]  mode         CCOS_DISK_MAP_SHARED to edit the file in place, CCOS_DISK_MAP_PRIVATE to keep changes in
+ *                          memory, e.g. to save them to other file.
+ * @param[in]  sector_size  Image sector size: 256 for bubble-memory images, 512 for external disk images.
+ * @param[in]  superblock   Superblock sector id. Must be non-zero, inside the image, and different from bitmap.
+ * @param[in]  bitmap       Bitmap sector id. Must be non-zero, inside the image, and different from superblock.
+ *
+ * @return     Disk handle on success, NULL otherwise.
+ */
+ccos_disk_t* ccos_disk_open_file(const char* path, ccos_disk_map_mode_t mode, uint16_t sector_size,
+                                 uint16_t superblock, uint16_t bitmap);
+
+/**
+ * @brief      Free a disk handle and the image data owned by it, or unmap the image file.
  *
  * @param      disk  Disk handle.
  */
 void ccos_disk_free(ccos_disk_t* disk);
 
+/**
+ * @brief      Write the sectors changed since the image was opened or last flushed to the image file.
+ *
+ * Changes are tracked per sector by the functions modifying the image, and adjacent changed sectors are written at
+ * once. Newly created images are written completely. Changes made to the image data directly are not tracked.
+ *
+ * @param[in]  disk  Disk handle.
+ * @param[in]  path  Path to the image file. It should hold the image as it was opened or last flushed. It's
+ *                   created only if the whole image is to be written, e.g. for newly created images.
+ *
+ * @return     CCOS_OK on success, CCOS_ENOENT if the file doesn't exist and only some sectors are changed, error code
+ *             otherwise.
+ */
+ccos_error_t ccos_disk_flush(ccos_disk_t* disk, const char* path);
+
 uint8_t* ccos_disk_data(ccos_disk_t* disk);
 size_t ccos_disk_size(const ccos_disk_t* disk);
 uint16_t ccos_disk_sector_size(const ccos_disk_t* disk);
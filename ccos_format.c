@@ -243,12 +243,19 @@ int ccos_new_disk_image(disk_format_t format, size_t disk_size, ccos_disk_t** ou
     return ENOMEM;
   }
 
+  // Bitmask counters and checksums are written once, after all the system sectors are marked.
+  ccos_begin_bitmask_update(disk);
+
   ccos_bitmask_list_t bitmask_list = init_bitmask(disk, bitmask);
   write_superblock(disk, &bitmask_list);
 
   write_boot_sector(disk, format, &bitmask_list);
   write_boot_code(disk, format, &bitmask_list);
 
+  ccos_commit_bitmask_update(disk, &bitmask_list);
+
+  // The image doesn't exist on the disk yet, so flushing it should write it whole.
+  ccos_disk_mark_all_dirty(disk);
   *output = disk;
 
   return 0;
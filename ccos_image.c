@@ -48,49 +48,29 @@ ccos_error_t ccos_set_exp_date(ccos_disk_t* disk, ccos_inode_t* file, ccos_date_
 }
 
 ccos_error_t ccos_get_dir_contents(ccos_disk_t* disk, ccos_inode_t* dir, uint16_t* entry_count, ccos_inode_t*** entries) {
-  uint8_t* dir_contents = NULL;
-  size_t dir_size = 0;
-
-  ccos_error_t err = ccos_read_file(disk, dir, &dir_contents, &dir_size);
-  if (err != CCOS_OK) {
-    return err;
-  }
-
-  // TODO: Do we really need entry count here?
-  uint16_t dir_count = dir->desc.dir_count;
-
-  parsed_directory_element_t* elements = NULL;
-
-  err = ccos_parse_directory_data(disk, dir_contents, dir_size, dir_count, &elements);
+  const ccos_parsed_dir_t* parsed = NULL;
+  ccos_error_t err = ccos_get_cached_dir(disk, dir, &parsed);
   if (err != CCOS_OK) {
-    free(dir_contents);
     return err;
   }
 
-  if (dir_count == 0) {
+  if (parsed->count == 0) {
     *entries = NULL;
     *entry_count = 0;
-    free(dir_contents);
-    free(elements);
     return CCOS_OK;
   }
 
-  ccos_inode_t** dir_entries = calloc(dir_count, sizeof(ccos_inode_t*));
+  ccos_inode_t** dir_entries = calloc(parsed->count, sizeof(ccos_inode_t*));
   if (dir_entries == NULL) {
-    free(dir_contents);
-    free(elements);
     return CCOS_ENOMEM;
   }
 
-  for (int j = 0; j < dir_count; ++j) {
-    dir_entries[j] = elements[j].file;
+  for (size_t i = 0; i < parsed->count; ++i) {
+    dir_entries[i] = parsed->elements[i].file;
   }
 
   *entries = dir_entries;
-  *entry_count = dir_count;
-
-  free(dir_contents);
-  free(elements);
+  *entry_count = parsed->count;
 
   return CCOS_OK;
 }
@@ -100,27 +80,50 @@ ccos_error_t ccos_find_file_by_name(ccos_disk_t* disk, ccos_inode_t* dir, const
     return CCOS_EINVAL;
   }
 
-  uint16_t entry_count = 0;
-  ccos_inode_t** entries = NULL;
-  ccos_error_t err = ccos_get_dir_contents(disk, dir, &entry_count, &entries);
-  if (err != CCOS_OK) {
-    return err;
+  return ccos_find_cached_dir_file(disk, dir, file_name, strlen(file_name), file);
+}
+
+ccos_error_t ccos_find_files_by_name(ccos_disk_t* disk, const char* file_name, ccos_inode_t*** files, size_t* count) {
+  if (disk == NULL || file_name == NULL || files == NULL || count == NULL) {
+    return CCOS_EINVAL;
   }
 
-  size_t file_name_length = strlen(file_name);
-  for (uint16_t i = 0; i < entry_count; ++i) {
-    const short_string_t* entry_name = ccos_get_file_name(entries[i]);
-    if (entry_name->length == file_name_length &&
-        strncasecmp(entry_name->data, file_name, entry_name->length) == 0) {
-      *file = entries[i];
-      free(entries);
-      return CCOS_OK;
-    }
+  return ccos_find_image_files(disk, file_name, strlen(file_name), files, count);
+}
+
+ccos_error_t ccos_lookup_path(ccos_disk_t* disk, const char* path, ccos_inode_t** file) {
+  if (disk == NULL || path == NULL || file == NULL || *path == '\0') {
+    return CCOS_EINVAL;
   }
 
-  free(entries);
   *file = NULL;
-  return CCOS_ENOENT;
+  ccos_inode_t* current = ccos_get_root_dir(disk);
+  if (current == NULL) {
+    return CCOS_EIO;
+  }
+
+  const char* component = path;
+  while (*component != '\0') {
+    const char* end = component;
+    while (*end != '\0' && !(end[0] == '/' && end > component && end[-1] == '~')) {
+      ++end;
+    }
+
+    if (!ccos_is_dir(current)) {
+      TRACE("%.*s: not a directory", (int)(component - path), path);
+      return CCOS_ENOENT;
+    }
+
+    ccos_error_t err = ccos_find_cached_dir_file(disk, current, component, end - component, &current);
+    if (err != CCOS_OK) {
+      return err;
+    }
+
+    component = *end == '/' ? end + 1 : end;
+  }
+
+  *file = current;
+  return CCOS_OK;
 }
 
 int ccos_is_dir(const ccos_inode_t* file) {
@@ -146,6 +149,11 @@ ccos_error_t ccos_replace_file(ccos_disk_t* disk, ccos_inode_t* file, const uint
     return CCOS_EINVAL;
   }
 
+  ccos_invalidate_dir_cache(disk, file->header.file_id);
+  if (ccos_is_dir(file)) {
+    ccos_drop_image_names(disk);
+  }
+
   uint32_t inode_file_size = file->desc.file_size;
   if (inode_file_size != file_size) {
     fprintf(stderr,
@@ -156,9 +164,9 @@ ccos_error_t ccos_replace_file(ccos_disk_t* disk, ccos_inode_t* file, const uint
   }
 
   size_t block_count = 0;
-  uint16_t* blocks = NULL;
+  const uint16_t* blocks = NULL;
 
-  ccos_error_t err = ccos_get_file_sectors(disk, file, &block_count, &blocks);
+  ccos_error_t err = ccos_get_cached_file_sectors(disk, file, &block_count, &blocks);
   if (err != CCOS_OK) {
     return err;
   }
@@ -171,17 +179,16 @@ ccos_error_t ccos_replace_file(ccos_disk_t* disk, ccos_inode_t* file, const uint
     err = ccos_get_sector_data(disk, blocks[i], &start, &data_size);
     if (err != CCOS_OK) {
       fprintf(stderr, "Unable to write data: Unable to get target block address!\n");
-      free(blocks);
       return err;
     }
 
     size_t copy_size = MIN(data_size, file_size - written_size);
     memcpy((uint8_t*)start, image_data_part, copy_size);
+    ccos_disk_mark_dirty(disk, start, copy_size);
     image_data_part += copy_size;
     written_size += copy_size;
   }
 
-  free(blocks);
   return CCOS_OK;
 }
 
@@ -206,85 +213,494 @@ ccos_error_t ccos_set_disk_label(ccos_disk_t* disk, const char* label) {
   return CCOS_OK;
 }
 
-ccos_error_t ccos_read_file(ccos_disk_t* disk, ccos_inode_t* file, uint8_t** file_data, size_t* file_size) {
+// Probably work-around for compatibility with older CCOS releases?
+// In some cases, inode->dir_length != inode->file_size, e.g. root dir might have file_size = 0x1F8 bytes (maximum
+// size of a file with one content block), and dir_length = 0xD8 (just some number below 0x1F8). In those cases the
+// correct number is dir_length.
+static size_t get_file_data_size(const ccos_inode_t* file) {
+  if (ccos_is_dir(file) && file->desc.file_size != file->desc.dir_length) {
+    TRACE("dir_length != file_size (%d != %d), fallback to dir_length.\n", file->desc.dir_length, file->desc.file_size);
+    return file->desc.dir_length;
+  }
+
+  return file->desc.file_size;
+}
+
+ccos_error_t ccos_file_spans_begin(ccos_disk_t* disk, ccos_inode_t* file, ccos_file_span_iterator_t* it) {
+  if (disk == NULL || file == NULL || it == NULL) {
+    return CCOS_EINVAL;
+  }
+
+  it->disk = disk;
+  it->file = file;
+  it->index = 0;
+  it->remaining = get_file_data_size(file);
+  return CCOS_OK;
+}
+
+ccos_error_t ccos_file_spans_next(ccos_file_span_iterator_t* it, const uint8_t** data, size_t* size) {
+  *data = NULL;
+  *size = 0;
+  if (it->remaining == 0) {
+    return CCOS_OK;
+  }
+
+  // The list is looked up on every step rather than kept in the iterator, as the cache entry may be reused by other
+  // files in between.
   size_t blocks_count = 0;
-  uint16_t* blocks = NULL;
+  const uint16_t* blocks = NULL;
+  ccos_error_t err = ccos_get_cached_file_sectors(it->disk, it->file, &blocks_count, &blocks);
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to get file blocks for file at 0x%x!\n", it->file->header.file_id);
+    return err;
+  }
 
-  ccos_error_t err = ccos_get_file_sectors(disk, file, &blocks_count, &blocks);
+  if (it->index >= blocks_count) {
+    return CCOS_OK;
+  }
+
+  const uint8_t* start = NULL;
+  size_t data_size = 0;
+  err = ccos_get_sector_data(it->disk, blocks[it->index], &start, &data_size);
   if (err != CCOS_OK) {
-    fprintf(stderr, "Unable to get file blocks for file at 0x%x!\n", file->header.file_id);
+    fprintf(stderr, "Unable to get data for data block 0x%x, file at 0x%x\n", blocks[it->index],
+            it->file->header.file_id);
     return err;
   }
 
-  size_t actual_size = file->desc.file_size;
+  it->index++;
+  *data = start;
+  *size = data_size < it->remaining ? data_size : it->remaining;
+  it->remaining -= *size;
+  return CCOS_OK;
+}
 
-  // Probably work-around for compatibility with older CCOS releases?
-  // In some cases, inode->dir_length != inode->file_size, e.g. root dir might have file_size = 0x1F8 bytes (maximum
-  // size of a file with one content block), and dir_length = 0xD8 (just some number below 0x1F8). In those cases the
-  // correct number is dir_length.
-  if (ccos_is_dir(file)) {
-    if (file->desc.file_size != file->desc.dir_length) {
-      TRACE("dir_length != file_size (%d != %d), fallback to dir_length.\n",
-            file->desc.dir_length, file->desc.file_size);
-      actual_size = file->desc.dir_length;
-    }
+ccos_error_t ccos_read_file(ccos_disk_t* disk, ccos_inode_t* file, uint8_t** file_data, size_t* file_size) {
+  ccos_file_span_iterator_t it;
+  ccos_error_t err = ccos_file_spans_begin(disk, file, &it);
+  if (err != CCOS_OK) {
+    return err;
   }
 
-  uint8_t* data = calloc(actual_size, sizeof(uint8_t));
+  size_t actual_size = it.remaining;
+  uint8_t* data = malloc(actual_size > 0 ? actual_size : 1);
   if (data == NULL) {
-    free(blocks);
     return CCOS_ENOMEM;
   }
 
-  uint32_t written = 0;
-
-  for (int i = 0; i < blocks_count; ++i) {
-    const uint8_t* data_start = NULL;
-    size_t data_size = 0;
-
-    err = ccos_get_sector_data(disk, blocks[i], &data_start, &data_size);
+  size_t written = 0;
+  for (;;) {
+    const uint8_t* span = NULL;
+    size_t span_size = 0;
+    err = ccos_file_spans_next(&it, &span, &span_size);
     if (err != CCOS_OK) {
-      fprintf(stderr, "Unable to get data for data block 0x%x, file at 0x%x\n", blocks[i], file->header.file_id);
       free(data);
-      free(blocks);
       return err;
     }
 
-    size_t copy_size = MIN(actual_size - written, data_size);
-    memcpy(&data[written], data_start, copy_size);
+    if (span_size == 0) {
+      break;
+    }
 
-    written += copy_size;
+    memcpy(&data[written], span, span_size);
+    written += span_size;
   }
 
   if (written != actual_size) {
-    fprintf(stderr, "Warn: File size (" SIZE_T ") != amount of bytes read (%u) at file 0x%x!\n", actual_size, written,
-            file->header.file_id);
+    fprintf(stderr, "Warn: File size (" SIZE_T ") != amount of bytes read (" SIZE_T ") at file 0x%x!\n", actual_size,
+            written, file->header.file_id);
+    memset(&data[written], 0, actual_size - written);
   }
 
   *file_size = actual_size;
   *file_data = data;
 
-  free(blocks);
+  return CCOS_OK;
+}
+
+ccos_error_t ccos_pread(ccos_disk_t* disk, ccos_inode_t* file, size_t offset, uint8_t* buf, size_t len,
+                        size_t* bytes_read) {
+  if (disk == NULL || file == NULL || (buf == NULL && len > 0)) {
+    return CCOS_EINVAL;
+  }
+
+  size_t data_size = get_file_data_size(file);
+  size_t end = offset < data_size ? (len < data_size - offset ? offset + len : data_size) : offset;
+
+  size_t blocks_count = 0;
+  const uint16_t* blocks = NULL;
+  ccos_error_t err = ccos_get_cached_file_sectors(disk, file, &blocks_count, &blocks);
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to get file blocks for file at 0x%x!\n", file->header.file_id);
+    return err;
+  }
+
+  size_t log_block_size = ccos_get_log_sector_size(disk);
+  size_t position = offset;
+  while (position < end) {
+    size_t index = position / log_block_size;
+    if (index >= blocks_count) {
+      break;
+    }
+
+    const uint8_t* start = NULL;
+    size_t sector_size = 0;
+    err = ccos_get_sector_data(disk, blocks[index], &start, &sector_size);
+    if (err != CCOS_OK) {
+      fprintf(stderr, "Unable to get data for data block 0x%x, file at 0x%x\n", blocks[index], file->header.file_id);
+      return err;
+    }
+
+    size_t sector_offset = position % log_block_size;
+    size_t copy_size = end - position < sector_size - sector_offset ? end - position : sector_size - sector_offset;
+    memcpy(&buf[position - offset], start + sector_offset, copy_size);
+    position += copy_size;
+  }
+
+  if (bytes_read != NULL) {
+    *bytes_read = position - offset;
+  }
+
+  return CCOS_OK;
+}
+
+// Add content sectors to the end of the file so it has out_blocks_count of them, and get the updated sector list.
+static ccos_error_t grow_file(ccos_disk_t* disk, ccos_inode_t* file, size_t out_blocks_count, size_t* blocks_count,
+                              const uint16_t** blocks) {
+  ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
+  if (bitmask_list.length == 0) {
+    fprintf(stderr, "Unable to write to file: invalid bitmask!\n");
+    return CCOS_EINVAL;
+  }
+
+  TRACE("Adding %d blocks to the file 0x%x", out_blocks_count - *blocks_count, file->header.file_id);
+  ccos_begin_bitmask_update(disk);
+  ccos_error_t err = ccos_add_sectors_to_file(disk, file, &bitmask_list, out_blocks_count - *blocks_count);
+  ccos_commit_bitmask_update(disk, &bitmask_list);
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to allocate more space for the file 0x%x!\n", file->header.file_id);
+    return err;
+  }
+
+  err = ccos_get_cached_file_sectors(disk, file, blocks_count, blocks);
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to get file blocks for the file id 0x%x!\n", file->header.file_id);
+  }
+
+  return err;
+}
+
+// Copy size bytes of src (or zeroes, if src is NULL) into the file contents at the given position.
+static ccos_error_t write_file_range(ccos_disk_t* disk, const ccos_inode_t* file, const uint16_t* blocks,
+                                     size_t blocks_count, size_t position, const uint8_t* src, size_t size) {
+  size_t log_block_size = ccos_get_log_sector_size(disk);
+  size_t written = 0;
+  while (written < size) {
+    size_t index = (position + written) / log_block_size;
+    if (index >= blocks_count) {
+      fprintf(stderr, "Unable to write data: file 0x%x is shorter than expected!\n", file->header.file_id);
+      return CCOS_EINVAL;
+    }
+
+    uint8_t* start = NULL;
+    size_t sector_size = 0;
+    ccos_error_t err = ccos_get_sector_data(disk, blocks[index], (const uint8_t**)&start, &sector_size);
+    if (err != CCOS_OK) {
+      fprintf(stderr, "Unable to write data: Unable to get target block address!\n");
+      return err;
+    }
+
+    size_t sector_offset = (position + written) % log_block_size;
+    size_t copy_size = size - written < sector_size - sector_offset ? size - written : sector_size - sector_offset;
+    if (src == NULL) {
+      memset(start + sector_offset, 0, copy_size);
+    } else {
+      memcpy(start + sector_offset, src + written, copy_size);
+    }
+    ccos_disk_mark_dirty(disk, start + sector_offset, copy_size);
+
+    written += copy_size;
+  }
+
+  return CCOS_OK;
+}
+
+static ccos_error_t add_dirty_sector(uint16_t** sectors, size_t* count, size_t* capacity, uint16_t sector) {
+  if (*count == *capacity) {
+    size_t new_capacity = *capacity == 0 ? 16 : *capacity * 2;
+    uint16_t* new_sectors = realloc(*sectors, new_capacity * sizeof(uint16_t));
+    if (new_sectors == NULL) {
+      return CCOS_ENOMEM;
+    }
+
+    *sectors = new_sectors;
+    *capacity = new_capacity;
+  }
+
+  (*sectors)[(*count)++] = sector;
+  return CCOS_OK;
+}
+
+static int compare_sectors(const void* a, const void* b) {
+  return (int)*(const uint16_t*)a - (int)*(const uint16_t*)b;
+}
+
+// Collect sectors changed by ccos_pwrite(): file data sectors [first_index, last_index], the inode if the file size was
+// changed, and, if sectors were allocated, all content inodes of the file and the image bitmask.
+static ccos_error_t get_pwrite_dirty_sectors(ccos_disk_t* disk, ccos_inode_t* file, const uint16_t* blocks,
+                                             size_t first_index, size_t last_index, bool size_changed, bool allocated,
+                                             uint16_t** dirty_sectors, size_t* dirty_count) {
+  uint16_t* sectors = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  ccos_error_t err = CCOS_OK;
+  for (size_t i = first_index; i <= last_index && err == CCOS_OK; ++i) {
+    err = add_dirty_sector(&sectors, &count, &capacity, blocks[i]);
+  }
+
+  if (err == CCOS_OK && (size_changed || allocated)) {
+    err = add_dirty_sector(&sectors, &count, &capacity, file->header.file_id);
+  }
+
+  if (allocated) {
+    uint16_t block = file->content_inode_info.block_next;
+    while (block != CCOS_INVALID_BLOCK && err == CCOS_OK) {
+      const ccos_content_inode_t* content_inode = ccos_disk_read(disk, block);
+      if (content_inode == NULL) {
+        break;
+      }
+
+      err = add_dirty_sector(&sectors, &count, &capacity, block);
+      block = content_inode->content_inode_info.block_next;
+    }
+
+    ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
+    for (size_t i = 0; i < bitmask_list.length && err == CCOS_OK; ++i) {
+      err = add_dirty_sector(&sectors, &count, &capacity, bitmask_list.bitmask_blocks[0]->header.file_id + i);
+    }
+  }
+
+  if (err != CCOS_OK) {
+    free(sectors);
+    return err;
+  }
+
+  qsort(sectors, count, sizeof(uint16_t), compare_sectors);
+  size_t unique = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (unique == 0 || sectors[unique - 1] != sectors[i]) {
+      sectors[unique++] = sectors[i];
+    }
+  }
+
+  *dirty_sectors = sectors;
+  *dirty_count = unique;
+  return CCOS_OK;
+}
+
+ccos_error_t ccos_pwrite(ccos_disk_t* disk, ccos_inode_t* file, size_t offset, const uint8_t* data, size_t len,
+                         uint16_t** dirty_sectors, size_t* dirty_count) {
+  ccos_error_t err = ccos_pwrite_unindexed(disk, file, offset, data, len, dirty_sectors, dirty_count);
+  if (disk != NULL && file != NULL && len > 0 && ccos_is_dir(file)) {
+    ccos_drop_image_names(disk);
+  }
+
+  return err;
+}
+
+ccos_error_t ccos_pwrite_unindexed(ccos_disk_t* disk, ccos_inode_t* file, size_t offset, const uint8_t* data,
+                                   size_t len, uint16_t** dirty_sectors, size_t* dirty_count) {
+  if (disk == NULL || file == NULL || (data == NULL && len > 0) || (dirty_sectors == NULL) != (dirty_count == NULL)) {
+    return CCOS_EINVAL;
+  }
+
+  if (dirty_sectors != NULL) {
+    *dirty_sectors = NULL;
+    *dirty_count = 0;
+  }
+
+  if (len == 0) {
+    return CCOS_OK;
+  }
+
+  ccos_invalidate_dir_cache(disk, file->header.file_id);
+
+  if (offset > UINT32_MAX || len > UINT32_MAX - offset) {
+    fprintf(stderr, "Unable to write to file 0x%x: file is too large!\n", file->header.file_id);
+    return CCOS_EINVAL;
+  }
+
+  size_t blocks_count = 0;
+  const uint16_t* blocks = NULL;
+  ccos_error_t err = ccos_get_cached_file_sectors(disk, file, &blocks_count, &blocks);
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to get file blocks for file id 0x%x!\n", file->header.file_id);
+    return err;
+  }
+
+  size_t log_block_size = ccos_get_log_sector_size(disk);
+  size_t file_size = get_file_data_size(file);
+  size_t end = offset + len;
+  size_t out_blocks_count = (end + log_block_size - 1) / log_block_size;
+  bool allocated = out_blocks_count > blocks_count;
+  if (allocated) {
+    err = grow_file(disk, file, out_blocks_count, &blocks_count, &blocks);
+    if (err != CCOS_OK) {
+      return err;
+    }
+  }
+
+  // Writing past the end of the file leaves a hole, which reads back as zeroes.
+  size_t first = offset;
+  if (offset > file_size) {
+    first = file_size;
+    err = write_file_range(disk, file, blocks, blocks_count, file_size, NULL, offset - file_size);
+    if (err != CCOS_OK) {
+      return err;
+    }
+  }
+
+  err = write_file_range(disk, file, blocks, blocks_count, offset, data, len);
+  if (err != CCOS_OK) {
+    return err;
+  }
+
+  bool size_changed = end > file_size;
+  if (size_changed) {
+    uint32_t new_size = end;
+    if (ccos_is_dir(file)) {
+      TRACE("Updating dir_length for %*s as well", file->desc.name_length, file->desc.name);
+      ccos_inode_write(disk, file, &file->desc.dir_length, &new_size, sizeof(new_size));
+    }
+    ccos_inode_write(disk, file, &file->desc.file_size, &new_size, sizeof(new_size));
+  }
+
+  if (dirty_sectors == NULL) {
+    return CCOS_OK;
+  }
+
+  return get_pwrite_dirty_sectors(disk, file, blocks, first / log_block_size, (end - 1) / log_block_size, size_changed,
+                                  allocated, dirty_sectors, dirty_count);
+}
+
+ccos_error_t ccos_truncate(ccos_disk_t* disk, ccos_inode_t* file, size_t new_size) {
+  ccos_error_t err = ccos_truncate_unindexed(disk, file, new_size);
+  if (disk != NULL && file != NULL && ccos_is_dir(file)) {
+    ccos_drop_image_names(disk);
+  }
+
+  return err;
+}
+
+ccos_error_t ccos_truncate_unindexed(ccos_disk_t* disk, ccos_inode_t* file, size_t new_size) {
+  if (disk == NULL || file == NULL) {
+    return CCOS_EINVAL;
+  }
+
+  ccos_invalidate_dir_cache(disk, file->header.file_id);
+
+  if (new_size > UINT32_MAX) {
+    fprintf(stderr, "Unable to resize file 0x%x: file is too large!\n", file->header.file_id);
+    return CCOS_EINVAL;
+  }
+
+  size_t blocks_count = 0;
+  const uint16_t* blocks = NULL;
+  ccos_error_t err = ccos_get_cached_file_sectors(disk, file, &blocks_count, &blocks);
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to get file blocks for file id 0x%x!\n", file->header.file_id);
+    return err;
+  }
+
+  size_t log_block_size = ccos_get_log_sector_size(disk);
+  size_t file_size = get_file_data_size(file);
+  size_t out_blocks_count = (new_size + log_block_size - 1) / log_block_size;
+  if (out_blocks_count > blocks_count) {
+    err = grow_file(disk, file, out_blocks_count, &blocks_count, &blocks);
+  } else if (out_blocks_count < blocks_count) {
+    ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
+    if (bitmask_list.length == 0) {
+      fprintf(stderr, "Unable to resize file: invalid bitmask!\n");
+      return CCOS_EINVAL;
+    }
+
+    err = ccos_remove_sectors_from_file(disk, file, &bitmask_list, blocks_count - out_blocks_count);
+  }
+
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to resize file 0x%x to " SIZE_T " bytes!\n", file->header.file_id, new_size);
+    return err;
+  }
+
+  if (new_size > file_size) {
+    err = write_file_range(disk, file, blocks, blocks_count, file_size, NULL, new_size - file_size);
+    if (err != CCOS_OK) {
+      return err;
+    }
+  }
+
+  if (new_size != file->desc.file_size || (ccos_is_dir(file) && new_size != file->desc.dir_length)) {
+    uint32_t size = new_size;
+    if (ccos_is_dir(file)) {
+      TRACE("Updating dir_length for %*s as well", file->desc.name_length, file->desc.name);
+      ccos_inode_write(disk, file, &file->desc.dir_length, &size, sizeof(size));
+    }
+    ccos_inode_write(disk, file, &file->desc.file_size, &size, sizeof(size));
+  }
+
+  return CCOS_OK;
+}
+
+static ccos_error_t resize_file(ccos_disk_t* disk, ccos_inode_t* file, ccos_bitmask_list_t* bitmask_list,
+                                size_t blocks_count, size_t out_blocks_count) {
+  if (out_blocks_count > blocks_count) {
+    TRACE("Adding %d blocks to the file", out_blocks_count - blocks_count);
+
+    ccos_error_t err = ccos_add_sectors_to_file(disk, file, bitmask_list, out_blocks_count - blocks_count);
+    if (err != CCOS_OK) {
+      fprintf(stderr, "Unable to allocate more space for the file 0x%x!\n", file->header.file_id);
+      return err;
+    }
+
+    TRACE("Done writing file.");
+  } else if (out_blocks_count < blocks_count) {
+    TRACE("Removing %d blocks from the file", blocks_count - out_blocks_count);
+    ccos_error_t err = ccos_remove_sectors_from_file(disk, file, bitmask_list, blocks_count - out_blocks_count);
+    if (err != CCOS_OK) {
+      fprintf(stderr, "Unable to remove blocks from file at 0x%x!\n", file->header.file_id);
+      return err;
+    }
+  }
 
   return CCOS_OK;
 }
 
 ccos_error_t ccos_write_file(ccos_disk_t* disk, ccos_inode_t* file, const uint8_t* file_data, size_t file_size) {
+  ccos_error_t err = ccos_write_file_unindexed(disk, file, file_data, file_size);
+  if (disk != NULL && file != NULL && ccos_is_dir(file)) {
+    ccos_drop_image_names(disk);
+  }
+
+  return err;
+}
+
+ccos_error_t ccos_write_file_unindexed(ccos_disk_t* disk, ccos_inode_t* file, const uint8_t* file_data,
+                                       size_t file_size) {
   if (disk == NULL || file == NULL || (file_data == NULL && file_size > 0)) {
     return CCOS_EINVAL;
   }
 
+  ccos_invalidate_dir_cache(disk, file->header.file_id);
+
   size_t blocks_count = 0;
-  uint16_t* blocks = NULL;
+  const uint16_t* blocks = NULL;
 
-  ccos_error_t err = ccos_get_file_sectors(disk, file, &blocks_count, &blocks);
+  ccos_error_t err = ccos_get_cached_file_sectors(disk, file, &blocks_count, &blocks);
   if (err != CCOS_OK) {
     fprintf(stderr, "Unable to get file blocks for file id 0x%x!\n", file->header.file_id);
     return err;
   }
 
-  free(blocks);
-
   ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
   if (bitmask_list.length == 0) {
     fprintf(stderr, "Unable to write to file: invalid bitmask!\n");
@@ -299,31 +715,15 @@ ccos_error_t ccos_write_file(ccos_disk_t* disk, ccos_inode_t* file, const uint8_
   if (out_blocks_count != blocks_count) {
     TRACE("But should contain %d", out_blocks_count);
   }
-  if (out_blocks_count > blocks_count) {
-    TRACE("Adding %d blocks to the file", out_blocks_count - blocks_count);
 
-    for (int i = 0; i < (out_blocks_count - blocks_count); ++i) {
-      TRACE("Adding %d / %d...", i + 1, (out_blocks_count - blocks_count));
-      if (ccos_add_sector_to_file(disk, file, &bitmask_list) == CCOS_INVALID_BLOCK) {
-        fprintf(stderr, "Unable to allocate more space for the file 0x%x: no space left!\n", file->header.file_id);
-        return CCOS_ENOSPC;
-      }
-    }
-
-    TRACE("Done writing file.");
-  } else if (out_blocks_count < blocks_count) {
-    TRACE("Removing %d blocks from the file", blocks_count - out_blocks_count);
-    for (int i = 0; i < (blocks_count - out_blocks_count); ++i) {
-      TRACE("Remove %d / %d...", i + 1, (blocks_count - out_blocks_count));
-      err = ccos_remove_sector_from_file(disk, file, &bitmask_list);
-      if (err != CCOS_OK) {
-        fprintf(stderr, "Unable to remove block from file at 0x%x!\n", file->header.file_id);
-        return err;
-      }
-    }
+  ccos_begin_bitmask_update(disk);
+  err = resize_file(disk, file, &bitmask_list, blocks_count, out_blocks_count);
+  ccos_commit_bitmask_update(disk, &bitmask_list);
+  if (err != CCOS_OK) {
+    return err;
   }
 
-  err = ccos_get_file_sectors(disk, file, &blocks_count, &blocks);
+  err = ccos_get_cached_file_sectors(disk, file, &blocks_count, &blocks);
   if (err != CCOS_OK) {
     fprintf(stderr, "Unable to get file blocks for the file id 0x%x!\n", file->header.file_id);
     return err;
@@ -336,12 +736,12 @@ ccos_error_t ccos_write_file(ccos_disk_t* disk, ccos_inode_t* file, const uint8_
     err = ccos_get_sector_data(disk, blocks[i], (const uint8_t**)&start, &data_size);
     if (err != CCOS_OK) {
       fprintf(stderr, "Unable to write data: Unable to get target block address!\n");
-      free(blocks);
       return err;
     }
 
     size_t copy_size = MIN(file_size - written, data_size);
     memcpy(start, &(file_data[written]), copy_size);
+    ccos_disk_mark_dirty(disk, start, copy_size);
     written += copy_size;
   }
 
@@ -350,14 +750,12 @@ ccos_error_t ccos_write_file(ccos_disk_t* disk, ccos_inode_t* file, const uint8_
             written, file->header.file_id);
   }
 
-  free(blocks);
-
+  uint32_t new_size = written;
   if (ccos_is_dir(file)) {
     TRACE("Updating dir_length for %*s as well", file->desc.name_length, file->desc.name);
-    file->desc.dir_length = written;
+    ccos_inode_write(disk, file, &file->desc.dir_length, &new_size, sizeof(new_size));
   }
-  file->desc.file_size = written;
-  ccos_update_inode_checksums(disk, file);
+  ccos_inode_write(disk, file, &file->desc.file_size, &new_size, sizeof(new_size));
   return CCOS_OK;
 }
 
@@ -371,13 +769,12 @@ ccos_error_t ccos_copy_file(ccos_disk_t* src, ccos_inode_t* src_file,
     return CCOS_EINVAL;
   }
 
-  uint16_t free_block = ccos_get_free_sector(dest, &dest_bitmask_list);
+  uint16_t free_block = ccos_allocate_sector(dest, &dest_bitmask_list);
   if (free_block == CCOS_INVALID_BLOCK) {
     fprintf(stderr, "Unable to copy file: no space left!\n");
     return CCOS_ENOSPC;
   }
 
-  ccos_mark_sector(dest, &dest_bitmask_list, free_block, 1);
   ccos_inode_t* new_file = ccos_init_inode(dest, free_block, dest_directory->header.file_id);
 
   uint8_t* file_data = NULL;
@@ -392,6 +789,7 @@ ccos_error_t ccos_copy_file(ccos_disk_t* src, ccos_inode_t* src_file,
   TRACE("Copying file info over...");
   memcpy(&(new_file->desc.file_size), &(src_file->desc.file_size),
          offsetof(ccos_inode_t, content_inode_info) - (offsetof(ccos_inode_t, desc) + offsetof(ccos_inode_desc_t, file_size)));
+  ccos_update_inode_checksums(dest, new_file);
 
   TRACE("Writing file 0x%lx", new_file->header.file_id);
   err = ccos_write_file(dest, new_file, file_data, file_size);
@@ -405,29 +803,118 @@ ccos_error_t ccos_copy_file(ccos_disk_t* src, ccos_inode_t* src_file,
   if (err != CCOS_OK) {
     fprintf(stderr, "Unable to copy file: unable to add new file with id 0x%x to the directory with id 0x%x!\n",
             new_file->header.file_id, dest_directory->header.file_id);
+    return err;
+  }
+
+  ccos_add_image_names(dest, dest_directory, &new_file, 1);
+  return CCOS_OK;
+}
+
+// Free all content blocks, content inodes and the inode of the file.
+static ccos_error_t release_file_sectors(ccos_disk_t* disk, ccos_inode_t* file, ccos_bitmask_list_t* bitmask_list) {
+  ccos_remove_image_name(disk, file);
+  ccos_error_t err = ccos_remove_sectors_from_file(disk, file, bitmask_list, SIZE_MAX);
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to free blocks of file %*s (0x%x)!\n", file->desc.name_length, file->desc.name,
+            file->header.file_id);
+    return err;
+  }
+
+  ccos_erase_sector(disk, file->header.file_id, bitmask_list);
+
+  return CCOS_OK;
+}
+
+static int compare_file_ids(const void* a, const void* b) {
+  return (int)*(const uint16_t*)a - (int)*(const uint16_t*)b;
+}
+
+static int compare_files_by_parent(const void* a, const void* b) {
+  const ccos_inode_t* first = *(ccos_inode_t* const*)a;
+  const ccos_inode_t* second = *(ccos_inode_t* const*)b;
+  if (first->desc.dir_file_id != second->desc.dir_file_id) {
+    return (int)first->desc.dir_file_id - (int)second->desc.dir_file_id;
+  }
+
+  return (int)first->header.file_id - (int)second->header.file_id;
+}
+
+// Files inside the deleted directories go away together with them.
+static bool has_deleted_ancestor(ccos_disk_t* disk, const ccos_inode_t* file, const uint16_t* ids, size_t count) {
+  uint16_t root = ccos_disk_superblock(disk);
+  uint16_t parent = file->desc.dir_file_id;
+  for (size_t depth = 0; parent != root && depth < UINT16_MAX; ++depth) {
+    if (bsearch(&parent, ids, count, sizeof(uint16_t), compare_file_ids) != NULL) {
+      return true;
+    }
+
+    const ccos_inode_t* dir = ccos_disk_read(disk, parent);
+    if (dir == NULL) {
+      break;
+    }
+
+    parent = dir->desc.dir_file_id;
+  }
+
+  return false;
+}
+
+// Free sectors of all the files in the directory subtree. The directories are deleted as well, so their contents are
+// left as is instead of removing the entries one by one.
+static ccos_error_t release_dir_contents(ccos_disk_t* disk, ccos_inode_t* dir, ccos_bitmask_list_t* bitmask_list) {
+  TRACE("Recursively deleting files in the directory %*s (0x%x)", dir->desc.name_length, dir->desc.name,
+        dir->header.file_id);
+  uint16_t files = 0;
+  ccos_inode_t** content = NULL;
+  ccos_error_t err = ccos_get_dir_contents(disk, dir, &files, &content);
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to delete directory contents: Unable to read directory 0x%x!\n", dir->header.file_id);
+    return err;
+  }
+
+  for (uint16_t i = 0; i < files && err == CCOS_OK; ++i) {
+    ccos_inode_t* file = content[i];
+    // Entries which point outside of the image or to other directory files have no inode of their own to delete.
+    if (file == NULL || file->desc.dir_file_id != dir->header.file_id) {
+      continue;
+    }
+
+    if (ccos_is_dir(file)) {
+      err = release_dir_contents(disk, file, bitmask_list);
+    }
+
+    if (err == CCOS_OK) {
+      err = release_file_sectors(disk, file, bitmask_list);
+    }
   }
+
+  free(content);
   return err;
 }
 
-// - Find parent directory
-//    - Remove filename from its contents
+// - Group files by parent directory
+// - For every parent directory
+//    - Remove filenames from its contents
 //    - Reduce directory size
 //    - Reduce directory entry count
 //    - Update directory checksums
 // - Find all file blocks; clear them and mark as free
 // - Clear all file content inode blocks and mark as free
-ccos_error_t ccos_delete_file(ccos_disk_t* disk, ccos_inode_t* file) {
-  if (ccos_is_dir(file)) {
-    TRACE("Recursively deleting files in the directory %*s (0x%x)", file->desc.name_length, file->desc.name,
-          file->header.file_id);
-    uint16_t files = 0;
-    ccos_inode_t** content = NULL;
-    // TODO: Handle errors.
-    ccos_get_dir_contents(disk, file, &files, &content);
-    for (int c = 0; c < files; c++) {
-      ccos_delete_file(disk, content[c]);
+// - Do the same for all the files in the deleted directories, leaving the directory contents as they are
+ccos_error_t ccos_delete_files(ccos_disk_t* disk, ccos_inode_t** files, size_t count) {
+  if (disk == NULL || (files == NULL && count > 0)) {
+    return CCOS_EINVAL;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    if (files[i] == NULL || ccos_is_root_dir(files[i])) {
+      fprintf(stderr, "Unable to delete file: Invalid file!\n");
+      return CCOS_EINVAL;
     }
-    free(content);
+  }
+
+  if (count == 0) {
+    return CCOS_OK;
   }
 
   ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
@@ -436,88 +923,108 @@ ccos_error_t ccos_delete_file(ccos_disk_t* disk, ccos_inode_t* file) {
     return CCOS_EINVAL;
   }
 
-  ccos_error_t err = ccos_delete_file_from_parent_dir(disk, file);
-  if (err != CCOS_OK) {
-    fprintf(stderr, "Unable to delete file: Unable to delete file entry from parent dir!\n");
-    return err;
+  uint16_t* ids = calloc(count, sizeof(uint16_t));
+  ccos_inode_t** victims = calloc(count, sizeof(ccos_inode_t*));
+  if (ids == NULL || victims == NULL) {
+    fprintf(stderr, "Unable to delete files: %s!\n", strerror(errno));
+    free(victims);
+    free(ids);
+    return CCOS_ENOMEM;
   }
 
-  size_t blocks_count = 0;
-  uint16_t* blocks = NULL;
-  err = ccos_get_file_sectors(disk, file, &blocks_count, &blocks);
-  if (err != CCOS_OK) {
-    fprintf(stderr, "Unable to read file blocks of file %*s (0x%x)!\n", file->desc.name_length, file->desc.name,
-            file->header.file_id);
-    return err;
+  for (size_t i = 0; i < count; ++i) {
+    ids[i] = files[i]->header.file_id;
   }
 
-  for (int j = 0; j < blocks_count; ++j) {
-    ccos_erase_sector(disk, blocks[j], &bitmask_list);
+  qsort(ids, count, sizeof(uint16_t), compare_file_ids);
+
+  size_t victims_count = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (!has_deleted_ancestor(disk, files[i], ids, count)) {
+      victims[victims_count++] = files[i];
+    }
   }
-  free(blocks);
 
-  while (file->content_inode_info.block_next != CCOS_INVALID_BLOCK) {
-    err = ccos_remove_content_inode(disk, file, &bitmask_list);
-    if (err != CCOS_OK) {
-      fprintf(stderr, "Unable to remove content block from the file %*s (0x%x)!\n", file->desc.name_length, file->desc.name,
-              file->header.file_id);
-      return err;
+  qsort(victims, victims_count, sizeof(ccos_inode_t*), compare_files_by_parent);
+  size_t unique_count = 0;
+  for (size_t i = 0; i < victims_count; ++i) {
+    if (unique_count == 0 || victims[unique_count - 1] != victims[i]) {
+      victims[unique_count++] = victims[i];
     }
   }
 
-  ccos_erase_sector(disk, file->header.file_id, &bitmask_list);
+  ccos_begin_bitmask_update(disk);
 
-  return CCOS_OK;
-}
+  ccos_error_t err = CCOS_OK;
+  for (size_t start = 0, end = 0; start < unique_count && err == CCOS_OK; start = end) {
+    uint16_t dir_id = victims[start]->desc.dir_file_id;
+    while (end < unique_count && victims[end]->desc.dir_file_id == dir_id) {
+      end++;
+    }
 
-static void erase_unlinked_file(ccos_disk_t* disk, ccos_inode_t* file, ccos_bitmask_list_t* bitmask_list) {
-  size_t blocks_count = 0;
-  uint16_t* blocks = NULL;
+    err = ccos_delete_files_from_dir(disk, ccos_get_parent_dir(disk, victims[start]), &victims[start], end - start);
+    if (err != CCOS_OK) {
+      fprintf(stderr, "Unable to delete file: Unable to delete file entry from parent dir!\n");
+      break;
+    }
 
-  if (ccos_get_file_sectors(disk, file, &blocks_count, &blocks) == CCOS_OK) {
-    for (int i = 0; i < blocks_count; ++i) {
-      ccos_erase_sector(disk, blocks[i], bitmask_list);
+    for (size_t i = start; i < end && err == CCOS_OK; ++i) {
+      if (ccos_is_dir(victims[i])) {
+        err = release_dir_contents(disk, victims[i], &bitmask_list);
+      }
+
+      if (err == CCOS_OK) {
+        err = release_file_sectors(disk, victims[i], &bitmask_list);
+      }
     }
-    free(blocks);
   }
 
-  while (file->content_inode_info.block_next != CCOS_INVALID_BLOCK) {
-    if (ccos_remove_content_inode(disk, file, bitmask_list) != CCOS_OK) {
-      break;
-    }
+  ccos_commit_bitmask_update(disk, &bitmask_list);
+  if (err != CCOS_OK) {
+    ccos_drop_image_names(disk);
   }
 
+  free(victims);
+  free(ids);
+  return err;
+}
+
+ccos_error_t ccos_delete_file(ccos_disk_t* disk, ccos_inode_t* file) {
+  return ccos_delete_files(disk, &file, 1);
+}
+
+static void erase_unlinked_file(ccos_disk_t* disk, ccos_inode_t* file, ccos_bitmask_list_t* bitmask_list) {
+  ccos_remove_sectors_from_file(disk, file, bitmask_list, SIZE_MAX);
   ccos_erase_sector(disk, file->header.file_id, bitmask_list);
 }
 
-ccos_inode_t* ccos_add_file(ccos_disk_t* disk, ccos_inode_t* dest_directory,
-                            uint8_t* file_data, size_t file_size, const char* file_name) {
-  if (disk == NULL || dest_directory == NULL || file_name == NULL || (file_data == NULL && file_size > 0)) {
-    return NULL;
+ccos_error_t ccos_file_writer_open(ccos_disk_t* disk, ccos_inode_t* dest_directory, const char* file_name,
+                                   ccos_file_writer_t* writer) {
+  if (disk == NULL || dest_directory == NULL || file_name == NULL || writer == NULL) {
+    return CCOS_EINVAL;
   }
 
   size_t file_name_length = strlen(file_name);
   if (file_name_length == 0 || file_name_length > CCOS_MAX_FILE_NAME) {
     fprintf(stderr, "Unable to add file: invalid file name length!\n");
-    return NULL;
+    return CCOS_EINVAL;
   }
 
   ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
   if (bitmask_list.length == 0) {
     fprintf(stderr, "Unable to add file: Unable to find bitmask in the image!\n");
-    return NULL;
+    return CCOS_EINVAL;
   }
 
   uint16_t free_block = CCOS_INVALID_BLOCK;
-  if ((free_block = ccos_get_free_sector(disk, &bitmask_list)) == CCOS_INVALID_BLOCK) {
+  if ((free_block = ccos_allocate_sector(disk, &bitmask_list)) == CCOS_INVALID_BLOCK) {
     fprintf(stderr, "Unable to get free block: No space left!\n");
-    return NULL;
+    return CCOS_ENOSPC;
   }
 
-  ccos_mark_sector(disk, &bitmask_list, free_block, 1);
   ccos_inode_t* new_file = ccos_init_inode(disk, free_block, dest_directory->header.file_id);
 
-  new_file->desc.file_size = file_size;
+  new_file->desc.file_size = 0;
   new_file->desc.dir_file_id = dest_directory->header.file_id;
   new_file->desc.name_length = file_name_length;
   memcpy(new_file->desc.name, file_name, file_name_length);
@@ -525,24 +1032,188 @@ ccos_inode_t* ccos_add_file(ccos_disk_t* disk, ccos_inode_t* dest_directory,
   new_file->desc.creation_date = ccos_get_datetime();
   new_file->desc.mod_date = new_file->desc.creation_date;
   new_file->desc.expiration_date = (ccos_date_t){};
+  ccos_update_inode_checksums(disk, new_file);
 
-  TRACE("Writing file 0x%lx", new_file->header.file_id);
-  if (ccos_write_file(disk, new_file, file_data, file_size) != CCOS_OK) {
-    fprintf(stderr, "Unable to write file to file with id 0x%x!\n", new_file->header.file_id);
-    erase_unlinked_file(disk, new_file, &bitmask_list);
-    return NULL;
+  *writer = (ccos_file_writer_t){.disk = disk, .directory = dest_directory, .file = new_file, .size = 0};
+  return CCOS_OK;
+}
+
+ccos_error_t ccos_file_writer_append(ccos_file_writer_t* writer, const uint8_t* data, size_t size) {
+  if (writer == NULL || writer->file == NULL || (data == NULL && size > 0)) {
+    return CCOS_EINVAL;
+  }
+
+  if (size == 0) {
+    return CCOS_OK;
+  }
+
+  ccos_disk_t* disk = writer->disk;
+  ccos_inode_t* file = writer->file;
+  if (size > UINT32_MAX - writer->size) {
+    fprintf(stderr, "Unable to write to file 0x%x: file is too large!\n", file->header.file_id);
+    return CCOS_EINVAL;
+  }
+
+  size_t blocks_count = 0;
+  const uint16_t* blocks = NULL;
+  ccos_error_t err = ccos_get_cached_file_sectors(disk, file, &blocks_count, &blocks);
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to get file blocks for file id 0x%x!\n", file->header.file_id);
+    return err;
+  }
+
+  size_t log_block_size = ccos_get_log_sector_size(disk);
+  size_t out_blocks_count = (writer->size + size + log_block_size - 1) / log_block_size;
+  if (out_blocks_count > blocks_count) {
+    err = grow_file(disk, file, out_blocks_count, &blocks_count, &blocks);
+    if (err != CCOS_OK) {
+      return err;
+    }
+  }
+
+  err = write_file_range(disk, file, blocks, blocks_count, writer->size, data, size);
+  if (err != CCOS_OK) {
+    return err;
+  }
+
+  writer->size += size;
+  return CCOS_OK;
+}
+
+static void write_writer_file_size(ccos_file_writer_t* writer) {
+  uint32_t new_size = writer->size;
+  ccos_inode_write(writer->disk, writer->file, &writer->file->desc.file_size, &new_size, sizeof(new_size));
+}
+
+ccos_error_t ccos_file_writer_close(ccos_file_writer_t* writer, ccos_inode_t** file) {
+  if (writer == NULL || writer->file == NULL) {
+    return CCOS_EINVAL;
   }
 
-  if (ccos_add_file_to_directory(disk, dest_directory, new_file) != CCOS_OK) {
+  ccos_disk_t* disk = writer->disk;
+  ccos_inode_t* new_file = writer->file;
+  write_writer_file_size(writer);
+
+  ccos_error_t err = ccos_add_file_to_directory(disk, writer->directory, new_file);
+  if (err != CCOS_OK) {
     fprintf(stderr, "Unable to copy file: unable to add new file with id 0x%x to the directory with id 0x%x!\n",
-            new_file->header.file_id, dest_directory->header.file_id);
-    erase_unlinked_file(disk, new_file, &bitmask_list);
+            new_file->header.file_id, writer->directory->header.file_id);
+    ccos_file_writer_abort(writer);
+    return err;
+  }
+
+  ccos_add_image_names(disk, writer->directory, &new_file, 1);
+  writer->file = NULL;
+  if (file != NULL) {
+    *file = new_file;
+  }
+
+  return CCOS_OK;
+}
+
+void ccos_file_writer_abort(ccos_file_writer_t* writer) {
+  if (writer == NULL || writer->file == NULL) {
+    return;
+  }
+
+  ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(writer->disk);
+  if (bitmask_list.length != 0) {
+    erase_unlinked_file(writer->disk, writer->file, &bitmask_list);
+  }
+
+  writer->file = NULL;
+}
+
+ccos_inode_t* ccos_add_file(ccos_disk_t* disk, ccos_inode_t* dest_directory,
+                            uint8_t* file_data, size_t file_size, const char* file_name) {
+  if (file_data == NULL && file_size > 0) {
+    return NULL;
+  }
+
+  ccos_file_writer_t writer = {0};
+  if (ccos_file_writer_open(disk, dest_directory, file_name, &writer) != CCOS_OK) {
+    return NULL;
+  }
+
+  TRACE("Writing file 0x%lx", writer.file->header.file_id);
+  if (ccos_file_writer_append(&writer, file_data, file_size) != CCOS_OK) {
+    fprintf(stderr, "Unable to write file to file with id 0x%x!\n", writer.file->header.file_id);
+    ccos_file_writer_abort(&writer);
+    return NULL;
+  }
+
+  ccos_inode_t* new_file = NULL;
+  if (ccos_file_writer_close(&writer, &new_file) != CCOS_OK) {
     return NULL;
   }
 
   return new_file;
 }
 
+ccos_error_t ccos_add_files(ccos_disk_t* disk, ccos_inode_t* dest_directory, const ccos_new_file_t* files,
+                            size_t count, ccos_inode_t** new_files) {
+  if (disk == NULL || dest_directory == NULL || (files == NULL && count > 0)) {
+    return CCOS_EINVAL;
+  }
+
+  if (count == 0) {
+    return CCOS_OK;
+  }
+
+  ccos_file_writer_t* writers = calloc(count, sizeof(ccos_file_writer_t));
+  ccos_inode_t** inodes = calloc(count, sizeof(ccos_inode_t*));
+  if (writers == NULL || inodes == NULL) {
+    fprintf(stderr, "Unable to add files: %s!\n", strerror(errno));
+    free(inodes);
+    free(writers);
+    return CCOS_ENOMEM;
+  }
+
+  ccos_error_t err = CCOS_OK;
+  size_t opened = 0;
+  for (; opened < count; ++opened) {
+    if (files[opened].data == NULL && files[opened].size > 0) {
+      err = CCOS_EINVAL;
+      break;
+    }
+
+    err = ccos_file_writer_open(disk, dest_directory, files[opened].name, &writers[opened]);
+    if (err != CCOS_OK) {
+      break;
+    }
+
+    err = ccos_file_writer_append(&writers[opened], files[opened].data, files[opened].size);
+    if (err != CCOS_OK) {
+      fprintf(stderr, "Unable to write file to file with id 0x%x!\n", writers[opened].file->header.file_id);
+      ccos_file_writer_abort(&writers[opened]);
+      break;
+    }
+
+    write_writer_file_size(&writers[opened]);
+    inodes[opened] = writers[opened].file;
+  }
+
+  if (err == CCOS_OK) {
+    err = ccos_add_files_to_directory(disk, dest_directory, inodes, count);
+  }
+
+  if (err == CCOS_OK) {
+    ccos_add_image_names(disk, dest_directory, inodes, count);
+  }
+
+  for (size_t i = 0; i < opened; ++i) {
+    if (err != CCOS_OK) {
+      ccos_file_writer_abort(&writers[i]);
+    } else if (new_files != NULL) {
+      new_files[i] = inodes[i];
+    }
+  }
+
+  free(inodes);
+  free(writers);
+  return err;
+}
+
 ccos_inode_t* ccos_get_root_dir(ccos_disk_t* disk) {
   ccos_inode_t* root = ccos_disk_read(disk, ccos_disk_superblock(disk));
   if (root == NULL) {
@@ -580,7 +1251,15 @@ ccos_error_t ccos_calc_free_space(ccos_disk_t* disk, size_t* free_space) {
     return CCOS_ENOENT;
   }
 
-  ccos_error_t err = ccos_get_free_sectors_count(disk, &bitmask_list, &free_blocks_count);
+  size_t allocated_count = 0;
+  ccos_error_t err = ccos_get_allocated_sectors_count(disk, &bitmask_list, &allocated_count);
+  if (err == CCOS_OK) {
+    free_blocks_count = ccos_disk_size(disk) / ccos_disk_sector_size(disk) - allocated_count;
+  } else if (err == CCOS_EINVAL) {
+    fprintf(stderr, "Warn: bitmask allocated count is out of range, counting free blocks in the bitmap!\n");
+    err = ccos_get_free_sectors_count(disk, &bitmask_list, &free_blocks_count);
+  }
+
   if (err != CCOS_OK) {
     fprintf(stderr, "Unable to calculate free space: Unable to get free blocks!\n");
     return err;
@@ -590,6 +1269,28 @@ ccos_error_t ccos_calc_free_space(ccos_disk_t* disk, size_t* free_space) {
   return CCOS_OK;
 }
 
+ccos_error_t ccos_verify_free_space(ccos_disk_t* disk, bool repair, size_t* free_space) {
+  size_t free_blocks_count = 0;
+
+  ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
+  if (bitmask_list.length == 0) {
+    fprintf(stderr, "Unable to verify free space on the image: Unable to find bitmask!\n");
+    return CCOS_ENOENT;
+  }
+
+  ccos_error_t err = ccos_reconcile_allocated_count(disk, &bitmask_list, repair, &free_blocks_count);
+  if (err != CCOS_OK && err != CCOS_EINVAL) {
+    fprintf(stderr, "Unable to verify free space: Unable to get free blocks!\n");
+    return err;
+  }
+
+  if (free_space != NULL) {
+    *free_space = free_blocks_count * ccos_disk_sector_size(disk);
+  }
+
+  return err;
+}
+
 ccos_inode_t* ccos_get_parent_dir(ccos_disk_t* disk, ccos_inode_t* file) {
   return ccos_disk_read(disk, file->desc.dir_file_id);
 }
@@ -669,27 +1370,15 @@ ccos_error_t ccos_rename_file(ccos_disk_t* disk, ccos_inode_t* file, const char*
     return CCOS_EINVAL;
   }
 
-  ccos_inode_t* parent_dir = ccos_get_parent_dir(disk, file);
-
-  ccos_error_t err = ccos_delete_file_from_parent_dir(disk, file);
-  if (err != CCOS_OK) {
-    fprintf(stderr, "Unable to rename file: Unable to delete old file entry from parent dir!\n");
-    return err;
-  }
-
-  memset(file->desc.name, 0, CCOS_MAX_FILE_NAME);
-
-  if (new_type != NULL) {
-    snprintf(file->desc.name, CCOS_MAX_FILE_NAME, "%s~%s~", new_name, new_type);
-  } else {
-    snprintf(file->desc.name, CCOS_MAX_FILE_NAME, "%s~%s~", new_name, type);
-  }
-
-  file->desc.name_length = strlen(file->desc.name);
+  char full_name[CCOS_MAX_FILE_NAME] = {0};
+  snprintf(full_name, CCOS_MAX_FILE_NAME, "%s~%s~", new_name, new_type != NULL ? new_type : type);
 
-  err = ccos_add_file_to_directory(disk, parent_dir, file);
+  // Index the file again even if renaming failed, as the name might be changed anyway.
+  ccos_remove_image_name(disk, file);
+  ccos_error_t err = ccos_rename_file_in_parent_dir(disk, file, full_name, strlen(full_name));
+  ccos_add_image_names(disk, ccos_get_parent_dir(disk, file), &file, 1);
   if (err != CCOS_OK) {
-    fprintf(stderr, "Unable to rename file: Unable to add new file entry from parent dir!\n");
+    fprintf(stderr, "Unable to rename file: Unable to update file entry in parent dir!\n");
     return err;
   }
 
@@ -9,6 +9,7 @@ extern "C" {
 #include "ccos_structure.h"
 #include "ccos_string.h"
 
+#include <stdbool.h>
 #include <stdio.h>
 
 typedef enum { CCOS_SECTOR_UNKNOWN, CCOS_SECTOR_DATA, CCOS_SECTOR_EMPTY } ccos_sector_type_t;
@@ -92,6 +93,39 @@ ccos_error_t ccos_get_dir_contents(ccos_disk_t* disk, ccos_inode_t* dir, uint16_
  */
 ccos_error_t ccos_find_file_by_name(ccos_disk_t* disk, ccos_inode_t* dir, const char* file_name, ccos_inode_t** file);
 
+/**
+ * @brief      Find all the files in the image with the given full name, case-insensitively.
+ *
+ * Uses the image-wide name index, which is built with a single pass over all the directories on the first call and
+ * then kept up to date by the functions adding, deleting and renaming files. Writing directory contents with
+ * ccos_write_file(), ccos_pwrite(), ccos_truncate() or ccos_replace_file() drops the index, so it's rebuilt on the next
+ * call. Changes made to the image data directly are not tracked.
+ *
+ * @param[in]  disk       Compass disk image.
+ * @param[in]  file_name  Full file name, including type markers (e.g. Demo~Text~).
+ * @param      files      Found files in the depth-first order of the image, directories go before their contents.
+ *                        Should be free()-d by the caller.
+ * @param      count      Number of found files.
+ *
+ * @return     CCOS_OK on success, CCOS_ENOENT if not found, error code otherwise.
+ */
+ccos_error_t ccos_find_files_by_name(ccos_disk_t* disk, const char* file_name, ccos_inode_t*** files, size_t* count);
+
+/**
+ * @brief      Find file by its path from the root directory, e.g. "Programs~Subject~/Demo~Text~".
+ *
+ * Path components are separated by '/' following the closing type marker, so file names containing '/' (e.g.
+ * "Diablo630SerialETX/ACK~Printer~") are not split. Every component is looked up in its parent directory the same
+ * way as in ccos_find_file_by_name().
+ *
+ * @param[in]  disk  Compass disk image.
+ * @param[in]  path  Path to the file.
+ * @param      file  Found file inode.
+ *
+ * @return     CCOS_OK on success, CCOS_ENOENT if not found, error code otherwise.
+ */
+ccos_error_t ccos_lookup_path(ccos_disk_t* disk, const char* path, ccos_inode_t** file);
+
 /**
  * @brief      Determine whether the given inode is a directory's inode.
  *
@@ -153,6 +187,40 @@ ccos_date_t ccos_get_datetime(void);
  */
 ccos_error_t ccos_replace_file(ccos_disk_t* disk, ccos_inode_t* file, const uint8_t* file_data, uint32_t file_size);
 
+// Position of a file span iterator. Fields are private to the library.
+typedef struct {
+  ccos_disk_t* disk;
+  ccos_inode_t* file;
+  size_t index;                // next content block of the file to visit
+  size_t remaining;            // file bytes not visited yet
+} ccos_file_span_iterator_t;
+
+/**
+ * @brief      Start iterating over file contents without copying them.
+ *
+ * File contents are visited as spans of sector payloads inside the image data, in file order; the last span is clipped
+ * to the file size (dir_length for directories). Spans point into the image and stay valid while the file isn't
+ * modified.
+ *
+ * @param[in]  disk  Compass disk image.
+ * @param[in]  file  File to read.
+ * @param[out] it    Iterator to initialize.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_file_spans_begin(ccos_disk_t* disk, ccos_inode_t* file, ccos_file_span_iterator_t* it);
+
+/**
+ * @brief      Get next span of the file contents.
+ *
+ * @param      it    Iterator started with ccos_file_spans_begin().
+ * @param[out] data  Pointer to the span data inside the image.
+ * @param[out] size  Span size in bytes, 0 when the whole file is visited.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_file_spans_next(ccos_file_span_iterator_t* it, const uint8_t** data, size_t* size);
+
 /**
  * @brief      Read file contents into memory buffer.
  *
@@ -165,6 +233,58 @@ ccos_error_t ccos_replace_file(ccos_disk_t* disk, ccos_inode_t* file, const uint
  */
 ccos_error_t ccos_read_file(ccos_disk_t* disk, ccos_inode_t* file, uint8_t** file_data, size_t* file_size);
 
+/**
+ * @brief      Read a part of the file contents into the given buffer.
+ *
+ * Only the sectors which hold the requested range are touched. Reads past the end of the file are clipped to the file
+ * size (dir_length for directories).
+ *
+ * @param[in]  disk        Compass disk image.
+ * @param[in]  file        File to read.
+ * @param[in]  offset      Offset in the file to read from.
+ * @param[out] buf         Buffer to receive the data, at least len bytes long.
+ * @param[in]  len         Number of bytes to read.
+ * @param[out] bytes_read  Number of bytes actually read; less than len at the end of the file. May be NULL.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_pread(ccos_disk_t* disk, ccos_inode_t* file, size_t offset, uint8_t* buf, size_t len,
+                        size_t* bytes_read);
+
+/**
+ * @brief      Overwrite a part of the file contents in place.
+ *
+ * Only the sectors which hold the written range are touched. If the range ends past the end of the file, the file is
+ * extended; a gap between the old end of the file and the offset is filled with zeroes.
+ *
+ * @param[in]  disk           Compass disk image.
+ * @param      file           File to write to.
+ * @param[in]  offset         Offset in the file to write at.
+ * @param[in]  data           Data to write.
+ * @param[in]  len            Data size.
+ * @param[out] dirty_sectors  Sorted list of the image sectors changed by the write: data sectors, and also the inode,
+ * content inodes and bitmask sectors if the file was extended. Should be freed by the caller. May be NULL.
+ * @param[out] dirty_count    Number of entries in dirty_sectors. Should be NULL if dirty_sectors is NULL.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_pwrite(ccos_disk_t* disk, ccos_inode_t* file, size_t offset, const uint8_t* data, size_t len,
+                         uint16_t** dirty_sectors, size_t* dirty_count);
+
+/**
+ * @brief      Change the file size, freeing or allocating content sectors as needed.
+ *
+ * Content sectors and content inodes past the new end of the file are freed at once. When the file grows, the new
+ * part is filled with zeroes.
+ *
+ * @param[in]  disk      Compass disk image.
+ * @param      file      File to resize.
+ * @param[in]  new_size  New file size.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_truncate(ccos_disk_t* disk, ccos_inode_t* file, size_t new_size);
+
 /**
  * @brief      Get parent directory of the given file.
  *
@@ -191,6 +311,8 @@ ccos_error_t ccos_copy_file(ccos_disk_t* src, ccos_inode_t* src_file,
 /**
  * @brief      Delete file in the image.
  *
+ * Directory is deleted with all its contents, see ccos_delete_files().
+ *
  * @param[in]  disk  Compass disk image.
  * @param[in]  file  The file to delete.
  *
@@ -198,6 +320,78 @@ ccos_error_t ccos_copy_file(ccos_disk_t* src, ccos_inode_t* src_file,
  */
 ccos_error_t ccos_delete_file(ccos_disk_t* disk, ccos_inode_t* file);
 
+/**
+ * @brief      Delete files in the image, rewriting every parent directory once.
+ *
+ * Directories are deleted with all their contents, files inside of them may be listed as well. Only the directories
+ * which are not deleted get their entries removed; sectors of the whole deleted subtree are just freed. Processing
+ * stops on the first error; changes made to the directories processed before it are kept.
+ *
+ * @param[in]  disk   Compass disk image.
+ * @param[in]  files  The files to delete.
+ * @param[in]  count  Number of the files.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_delete_files(ccos_disk_t* disk, ccos_inode_t** files, size_t count);
+
+// Streaming writer of a new file. Fields are private to the library.
+typedef struct {
+  ccos_disk_t* disk;
+  ccos_inode_t* directory;
+  ccos_inode_t* file;          // NULL once the writer is closed or aborted
+  size_t size;                 // bytes appended so far
+} ccos_file_writer_t;
+
+/**
+ * @brief      Start writing a new file into the given directory.
+ *
+ * The file inode is allocated right away, but the file is not linked into the directory until
+ * ccos_file_writer_close() is called.
+ *
+ * @param[in]  disk            Compass disk image.
+ * @param      dest_directory  The destination directory to add file to.
+ * @param[in]  file_name       File name.
+ * @param[out] writer          Writer to initialize.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_file_writer_open(ccos_disk_t* disk, ccos_inode_t* dest_directory, const char* file_name,
+                                   ccos_file_writer_t* writer);
+
+/**
+ * @brief      Append data to the file being written.
+ *
+ * The data fills the payload of the last file sector first; content sectors and content inodes for the rest are
+ * allocated as needed.
+ *
+ * @param      writer  Writer started with ccos_file_writer_open().
+ * @param[in]  data    Data to append.
+ * @param[in]  size    Data size.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_file_writer_append(ccos_file_writer_t* writer, const uint8_t* data, size_t size);
+
+/**
+ * @brief      Finish writing the file: set its size and add it to the destination directory.
+ *
+ * The file is erased from the image if it can't be added to the directory.
+ *
+ * @param      writer  Writer started with ccos_file_writer_open().
+ * @param[out] file    Newly created file inode. May be NULL.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_file_writer_close(ccos_file_writer_t* writer, ccos_inode_t** file);
+
+/**
+ * @brief      Drop the file being written and free all the sectors allocated for it.
+ *
+ * @param      writer  Writer started with ccos_file_writer_open().
+ */
+void ccos_file_writer_abort(ccos_file_writer_t* writer);
+
 /**
  * @brief      Add new file to the given directory.
  *
@@ -212,6 +406,29 @@ ccos_error_t ccos_delete_file(ccos_disk_t* disk, ccos_inode_t* file);
 ccos_inode_t* ccos_add_file(ccos_disk_t* disk, ccos_inode_t* dest_directory,
                             uint8_t* file_data, size_t file_size, const char* file_name);
 
+// Contents of a file to add with ccos_add_files().
+typedef struct {
+  const char* name;            // file name, e.g. "File~Type~"
+  const uint8_t* data;
+  size_t size;
+} ccos_new_file_t;
+
+/**
+ * @brief      Add new files to the given directory, rewriting the directory contents once.
+ *
+ * Either all the files are added, or none of them, e.g. if any of the names is already taken.
+ *
+ * @param[in]  disk            Compass disk image.
+ * @param      dest_directory  The destination directory to add files to.
+ * @param[in]  files           Names and contents of the files.
+ * @param[in]  count           Number of the files.
+ * @param[out] new_files       Newly created file inodes, in the same order as files. May be NULL.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_add_files(ccos_disk_t* disk, ccos_inode_t* dest_directory, const ccos_new_file_t* files,
+                            size_t count, ccos_inode_t** new_files);
+
 /**
  * @brief      Check file checksums and file structure, log to stderr in case of malformed file.
  *
@@ -225,6 +442,9 @@ ccos_error_t ccos_validate_file(ccos_disk_t* disk, const ccos_inode_t* file);
 /**
  * @brief      Calculate the amount of free space available in the image.
  *
+ * Trusts the "allocated" counter stored in the bitmask header and doesn't scan the bitmap; the bitmap is only counted
+ * if the counter is out of range. Use ccos_verify_free_space() to check the counter against the bitmap.
+ *
  * @param[in]  disk        Compass disk image.
  * @param[out] free_space  Pointer to size_t to receive the number of free bytes available in the image.
  *
@@ -232,6 +452,18 @@ ccos_error_t ccos_validate_file(ccos_disk_t* disk, const ccos_inode_t* file);
  */
 ccos_error_t ccos_calc_free_space(ccos_disk_t* disk, size_t* free_space);
 
+/**
+ * @brief      Count free space in the image bitmap and check it against the bitmask "allocated" counter.
+ *
+ * @param[in]  disk        Compass disk image.
+ * @param[in]  repair      Fix the counter in the image if it mismatches the bitmap.
+ * @param[out] free_space  Pointer to size_t to receive the number of free bytes found in the bitmap. May be NULL.
+ *
+ * @return     CCOS_OK if the counter matches the bitmap or was repaired, CCOS_EINVAL on mismatch without repair, error
+ *             code otherwise.
+ */
+ccos_error_t ccos_verify_free_space(ccos_disk_t* disk, bool repair, size_t* free_space);
+
 /**
  * @brief      Overwrite file contents with the given data.
  *
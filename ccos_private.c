@@ -2,6 +2,7 @@
 #include "ccos_structure.h"
 #include "ccos_image.h"
 
+#include <ctype.h>
 #include <errno.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -29,15 +30,33 @@ static uint16_t calc_checksum(const uint8_t* data, uint16_t data_size) {
   return ret;
 }
 
+// Offsets of the checksummed regions inside of the sector. Every region starts at an even offset, so a byte at an even
+// sector offset is always the low byte of a checksum word, and a byte at an odd offset is the high one.
+#define INODE_METADATA_CHECKSUM_END (offsetof(ccos_inode_t, desc) + offsetof(ccos_inode_desc_t, metadata_checksum))
+#define INODE_SECTORS_CHECKSUM_START (offsetof(ccos_inode_t, content_inode_info) + offsetof(ccos_block_data_t, block_next))
+#define CONTENT_INODE_CHECKSUM_START \
+  (offsetof(ccos_content_inode_t, content_inode_info) + offsetof(ccos_block_data_t, block_next))
+#define BITMASK_CHECKSUM_START offsetof(ccos_bitmask_t, allocated)
+
+static uint16_t inode_sectors_checksum_size(ccos_disk_t* disk) {
+  return ccos_get_log_sector_size(disk) - sizeof(ccos_inode_desc_t) - offsetof(ccos_block_data_t, block_next);
+}
+
+static uint16_t content_inode_checksum_size(ccos_disk_t* disk) {
+  return ccos_disk_sector_size(disk) - CONTENT_INODE_CHECKSUM_START - ccos_get_content_inode_padding(disk);
+}
+
+static uint16_t bitmask_checksum_size(ccos_disk_t* disk) {
+  return ccos_get_bitmask_size(disk) + sizeof(((ccos_bitmask_t*)NULL)->allocated);
+}
+
 uint16_t ccos_calc_inode_metadata_checksum(const ccos_inode_t* inode) {
-  return calc_checksum((const uint8_t*)inode, offsetof(ccos_inode_t, desc) + offsetof(ccos_inode_desc_t, metadata_checksum));
+  return calc_checksum((const uint8_t*)inode, INODE_METADATA_CHECKSUM_END);
 }
 
 uint16_t ccos_calc_inode_sectors_checksum(ccos_disk_t* disk, const ccos_inode_t* inode) {
   const uint8_t* checksum_data = (const uint8_t*)&inode->content_inode_info.block_next;
-  uint16_t checksum_data_size = ccos_get_log_sector_size(disk)
-    - sizeof(ccos_inode_desc_t)
-    - offsetof(ccos_block_data_t, block_next);
+  uint16_t checksum_data_size = inode_sectors_checksum_size(disk);
 
   uint16_t blocks_checksum = calc_checksum(checksum_data, checksum_data_size);
   blocks_checksum += inode->content_inode_info.header.file_id;
@@ -47,10 +66,8 @@ uint16_t ccos_calc_inode_sectors_checksum(ccos_disk_t* disk, const ccos_inode_t*
 }
 
 uint16_t ccos_calc_content_inode_checksum(ccos_disk_t* disk, const ccos_content_inode_t* content_inode) {
-  const size_t start_offset = offsetof(ccos_content_inode_t, content_inode_info) + offsetof(ccos_block_data_t, block_next);
-
   const uint8_t *checksum_data = (const uint8_t*)&content_inode->content_inode_info.block_next;
-  uint16_t checksum_data_size = ccos_disk_sector_size(disk) - start_offset - ccos_get_content_inode_padding(disk);
+  uint16_t checksum_data_size = content_inode_checksum_size(disk);
 
   uint16_t blocks_checksum = calc_checksum(checksum_data, checksum_data_size);
   blocks_checksum += content_inode->content_inode_info.header.file_id;
@@ -61,7 +78,7 @@ uint16_t ccos_calc_content_inode_checksum(ccos_disk_t* disk, const ccos_content_
 
 uint16_t ccos_calc_bitmask_checksum(ccos_disk_t* disk, const ccos_bitmask_t* bitmask) {
   const uint8_t* checksum_data = (const uint8_t*)&bitmask->allocated;
-  uint16_t checksum_data_size = ccos_get_bitmask_size(disk) + sizeof(bitmask->allocated);
+  uint16_t checksum_data_size = bitmask_checksum_size(disk);
 
   uint16_t checksum = calc_checksum(checksum_data, checksum_data_size);
   checksum += bitmask->header.file_id;
@@ -73,6 +90,7 @@ uint16_t ccos_calc_bitmask_checksum(ccos_disk_t* disk, const ccos_bitmask_t* bit
 void ccos_update_inode_checksums(ccos_disk_t* disk, ccos_inode_t* inode) {
   inode->desc.metadata_checksum = ccos_calc_inode_metadata_checksum(inode);
   inode->content_inode_info.blocks_checksum = ccos_calc_inode_sectors_checksum(disk, inode);
+  ccos_disk_mark_dirty(disk, inode, ccos_disk_sector_size(disk));
 }
 
 int ccos_is_valid_inode_checksum(ccos_disk_t* disk, const ccos_inode_t* file) {
@@ -95,10 +113,165 @@ int ccos_is_valid_inode_checksum(ccos_disk_t* disk, const ccos_inode_t* file) {
 
 void ccos_update_content_inode_checksums(ccos_disk_t* disk, ccos_content_inode_t* content_inode) {
   content_inode->content_inode_info.blocks_checksum = ccos_calc_content_inode_checksum(disk, content_inode);
+  ccos_disk_mark_dirty(disk, content_inode, ccos_disk_sector_size(disk));
 }
 
 void ccos_update_bitmask_checksum(ccos_disk_t* disk, ccos_bitmask_t* bitmask) {
   bitmask->checksum = ccos_calc_bitmask_checksum(disk, bitmask);
+  ccos_disk_mark_dirty(disk, bitmask, ccos_disk_sector_size(disk));
+}
+
+// Checksum stored in the sector along with the byte ranges it covers: a range of checksummed data plus an optional
+// block header, which words are added to the sum separately.
+typedef struct {
+  size_t checksum_offset;
+  size_t data_start;
+  size_t data_end;
+  size_t header_start;
+  bool has_header;
+} checksum_region_t;
+
+static bool is_in_checksum_region(const checksum_region_t* region, size_t offset) {
+  if (offset >= region->data_start && offset < region->data_end) {
+    return true;
+  }
+
+  return region->has_header && offset >= region->header_start &&
+         offset < region->header_start + sizeof(ccos_block_header_t);
+}
+
+static uint16_t checksum_byte_weight(size_t offset, uint8_t value) {
+  return (offset & 1u) ? (uint16_t)(value << 8u) : value;
+}
+
+// Copy bytes into the sector, adjusting every checksum which region covers them by the difference of old and new words.
+static void write_checksummed(uint8_t* sector, const checksum_region_t* regions, size_t regions_count, void* dest,
+                              const void* src, size_t size) {
+  uint8_t* dest_bytes = (uint8_t*)dest;
+  const uint8_t* src_bytes = (const uint8_t*)src;
+  size_t offset = dest_bytes - sector;
+
+  for (size_t i = 0; i < size; ++i, ++offset) {
+    uint16_t delta = checksum_byte_weight(offset, src_bytes[i]) - checksum_byte_weight(offset, dest_bytes[i]);
+    dest_bytes[i] = src_bytes[i];
+    if (delta == 0) {
+      continue;
+    }
+
+    for (size_t j = 0; j < regions_count; ++j) {
+      if (is_in_checksum_region(&regions[j], offset)) {
+        uint16_t checksum;
+        memcpy(&checksum, sector + regions[j].checksum_offset, sizeof(checksum));
+        checksum += delta;
+        memcpy(sector + regions[j].checksum_offset, &checksum, sizeof(checksum));
+      }
+    }
+  }
+}
+
+#ifdef CCOS_CHECKSUM_DEBUG
+// Compare incrementally maintained checksum against the full recalculation. Checksums that were already broken before
+// the write are not checked, as the delta update keeps them broken.
+static void verify_checksum(const char* name, uint16_t file_id, bool was_valid, uint16_t stored, uint16_t expected) {
+  if (was_valid && stored != expected) {
+    fprintf(stderr, "Error: %s checksum of file 0x%x is 0x%04hx after incremental update, expected 0x%04hx!\n",
+            name, file_id, stored, expected);
+    abort();
+  }
+}
+#endif
+
+void ccos_inode_write(ccos_disk_t* disk, ccos_inode_t* inode, void* dest, const void* src, size_t size) {
+#ifdef CCOS_CHECKSUM_DEBUG
+  bool metadata_was_valid = ccos_calc_inode_metadata_checksum(inode) == inode->desc.metadata_checksum;
+  bool sectors_were_valid = ccos_calc_inode_sectors_checksum(disk, inode) == inode->content_inode_info.blocks_checksum;
+#endif
+
+  const checksum_region_t regions[] = {
+    {
+      .checksum_offset = INODE_METADATA_CHECKSUM_END,
+      .data_start = 0,
+      .data_end = INODE_METADATA_CHECKSUM_END,
+    },
+    {
+      .checksum_offset = offsetof(ccos_inode_t, content_inode_info) + offsetof(ccos_block_data_t, blocks_checksum),
+      .data_start = INODE_SECTORS_CHECKSUM_START,
+      .data_end = INODE_SECTORS_CHECKSUM_START + inode_sectors_checksum_size(disk),
+      .header_start = offsetof(ccos_inode_t, content_inode_info),
+      .has_header = true,
+    },
+  };
+
+  if ((uint8_t*)dest + size > (uint8_t*)&inode->content_inode_info) {
+    ccos_invalidate_file_sectors(disk, inode->header.file_id);
+  }
+
+  write_checksummed((uint8_t*)inode, regions, sizeof(regions) / sizeof(regions[0]), dest, src, size);
+  ccos_disk_mark_dirty(disk, inode, ccos_disk_sector_size(disk));
+
+#ifdef CCOS_CHECKSUM_DEBUG
+  verify_checksum("Metadata", inode->header.file_id, metadata_was_valid, inode->desc.metadata_checksum,
+                  ccos_calc_inode_metadata_checksum(inode));
+  verify_checksum("Inode blocks", inode->header.file_id, sectors_were_valid, inode->content_inode_info.blocks_checksum,
+                  ccos_calc_inode_sectors_checksum(disk, inode));
+#endif
+}
+
+void ccos_content_inode_write(ccos_disk_t* disk, ccos_content_inode_t* content_inode, void* dest, const void* src,
+                              size_t size) {
+#ifdef CCOS_CHECKSUM_DEBUG
+  bool was_valid = ccos_calc_content_inode_checksum(disk, content_inode) ==
+                   content_inode->content_inode_info.blocks_checksum;
+#endif
+
+  const checksum_region_t region = {
+    .checksum_offset = offsetof(ccos_content_inode_t, content_inode_info) + offsetof(ccos_block_data_t, blocks_checksum),
+    .data_start = CONTENT_INODE_CHECKSUM_START,
+    .data_end = CONTENT_INODE_CHECKSUM_START + content_inode_checksum_size(disk),
+    .header_start = offsetof(ccos_content_inode_t, content_inode_info),
+    .has_header = true,
+  };
+
+  ccos_invalidate_file_sectors(disk, content_inode->content_inode_info.header.file_id);
+  write_checksummed((uint8_t*)content_inode, &region, 1, dest, src, size);
+  ccos_disk_mark_dirty(disk, content_inode, ccos_disk_sector_size(disk));
+
+#ifdef CCOS_CHECKSUM_DEBUG
+  verify_checksum("Content inode", content_inode->content_inode_info.header.file_id, was_valid,
+                  content_inode->content_inode_info.blocks_checksum, ccos_calc_content_inode_checksum(disk, content_inode));
+#endif
+}
+
+static void write_bitmask(ccos_disk_t* disk, ccos_bitmask_t* bitmask, void* dest, const void* src, size_t size) {
+#ifdef CCOS_CHECKSUM_DEBUG
+  bool was_valid = ccos_calc_bitmask_checksum(disk, bitmask) == bitmask->checksum;
+#endif
+
+  const checksum_region_t region = {
+    .checksum_offset = offsetof(ccos_bitmask_t, checksum),
+    .data_start = BITMASK_CHECKSUM_START,
+    .data_end = BITMASK_CHECKSUM_START + bitmask_checksum_size(disk),
+    .header_start = offsetof(ccos_bitmask_t, header),
+    .has_header = true,
+  };
+
+  write_checksummed((uint8_t*)bitmask, &region, 1, dest, src, size);
+  ccos_disk_mark_dirty(disk, bitmask, ccos_disk_sector_size(disk));
+
+#ifdef CCOS_CHECKSUM_DEBUG
+  verify_checksum("Bitmask", bitmask->header.file_id, was_valid,
+                  bitmask->checksum, ccos_calc_bitmask_checksum(disk, bitmask));
+#endif
+}
+
+void ccos_bitmask_write(ccos_disk_t* disk, ccos_bitmask_t* bitmask, void* dest, const void* src, size_t size) {
+  const uint8_t* bytes = ccos_get_bitmask_bytes(bitmask);
+  const uint8_t* dest_bytes = (const uint8_t*)dest;
+  if (dest_bytes < bytes + ccos_get_bitmask_size(disk) && dest_bytes + size > bytes) {
+    ccos_invalidate_bitmap_summary(disk);
+  }
+
+  write_bitmask(disk, bitmask, dest, src, size);
 }
 
 
@@ -106,7 +279,7 @@ void ccos_update_bitmask_checksum(ccos_disk_t* disk, ccos_bitmask_t* bitmask) {
 /*                               SECTOR READERS                               */
 /* -------------------------------------------------------------------------- */
 
-ccos_error_t ccos_get_file_sectors(ccos_disk_t* disk, ccos_inode_t* file, size_t* blocks_count, uint16_t** blocks) {
+static ccos_error_t read_file_sectors(ccos_disk_t* disk, ccos_inode_t* file, size_t* blocks_count, uint16_t** blocks) {
   // TODO: Check file checksum.
   size_t total_blocks = ccos_disk_size(disk) / ccos_disk_sector_size(disk);
 
@@ -182,283 +355,1723 @@ ccos_error_t ccos_get_file_sectors(ccos_disk_t* disk, ccos_inode_t* file, size_t
   return CCOS_OK;
 }
 
+ccos_error_t ccos_get_cached_file_sectors(ccos_disk_t* disk, ccos_inode_t* file, size_t* blocks_count,
+                                          const uint16_t** blocks) {
+  ccos_file_sectors_t* entry = &ccos_disk_file_sectors(disk)[file->header.file_id % CCOS_FILE_SECTORS_CACHE_SIZE];
+  if (entry->file_id != file->header.file_id) {
+    size_t count = 0;
+    uint16_t* list = NULL;
+    ccos_error_t err = read_file_sectors(disk, file, &count, &list);
+    if (err != CCOS_OK) {
+      return err;
+    }
 
-/* -------------------------------------------------------------------------- */
-/*                             BITMASK OPERATIONS                             */
-/* -------------------------------------------------------------------------- */
+    free(entry->blocks);
+    entry->file_id = file->header.file_id;
+    entry->blocks = list;
+    entry->count = count;
+  }
 
-static ccos_bitmask_t* get_bitmask(ccos_disk_t* disk) {
-  ccos_bitmask_t* bitmask = ccos_disk_read(disk, ccos_disk_bitmap(disk));
-  if (bitmask == NULL) {
-    return NULL;
+  *blocks = entry->blocks;
+  *blocks_count = entry->count;
+  return CCOS_OK;
+}
+
+ccos_error_t ccos_get_file_sectors(ccos_disk_t* disk, ccos_inode_t* file, size_t* blocks_count, uint16_t** blocks) {
+  size_t count = 0;
+  const uint16_t* cached = NULL;
+  ccos_error_t err = ccos_get_cached_file_sectors(disk, file, &count, &cached);
+  if (err != CCOS_OK) {
+    return err;
   }
 
-  if (bitmask->header.file_id != ccos_disk_bitmap(disk)) {
-    // TODO: return error.
-    return NULL;
+  uint16_t* list = calloc(count > 0 ? count : 1, sizeof(uint16_t));
+  if (list == NULL) {
+    return CCOS_ENOMEM;
   }
 
-  return bitmask;
+  memcpy(list, cached, count * sizeof(uint16_t));
+  *blocks = list;
+  *blocks_count = count;
+  return CCOS_OK;
 }
 
-ccos_bitmask_list_t ccos_find_bitmask_sectors(ccos_disk_t* disk) {
-  ccos_bitmask_list_t result = {0};
-  ccos_bitmask_t* first_bitmask_block = get_bitmask(disk);
-  if (first_bitmask_block == NULL) {
-    fprintf(stderr, "Unable to get bitmask blocks: No bitmask in image!\n");
-    return result;
+void ccos_invalidate_file_sectors(ccos_disk_t* disk, uint16_t file_id) {
+  ccos_file_sectors_t* entries = ccos_disk_file_sectors(disk);
+  if (entries == NULL) {
+    return;
   }
 
-  size_t block_size = ccos_disk_sector_size(disk);
+  if (file_id != CCOS_INVALID_BLOCK) {
+    ccos_file_sectors_t* entry = &entries[file_id % CCOS_FILE_SECTORS_CACHE_SIZE];
+    if (entry->file_id == file_id) {
+      TRACE("Dropping cached blocks of file 0x%x", file_id);
+      entry->file_id = CCOS_INVALID_BLOCK;
+    }
 
-  uint16_t bitmask_id = first_bitmask_block->header.file_id;
-  uint32_t bitmask_addr = bitmask_id * block_size;
+    return;
+  }
 
-  for (size_t i = 0; i < MAX_BITMASK_BLOCKS_IN_IMAGE; i++) {
-    uint32_t offset = bitmask_addr + i * block_size;
-    ccos_block_header_t* header = (ccos_block_header_t*)ccos_disk_read(disk, (uint16_t)(offset / block_size));
-    if (header->file_id == bitmask_id) {
-      if (header->file_fragment_index != i) {
-        fprintf(stderr, "WARN: 0x%x: Invalid bitmask fragment index: expected: " SIZE_T "; actual: %d!\n", offset, i,
-                header->file_fragment_index);
+  for (size_t i = 0; i < CCOS_FILE_SECTORS_CACHE_SIZE; ++i) {
+    entries[i].file_id = CCOS_INVALID_BLOCK;
+  }
+}
+
+
+/* -------------------------------------------------------------------------- */
+/*                               DIRECTORY CACHE                              */
+/* -------------------------------------------------------------------------- */
+
+// Sequential reader of file contents on top of the span iterator, for parsers which consume a few bytes at a time.
+typedef struct {
+  ccos_file_span_iterator_t it;
+  const uint8_t* span;
+  size_t span_size;
+} span_reader_t;
+
+// Copy next `size` bytes of the file into dest, or skip them if dest is NULL. `read` receives the number of bytes
+// actually consumed, which is less than `size` at the end of the file.
+static ccos_error_t span_reader_read(span_reader_t* reader, void* dest, size_t size, size_t* read) {
+  *read = 0;
+  while (*read < size) {
+    if (reader->span_size == 0) {
+      ccos_error_t err = ccos_file_spans_next(&reader->it, &reader->span, &reader->span_size);
+      if (err != CCOS_OK) {
+        return err;
       }
 
-      result.bitmask_blocks[i] = (ccos_bitmask_t*)header;
-    } else {
-      // previous block was the last bitnmask block
-      result.length = i;
-      break;
+      if (reader->span_size == 0) {
+        break;
+      }
     }
-  }
 
-  return result;
-}
+    size_t chunk = size - *read < reader->span_size ? size - *read : reader->span_size;
+    if (dest != NULL) {
+      memcpy((uint8_t*)dest + *read, reader->span, chunk);
+    }
 
-static ccos_error_t validate_bitmask_list(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list,
-                                           size_t block_count) {
-  if (bitmask_list == NULL || bitmask_list->length == 0) {
-    return CCOS_EINVAL;
+    reader->span += chunk;
+    reader->span_size -= chunk;
+    *read += chunk;
   }
 
-  size_t bitmask_blocks = ccos_get_bitmask_sectors(disk);
-  size_t bitmask_capacity = bitmask_list->length * bitmask_blocks;
-  if (block_count > bitmask_capacity) {
-    return CCOS_ERANGE;
+  return CCOS_OK;
+}
+
+static void make_dir_key(const short_string_t* file_name, ccos_dir_key_t* key) {
+  memset(key, 0, sizeof(*key));
+  size_t name_length = 0;
+  size_t type_length = 0;
+  if (ccos_parse_short_file_name(file_name, key->name, key->type, &name_length, &type_length) != CCOS_OK) {
+    memset(key, 0, sizeof(*key));
+    return;
   }
 
-  if (bitmask_list->bitmask_blocks[0] == NULL ||
-      bitmask_list->bitmask_blocks[0]->allocated > block_count) {
-    return CCOS_EINVAL;
+  for (size_t i = 0; i < name_length; ++i) {
+    key->name[i] = (char)tolower((unsigned char)key->name[i]);
   }
 
-  for (size_t i = 1; i < bitmask_list->length; ++i) {
-    if (bitmask_list->bitmask_blocks[i] == NULL) {
-      return CCOS_EINVAL;
-    }
+  for (size_t i = 0; i < type_length; ++i) {
+    key->type[i] = (char)tolower((unsigned char)key->type[i]);
   }
 
-  return CCOS_OK;
+  key->type_length = type_length;
 }
 
-__attribute__((always_inline))
-static int is_bitmask_block_allocated(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list, size_t block) {
-  size_t bitmask_blocks = ccos_get_bitmask_sectors(disk);
-  size_t bitmask_index = block / bitmask_blocks;
-  size_t local_block = block - bitmask_index * bitmask_blocks;
-  uint8_t* bitmask_bytes = ccos_get_bitmask_bytes(bitmask_list->bitmask_blocks[bitmask_index]);
+void ccos_make_dir_key(const ccos_inode_t* file, ccos_dir_key_t* key) {
+  if (file == NULL) {
+    memset(key, 0, sizeof(*key));
+    return;
+  }
 
-  return (bitmask_bytes[local_block / 8] & (1u << (local_block % 8))) != 0;
+  make_dir_key((const short_string_t*)&file->desc.name_length, key);
 }
 
-static size_t count_free_bitmask_blocks(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list,
-                                        size_t block_count) {
-  size_t free_count = 0;
-  for (size_t block = 0; block < block_count; block++) {
-    if (!is_bitmask_block_allocated(disk, bitmask_list, block)) {
-      free_count++;
-    }
+static int compare_dir_keys(const ccos_dir_key_t* entry_key, const ccos_dir_key_t* key) {
+  int res = strcmp(entry_key->name, key->name);
+  if (res == 0) {
+    size_t type_length = entry_key->type_length < key->type_length ? entry_key->type_length : key->type_length;
+    res = strncmp(entry_key->type, key->type, type_length);
   }
 
-  return free_count;
+  return res;
 }
 
-bool ccos_validate_disk_bitmap(ccos_disk_t* disk) {
-  ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
-  size_t block_count = ccos_disk_size(disk) / ccos_disk_sector_size(disk);
-  if (validate_bitmask_list(disk, &bitmask_list, block_count) != CCOS_OK) {
-    return false;
+// Binary search finds the same position as the linear scan only if "entry >= key" never flips back to false further in
+// the list. It holds for entries ordered by basename and then by type, except when a type is followed by a longer type
+// starting with it: e.g. "Run" and "Runa" are both >= "Ru" but "Runa" < "Runb". Since types in between such two would
+// start with the shorter one as well, checking adjacent entries is enough.
+static bool is_ordered_key_pair(const ccos_dir_key_t* first, const ccos_dir_key_t* second) {
+  int res = strcmp(first->name, second->name);
+  if (res != 0) {
+    return res < 0;
   }
 
-  bool valid = true;
-  uint16_t expected_allocated = bitmask_list.bitmask_blocks[0]->allocated;
-  for (size_t i = 0; i < bitmask_list.length; i++) {
-    ccos_bitmask_t* bitmask = bitmask_list.bitmask_blocks[i];
-    uint16_t checksum = ccos_calc_bitmask_checksum(disk, bitmask);
-    if (bitmask->checksum != checksum) {
-      fprintf(stderr, "Warn: bitmask #" SIZE_T " checksum mismatch! Expected: 0x%x, got: 0x%x!\n", i,
-              bitmask->checksum, checksum);
-      valid = false;
-    }
-  }
+  return strcmp(first->type, second->type) <= 0 &&
+         !(first->type_length < second->type_length &&
+           strncmp(first->type, second->type, first->type_length) == 0);
+}
 
-  size_t free_count = count_free_bitmask_blocks(disk, &bitmask_list, block_count);
-  if ((block_count - expected_allocated) != free_count) {
-    fprintf(stderr, "Warn: free block count (" SIZE_T ") mismatches found free blocks (" SIZE_T ")!\n",
-            block_count - expected_allocated, free_count);
-    valid = false;
+static size_t count_unordered_pairs(const ccos_parsed_dir_t* parsed, size_t from, size_t to) {
+  size_t count = 0;
+  for (size_t i = from; i + 1 < to && i + 1 < parsed->count; ++i) {
+    count += !is_ordered_key_pair(&parsed->keys[i], &parsed->keys[i + 1]);
   }
 
-  return valid;
+  return count;
 }
 
-uint16_t ccos_get_free_sector(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list) {
-  size_t block_count = ccos_disk_size(disk) / ccos_disk_sector_size(disk);
+size_t ccos_find_parsed_dir_index(const ccos_parsed_dir_t* parsed, const ccos_dir_key_t* key) {
+  if (parsed->unordered_pairs > 0) {
+    size_t i;
+    for (i = 0; i < parsed->count; ++i) {
+      if (compare_dir_keys(&parsed->keys[i], key) >= 0) {
+        break;
+      }
+    }
 
-  if (validate_bitmask_list(disk, bitmask_list, block_count) != CCOS_OK) {
-    return CCOS_INVALID_BLOCK;
+    return i;
   }
 
-  for (size_t block = 0; block < block_count; block++) {
-    if (!is_bitmask_block_allocated(disk, bitmask_list, block)) {
-      return (uint16_t)block;
+  size_t low = 0;
+  size_t high = parsed->count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (compare_dir_keys(&parsed->keys[middle], key) >= 0) {
+      high = middle;
+    } else {
+      low = middle + 1;
     }
   }
 
-  return CCOS_INVALID_BLOCK;
+  return low;
 }
 
-ccos_error_t ccos_get_free_sectors_count(ccos_disk_t* disk, ccos_bitmask_list_t* bitmask_list,
-                                   size_t* free_blocks_count) {
-  if (bitmask_list == NULL || free_blocks_count == NULL) {
-    return CCOS_EINVAL;
+#define CCOS_NAME_INDEX_MIN_SIZE 16
+
+// FNV-1a over the ASCII-folded name, matching strncasecmp() comparison in the C locale.
+static uint32_t hash_file_name(const char* name, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= (uint8_t)tolower((unsigned char)name[i]);
+    hash *= 16777619u;
   }
 
-  size_t block_count = ccos_disk_size(disk) / ccos_disk_sector_size(disk);
-  ccos_error_t err = validate_bitmask_list(disk, bitmask_list, block_count);
-  if (err != CCOS_OK) {
-    return err;
+  return hash;
+}
+
+static bool is_file_named(const ccos_inode_t* file, const char* name, size_t length) {
+  return file->desc.name_length == length && strncasecmp(file->desc.name, name, length) == 0;
+}
+
+static size_t find_name_index_slot(const ccos_parsed_dir_t* parsed, const char* name, size_t length) {
+  size_t mask = parsed->name_index_size - 1;
+  size_t slot = hash_file_name(name, length) & mask;
+  while (parsed->name_index[slot] != NULL && !is_file_named(parsed->name_index[slot], name, length)) {
+    slot = (slot + 1) & mask;
   }
 
-  *free_blocks_count = count_free_bitmask_blocks(disk, bitmask_list, block_count);
-  TRACE("Free blocks: %zu", *free_blocks_count);
+  return slot;
+}
 
-  return CCOS_OK;
+static void drop_name_index(ccos_parsed_dir_t* parsed) {
+  free(parsed->name_index);
+  parsed->name_index = NULL;
+  parsed->name_index_size = 0;
+  parsed->name_index_count = 0;
+  parsed->duplicate_names = false;
 }
 
-void ccos_mark_sector(ccos_disk_t* disk, ccos_bitmask_list_t* bitmask_list, uint16_t block, uint8_t mode) {
-  TRACE("Mark block %x as %s...", block, mode ? "used" : "free");
+// Adds the file unless some file with the same name is already there; returns false in that case.
+static bool put_name_index_file(ccos_parsed_dir_t* parsed, ccos_inode_t* file) {
+  size_t slot = find_name_index_slot(parsed, file->desc.name, file->desc.name_length);
+  if (parsed->name_index[slot] != NULL) {
+    return false;
+  }
 
-  size_t bitmask_blocks = ccos_get_bitmask_sectors(disk);
+  parsed->name_index[slot] = file;
+  parsed->name_index_count++;
+  return true;
+}
 
-  if (block >= bitmask_list->length * bitmask_blocks) {
-    fprintf(stderr, "Unable to mark block 0x%x: out of bitmask bounds of %lx!\n", block,
-            bitmask_list->length * bitmask_blocks);
-    return;
+// Keeps the load factor at most 1/2, so probe sequences stay short.
+static ccos_error_t resize_name_index(ccos_parsed_dir_t* parsed, size_t count) {
+  size_t size = CCOS_NAME_INDEX_MIN_SIZE;
+  while (size < count * 2) {
+    size *= 2;
   }
 
-  size_t bitmask_index = block / bitmask_blocks;
-  block = block - (bitmask_index * bitmask_blocks);
-  uint8_t* bytes = ccos_get_bitmask_bytes(bitmask_list->bitmask_blocks[bitmask_index]);
-  uint8_t* byte = &bytes[block >> 3u];
-  if (mode) {
-    *byte = *byte | (1u << (block & 0b111u));
-  } else {
-    *byte = *byte & ~(1u << (block & 0b111u));
+  if (size <= parsed->name_index_size) {
+    return CCOS_OK;
   }
 
-  for (size_t i = 0; i < bitmask_list->length; i++) {
-    if (mode) {
-      // all bitmasks should have same "allocated" value (?)
-      bitmask_list->bitmask_blocks[i]->allocated += 1;
-    } else {
-      bitmask_list->bitmask_blocks[i]->allocated -= 1;
-    }
+  ccos_inode_t** name_index = calloc(size, sizeof(ccos_inode_t*));
+  if (name_index == NULL) {
+    return CCOS_ENOMEM;
+  }
 
-    ccos_update_bitmask_checksum(disk, bitmask_list->bitmask_blocks[i]);
+  ccos_inode_t** old_index = parsed->name_index;
+  size_t old_size = parsed->name_index_size;
+  parsed->name_index = name_index;
+  parsed->name_index_size = size;
+  parsed->name_index_count = 0;
+  for (size_t i = 0; i < old_size; ++i) {
+    if (old_index[i] != NULL) {
+      put_name_index_file(parsed, old_index[i]);
+    }
   }
-}
 
+  free(old_index);
+  return CCOS_OK;
+}
 
-/* -------------------------------------------------------------------------- */
-/*                           LOW LEVEL FS OPERATIONS                          */
-/* -------------------------------------------------------------------------- */
+static ccos_error_t build_name_index(ccos_parsed_dir_t* parsed) {
+  ccos_error_t err = resize_name_index(parsed, parsed->count);
+  if (err != CCOS_OK) {
+    return err;
+  }
 
-ccos_inode_t* ccos_init_inode(ccos_disk_t* disk, uint16_t block, uint16_t parent_dir_block) {
-  TRACE("Initializing inode at 0x%x!", block);
-  ccos_inode_t* inode = ccos_disk_read(disk, block);
-  memset(inode, 0, ccos_disk_sector_size(disk));
-  inode->header.file_id = block;
-  inode->desc.dir_file_id = parent_dir_block;
-  inode->content_inode_info.header.file_id = block;
-  inode->content_inode_info.block_next = CCOS_INVALID_BLOCK;
-  inode->content_inode_info.block_current = block;
-  inode->content_inode_info.block_prev = CCOS_INVALID_BLOCK;
+  // Lookups return the first of the files with the same name, as the scan over the entries would do.
+  for (size_t i = 0; i < parsed->count; ++i) {
+    if (parsed->elements[i].file != NULL && !put_name_index_file(parsed, parsed->elements[i].file)) {
+      parsed->duplicate_names = true;
+    }
+  }
 
-  size_t inode_max_blocks = ccos_get_inode_max_sectors(disk);
-  uint16_t* content_blocks = ccos_get_inode_content_sectors(inode);
+  return CCOS_OK;
+}
 
-  for (int i = 0; i < inode_max_blocks; ++i) {
-    content_blocks[i] = CCOS_CONTENT_BLOCKS_END_MARKER;
+static void add_name_index_file(ccos_parsed_dir_t* parsed, ccos_inode_t* file) {
+  if (parsed->name_index == NULL || file == NULL) {
+    return;
   }
 
-  ccos_update_inode_checksums(disk, inode);
-  return inode;
+  // Which of the files with the same name goes first isn't known here, so the index is rebuilt on the next lookup.
+  if (resize_name_index(parsed, parsed->name_index_count + 1) != CCOS_OK || !put_name_index_file(parsed, file)) {
+    drop_name_index(parsed);
+  }
 }
 
-ccos_content_inode_t* ccos_add_content_inode(ccos_disk_t* disk, ccos_inode_t* file, ccos_bitmask_list_t* bitmask_list) {
-  ccos_block_data_t* content_inode_info = &(file->content_inode_info);
-  ccos_content_inode_t* last_content_inode = ccos_get_last_content_inode(disk, file);
-  if (last_content_inode != NULL) {
-    content_inode_info = &(last_content_inode->content_inode_info);
+static void remove_name_index_file(ccos_parsed_dir_t* parsed, const ccos_inode_t* file) {
+  if (parsed->name_index == NULL || file == NULL) {
+    return;
   }
 
-  uint16_t new_block = ccos_get_free_sector(disk, bitmask_list);
-  if (new_block == CCOS_INVALID_BLOCK) {
-    fprintf(stderr, "Unable to allocate new content inode: No free space!\n");
-    return NULL;
+  // Other file with the same name should take its place, so it's easier to rebuild the index.
+  if (parsed->duplicate_names) {
+    drop_name_index(parsed);
+    return;
   }
 
-  ccos_mark_sector(disk, bitmask_list, new_block, 1);
-
-  ccos_content_inode_t* content_inode = ccos_disk_read(disk, new_block);
+  size_t mask = parsed->name_index_size - 1;
+  size_t slot = find_name_index_slot(parsed, file->desc.name, file->desc.name_length);
+  if (parsed->name_index[slot] != file) {
+    return;
+  }
 
-  content_inode->content_inode_info.header.file_id = content_inode_info->header.file_id;
-  content_inode->content_inode_info.header.file_fragment_index = content_inode_info->header.file_fragment_index;
-  content_inode->content_inode_info.block_next = CCOS_INVALID_BLOCK;
-  content_inode->content_inode_info.block_current = new_block;
-  content_inode->content_inode_info.block_prev = content_inode_info->block_current;
+  // Backward shift deletion: move up the following files of the cluster which may not stay behind the hole.
+  parsed->name_index[slot] = NULL;
+  parsed->name_index_count--;
+  for (size_t next = (slot + 1) & mask; parsed->name_index[next] != NULL; next = (next + 1) & mask) {
+    ccos_inode_t* moved = parsed->name_index[next];
+    size_t home = hash_file_name(moved->desc.name, moved->desc.name_length) & mask;
+    // The file stays if its home slot is cyclically in (slot, next].
+    if (slot <= next ? (slot < home && home <= next) : (slot < home || home <= next)) {
+      continue;
+    }
 
-  content_inode_info->block_next = new_block;
+    parsed->name_index[slot] = moved;
+    parsed->name_index[next] = NULL;
+    slot = next;
+  }
+}
 
-  ccos_update_content_inode_checksums(disk, content_inode);
-  if (last_content_inode != NULL) {
-    ccos_update_content_inode_checksums(disk, last_content_inode);
-  } else {
-    ccos_update_inode_checksums(disk, file);
+static ccos_error_t reserve_parsed_dir(ccos_parsed_dir_t* parsed, size_t capacity) {
+  if (capacity <= parsed->capacity) {
+    return CCOS_OK;
   }
 
-  return content_inode;
-}
+  size_t new_capacity = parsed->capacity == 0 ? 8 : parsed->capacity;
+  while (new_capacity < capacity) {
+    new_capacity *= 2;
+  }
 
-ccos_content_inode_t* ccos_get_last_content_inode(ccos_disk_t* disk, const ccos_inode_t* file) {
-  if (file->content_inode_info.block_next != CCOS_INVALID_BLOCK) {
-    ccos_content_inode_t* result = ccos_disk_read(disk, file->content_inode_info.block_next);
-    while (result->content_inode_info.block_next != CCOS_INVALID_BLOCK) {
-      result = ccos_disk_read(disk, result->content_inode_info.block_next);
-    }
+  parsed_directory_element_t* elements = realloc(parsed->elements, new_capacity * sizeof(parsed_directory_element_t));
+  if (elements == NULL) {
+    return CCOS_ENOMEM;
+  }
+  parsed->elements = elements;
 
-    return result;
+  ccos_dir_key_t* keys = realloc(parsed->keys, new_capacity * sizeof(ccos_dir_key_t));
+  if (keys == NULL) {
+    return CCOS_ENOMEM;
   }
+  parsed->keys = keys;
 
-  return NULL;
+  parsed->capacity = new_capacity;
+  return CCOS_OK;
 }
 
-void ccos_erase_sector(ccos_disk_t* disk, uint16_t block, ccos_bitmask_list_t* bitmask_list) {
+// Same layout as handled by ccos_parse_directory_data(), but parsed straight from the directory sectors.
+static ccos_error_t parse_dir(ccos_disk_t* disk, ccos_inode_t* dir, ccos_parsed_dir_t* parsed) {
+  *parsed = (ccos_parsed_dir_t){.dir_id = dir->header.file_id, .dir_count = dir->desc.dir_count};
+
+  span_reader_t reader = {0};
+  ccos_error_t err = ccos_file_spans_begin(disk, dir, &reader.it);
+  if (err != CCOS_OK) {
+    return err;
+  }
+
+  err = reserve_parsed_dir(parsed, dir->desc.dir_count);
+  if (err != CCOS_OK) {
+    ccos_free_parsed_dir(parsed);
+    return err;
+  }
+
+  TRACE("Parsing %d dir entries, size = " SIZE_T " bytes...", dir->desc.dir_count, reader.it.remaining);
+  size_t offset = 0;
+  for (uint16_t count = 0; count < dir->desc.dir_count; count++) {
+    uint8_t flag = 0;
+    dir_entry_t entry = {0};
+    size_t read = 0;
+
+    err = span_reader_read(&reader, &flag, sizeof(flag), &read);
+    if (err != CCOS_OK || read < sizeof(flag) || flag == CCOS_DIR_LAST_ENTRY_MARKER) {
+      break;
+    }
+
+    offset += sizeof(flag);
+    err = span_reader_read(&reader, &entry, sizeof(entry), &read);
+    if (err != CCOS_OK || read < sizeof(entry)) {
+      break;
+    }
+
+    TRACE("entry block: 0x%x, name length: %d characters", entry.block, entry.name_length);
+    size_t entry_size = sizeof(dir_entry_t) + entry.name_length + sizeof(uint8_t);
+    parsed_directory_element_t* element = &parsed->elements[parsed->count];
+    element->offset = offset;
+    element->size = entry_size;
+    element->file = ccos_disk_read(disk, entry.block);
+    ccos_make_dir_key(element->file, &parsed->keys[parsed->count]);
+    parsed->count++;
+    offset += entry_size;
+
+    // Skip the name and its reverse length.
+    err = span_reader_read(&reader, NULL, entry.name_length + sizeof(uint8_t), &read);
+    if (err != CCOS_OK) {
+      break;
+    }
+  }
+
+  if (err != CCOS_OK) {
+    ccos_free_parsed_dir(parsed);
+    return err;
+  }
+
+  parsed->unordered_pairs = count_unordered_pairs(parsed, 0, parsed->count);
+  if (parsed->unordered_pairs > 0) {
+    TRACE("Directory 0x%x has " SIZE_T " entries out of order, names will be looked up with linear scan",
+          parsed->dir_id, parsed->unordered_pairs);
+  }
+
+  return CCOS_OK;
+}
+
+static ccos_parsed_dir_t* get_dir_cache_entry(ccos_disk_t* disk, ccos_inode_t* dir) {
+  return &ccos_disk_dir_cache(disk)[dir->header.file_id % CCOS_DIR_CACHE_SIZE];
+}
+
+static bool is_valid_dir_cache_entry(const ccos_parsed_dir_t* entry, const ccos_inode_t* dir) {
+  // dir_count is checked as well to catch directory changes which bypass the cache updates.
+  return entry->dir_id == dir->header.file_id && entry->dir_count == dir->desc.dir_count;
+}
+
+ccos_error_t ccos_get_cached_dir(ccos_disk_t* disk, ccos_inode_t* dir, const ccos_parsed_dir_t** parsed) {
+  ccos_parsed_dir_t* entry = get_dir_cache_entry(disk, dir);
+  if (!is_valid_dir_cache_entry(entry, dir)) {
+    ccos_parsed_dir_t new_entry = {0};
+    ccos_error_t err = parse_dir(disk, dir, &new_entry);
+    if (err != CCOS_OK) {
+      return err;
+    }
+
+    ccos_free_parsed_dir(entry);
+    *entry = new_entry;
+  }
+
+  *parsed = entry;
+  return CCOS_OK;
+}
+
+ccos_error_t ccos_detach_cached_dir(ccos_disk_t* disk, ccos_inode_t* dir, ccos_parsed_dir_t* parsed) {
+  ccos_parsed_dir_t* entry = get_dir_cache_entry(disk, dir);
+  if (!is_valid_dir_cache_entry(entry, dir)) {
+    return parse_dir(disk, dir, parsed);
+  }
+
+  *parsed = *entry;
+  *entry = (ccos_parsed_dir_t){.dir_id = CCOS_INVALID_BLOCK};
+  return CCOS_OK;
+}
+
+void ccos_attach_cached_dir(ccos_disk_t* disk, ccos_parsed_dir_t* parsed) {
+  ccos_parsed_dir_t* entry = &ccos_disk_dir_cache(disk)[parsed->dir_id % CCOS_DIR_CACHE_SIZE];
+  ccos_free_parsed_dir(entry);
+  *entry = *parsed;
+  *parsed = (ccos_parsed_dir_t){.dir_id = CCOS_INVALID_BLOCK};
+}
+
+void ccos_free_parsed_dir(ccos_parsed_dir_t* parsed) {
+  free(parsed->elements);
+  free(parsed->keys);
+  free(parsed->name_index);
+  *parsed = (ccos_parsed_dir_t){.dir_id = CCOS_INVALID_BLOCK};
+}
+
+ccos_error_t ccos_insert_parsed_dir_entry(ccos_parsed_dir_t* parsed, size_t index, ccos_inode_t* file, uint16_t offset,
+                                          size_t size) {
+  ccos_error_t err = reserve_parsed_dir(parsed, parsed->count + 1);
+  if (err != CCOS_OK) {
+    return err;
+  }
+
+  // Pair of the entries around the new one is replaced with two pairs.
+  parsed->unordered_pairs -= index > 0 ? count_unordered_pairs(parsed, index - 1, index + 1) : 0;
+  memmove(&parsed->elements[index + 1], &parsed->elements[index],
+          (parsed->count - index) * sizeof(parsed_directory_element_t));
+  memmove(&parsed->keys[index + 1], &parsed->keys[index], (parsed->count - index) * sizeof(ccos_dir_key_t));
+  parsed->count++;
+
+  parsed->elements[index] = (parsed_directory_element_t){.offset = offset, .size = size, .file = file};
+  ccos_make_dir_key(file, &parsed->keys[index]);
+  parsed->unordered_pairs += count_unordered_pairs(parsed, index > 0 ? index - 1 : 0, index + 2);
+  add_name_index_file(parsed, file);
+
+  // Each entry is followed by the last entry flag.
+  for (size_t i = index + 1; i < parsed->count; ++i) {
+    parsed->elements[i].offset += size + sizeof(uint8_t);
+  }
+
+  return CCOS_OK;
+}
+
+void ccos_remove_parsed_dir_entry(ccos_parsed_dir_t* parsed, size_t index) {
+  size_t size = parsed->elements[index].size;
+  remove_name_index_file(parsed, parsed->elements[index].file);
+  parsed->unordered_pairs -= count_unordered_pairs(parsed, index > 0 ? index - 1 : 0, index + 2);
+  memmove(&parsed->elements[index], &parsed->elements[index + 1],
+          (parsed->count - index - 1) * sizeof(parsed_directory_element_t));
+  memmove(&parsed->keys[index], &parsed->keys[index + 1], (parsed->count - index - 1) * sizeof(ccos_dir_key_t));
+  parsed->count--;
+  parsed->unordered_pairs += index > 0 ? count_unordered_pairs(parsed, index - 1, index + 1) : 0;
+
+  for (size_t i = index; i < parsed->count; ++i) {
+    parsed->elements[i].offset -= size + sizeof(uint8_t);
+  }
+}
+
+void ccos_remove_parsed_dir_entries(ccos_parsed_dir_t* parsed, const bool* removed) {
+  size_t count = 0;
+  size_t shift = 0;
+  for (size_t i = 0; i < parsed->count; ++i) {
+    if (removed[i]) {
+      remove_name_index_file(parsed, parsed->elements[i].file);
+      shift += parsed->elements[i].size + sizeof(uint8_t);
+      continue;
+    }
+
+    parsed->elements[count] = parsed->elements[i];
+    parsed->elements[count].offset -= shift;
+    parsed->keys[count] = parsed->keys[i];
+    count++;
+  }
+
+  parsed->count = count;
+  parsed->unordered_pairs = count_unordered_pairs(parsed, 0, count);
+}
+
+ccos_error_t ccos_find_cached_dir_file(ccos_disk_t* disk, ccos_inode_t* dir, const char* name, size_t length,
+                                       ccos_inode_t** file) {
+  *file = NULL;
+  const ccos_parsed_dir_t* cached = NULL;
+  ccos_error_t err = ccos_get_cached_dir(disk, dir, &cached);
+  if (err != CCOS_OK) {
+    return err;
+  }
+
+  ccos_parsed_dir_t* parsed = get_dir_cache_entry(disk, dir);
+  if (parsed->name_index == NULL && build_name_index(parsed) != CCOS_OK) {
+    drop_name_index(parsed);
+    for (size_t i = 0; i < parsed->count; ++i) {
+      if (parsed->elements[i].file != NULL && is_file_named(parsed->elements[i].file, name, length)) {
+        *file = parsed->elements[i].file;
+        return CCOS_OK;
+      }
+    }
+
+    return CCOS_ENOENT;
+  }
+
+  *file = parsed->name_index[find_name_index_slot(parsed, name, length)];
+  return *file != NULL ? CCOS_OK : CCOS_ENOENT;
+}
+
+void ccos_invalidate_dir_cache(ccos_disk_t* disk, uint16_t dir_id) {
+  ccos_parsed_dir_t* entries = ccos_disk_dir_cache(disk);
+  if (entries == NULL) {
+    return;
+  }
+
+  if (dir_id != CCOS_INVALID_BLOCK) {
+    ccos_parsed_dir_t* entry = &entries[dir_id % CCOS_DIR_CACHE_SIZE];
+    if (entry->dir_id == dir_id) {
+      TRACE("Dropping cached contents of directory 0x%x", dir_id);
+      ccos_free_parsed_dir(entry);
+    }
+
+    return;
+  }
+
+  for (size_t i = 0; i < CCOS_DIR_CACHE_SIZE; ++i) {
+    ccos_free_parsed_dir(&entries[i]);
+  }
+
+  ccos_drop_image_names(disk);
+}
+
+#define CCOS_IMAGE_NAMES_MIN_SIZE 64
+#define CCOS_MAX_DIR_DEPTH 32
+
+static size_t get_image_name_home(const ccos_image_names_t* names, const ccos_inode_t* file) {
+  return hash_file_name(file->desc.name, file->desc.name_length) & (names->size - 1);
+}
+
+static void put_image_name(ccos_image_names_t* names, ccos_inode_t* file, ccos_inode_t* parent) {
+  size_t mask = names->size - 1;
+  size_t slot = get_image_name_home(names, file);
+  while (names->slots[slot].file != NULL) {
+    slot = (slot + 1) & mask;
+  }
+
+  names->slots[slot] = (ccos_image_name_t){.file = file, .parent = parent};
+  names->count++;
+}
+
+// Keeps the load factor at most 1/2, as the directory name index does.
+static ccos_error_t reserve_image_names(ccos_image_names_t* names, size_t count) {
+  size_t size = CCOS_IMAGE_NAMES_MIN_SIZE;
+  while (size < count * 2) {
+    size *= 2;
+  }
+
+  if (size <= names->size) {
+    return CCOS_OK;
+  }
+
+  ccos_image_name_t* slots = calloc(size, sizeof(ccos_image_name_t));
+  if (slots == NULL) {
+    return CCOS_ENOMEM;
+  }
+
+  ccos_image_name_t* old_slots = names->slots;
+  size_t old_size = names->size;
+  names->slots = slots;
+  names->size = size;
+  names->count = 0;
+  for (size_t i = 0; i < old_size; ++i) {
+    if (old_slots[i].file != NULL) {
+      put_image_name(names, old_slots[i].file, old_slots[i].parent);
+    }
+  }
+
+  free(old_slots);
+  return CCOS_OK;
+}
+
+// Walk all the directories of the image once, starting from the root. Files are put into the index in no particular
+// order, lookups sort the files they find.
+static ccos_error_t build_image_names(ccos_disk_t* disk) {
+  ccos_drop_image_names(disk);
+  ccos_image_names_t* names = ccos_disk_image_names(disk);
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+  if (root == NULL) {
+    return CCOS_EIO;
+  }
+
+  size_t dirs_capacity = 16;
+  size_t dirs_count = 0;
+  ccos_inode_t** dirs = calloc(dirs_capacity, sizeof(ccos_inode_t*));
+  if (dirs == NULL) {
+    return CCOS_ENOMEM;
+  }
+
+  dirs[dirs_count++] = root;
+  ccos_error_t err = CCOS_OK;
+  while (dirs_count > 0 && err == CCOS_OK) {
+    ccos_inode_t* dir = dirs[--dirs_count];
+    const ccos_parsed_dir_t* parsed = NULL;
+    err = ccos_get_cached_dir(disk, dir, &parsed);
+    if (err == CCOS_OK) {
+      err = reserve_image_names(names, names->count + parsed->count);
+    }
+
+    for (size_t i = 0; err == CCOS_OK && i < parsed->count; ++i) {
+      ccos_inode_t* file = parsed->elements[i].file;
+      if (file == NULL) {
+        continue;
+      }
+
+      put_image_name(names, file, dir);
+      if (!ccos_is_dir(file)) {
+        continue;
+      }
+
+      if (dirs_count == dirs_capacity) {
+        ccos_inode_t** new_dirs = realloc(dirs, dirs_capacity * 2 * sizeof(ccos_inode_t*));
+        if (new_dirs == NULL) {
+          err = CCOS_ENOMEM;
+          break;
+        }
+
+        dirs = new_dirs;
+        dirs_capacity *= 2;
+      }
+
+      dirs[dirs_count++] = file;
+    }
+  }
+
+  free(dirs);
+  if (err != CCOS_OK) {
+    ccos_drop_image_names(disk);
+    return err;
+  }
+
+  TRACE("Indexed %zu files of the image", names->count);
+  names->valid = true;
+  return CCOS_OK;
+}
+
+typedef struct {
+  ccos_inode_t* file;
+  size_t depth;
+  size_t path[CCOS_MAX_DIR_DEPTH];   // positions of the file and its ancestors in their directories, from the file up
+} image_file_position_t;
+
+static size_t find_dir_entry_position(const ccos_parsed_dir_t* parsed, const ccos_inode_t* file) {
+  ccos_dir_key_t key;
+  ccos_make_dir_key(file, &key);
+  size_t index = ccos_find_parsed_dir_index(parsed, &key);
+  if (index < parsed->count && parsed->elements[index].file == file) {
+    return index;
+  }
+
+  for (index = 0; index < parsed->count && parsed->elements[index].file != file; ++index) {
+  }
+
+  return index;
+}
+
+static void get_image_file_position(ccos_disk_t* disk, ccos_inode_t* file, ccos_inode_t* parent,
+                                    image_file_position_t* position) {
+  position->file = file;
+  position->depth = 0;
+  while (parent != NULL && position->depth < CCOS_MAX_DIR_DEPTH) {
+    const ccos_parsed_dir_t* parsed = NULL;
+    if (ccos_get_cached_dir(disk, parent, &parsed) != CCOS_OK) {
+      return;
+    }
+
+    position->path[position->depth++] = find_dir_entry_position(parsed, file);
+    if (ccos_is_root_dir(parent)) {
+      return;
+    }
+
+    file = parent;
+    parent = ccos_get_parent_dir(disk, parent);
+  }
+}
+
+// Depth-first order of the image: directory goes right before its contents, entries of a directory go in its order.
+static int compare_image_file_positions(const image_file_position_t* a, const image_file_position_t* b) {
+  for (size_t i = 1; i <= a->depth && i <= b->depth; ++i) {
+    size_t a_index = a->path[a->depth - i];
+    size_t b_index = b->path[b->depth - i];
+    if (a_index != b_index) {
+      return a_index < b_index ? -1 : 1;
+    }
+  }
+
+  return a->depth == b->depth ? 0 : (a->depth < b->depth ? -1 : 1);
+}
+
+ccos_error_t ccos_find_image_files(ccos_disk_t* disk, const char* name, size_t length, ccos_inode_t*** files,
+                                   size_t* count) {
+  *files = NULL;
+  *count = 0;
+  ccos_image_names_t* names = ccos_disk_image_names(disk);
+  if (!names->valid) {
+    ccos_error_t err = build_image_names(disk);
+    if (err != CCOS_OK) {
+      return err;
+    }
+  }
+
+  size_t mask = names->size - 1;
+  size_t found_count = 0;
+  for (size_t slot = hash_file_name(name, length) & mask; names->slots[slot].file != NULL; slot = (slot + 1) & mask) {
+    if (is_file_named(names->slots[slot].file, name, length)) {
+      found_count++;
+    }
+  }
+
+  if (found_count == 0) {
+    return CCOS_ENOENT;
+  }
+
+  image_file_position_t* positions = calloc(found_count, sizeof(image_file_position_t));
+  ccos_inode_t** found = calloc(found_count, sizeof(ccos_inode_t*));
+  if (positions == NULL || found == NULL) {
+    free(found);
+    free(positions);
+    return CCOS_ENOMEM;
+  }
+
+  // Same-named files are rare, so they are sorted by insertion.
+  size_t index = 0;
+  for (size_t slot = hash_file_name(name, length) & mask; names->slots[slot].file != NULL; slot = (slot + 1) & mask) {
+    if (!is_file_named(names->slots[slot].file, name, length)) {
+      continue;
+    }
+
+    image_file_position_t position;
+    get_image_file_position(disk, names->slots[slot].file, names->slots[slot].parent, &position);
+    size_t i = index++;
+    for (; i > 0 && compare_image_file_positions(&positions[i - 1], &position) > 0; --i) {
+      positions[i] = positions[i - 1];
+    }
+
+    positions[i] = position;
+  }
+
+  for (size_t i = 0; i < found_count; ++i) {
+    found[i] = positions[i].file;
+  }
+
+  free(positions);
+  *files = found;
+  *count = found_count;
+  return CCOS_OK;
+}
+
+void ccos_add_image_names(ccos_disk_t* disk, ccos_inode_t* dir, ccos_inode_t** files, size_t count) {
+  ccos_image_names_t* names = ccos_disk_image_names(disk);
+  if (names == NULL || !names->valid) {
+    return;
+  }
+
+  if (reserve_image_names(names, names->count + count) != CCOS_OK) {
+    ccos_drop_image_names(disk);
+    return;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    if (files[i] != NULL) {
+      put_image_name(names, files[i], dir);
+    }
+  }
+}
+
+void ccos_remove_image_name(ccos_disk_t* disk, const ccos_inode_t* file) {
+  ccos_image_names_t* names = ccos_disk_image_names(disk);
+  if (names == NULL || !names->valid || file == NULL) {
+    return;
+  }
+
+  size_t mask = names->size - 1;
+  size_t slot = get_image_name_home(names, file);
+  while (names->slots[slot].file != NULL && names->slots[slot].file != file) {
+    slot = (slot + 1) & mask;
+  }
+
+  if (names->slots[slot].file == NULL) {
+    return;
+  }
+
+  // Backward shift deletion, see remove_name_index_file().
+  names->slots[slot] = (ccos_image_name_t){0};
+  names->count--;
+  for (size_t next = (slot + 1) & mask; names->slots[next].file != NULL; next = (next + 1) & mask) {
+    size_t home = get_image_name_home(names, names->slots[next].file);
+    if (slot <= next ? (slot < home && home <= next) : (slot < home || home <= next)) {
+      continue;
+    }
+
+    names->slots[slot] = names->slots[next];
+    names->slots[next] = (ccos_image_name_t){0};
+    slot = next;
+  }
+}
+
+void ccos_drop_image_names(ccos_disk_t* disk) {
+  ccos_image_names_t* names = ccos_disk_image_names(disk);
+  if (names == NULL) {
+    return;
+  }
+
+  free(names->slots);
+  *names = (ccos_image_names_t){0};
+}
+
+
+/* -------------------------------------------------------------------------- */
+/*                             BITMASK OPERATIONS                             */
+/* -------------------------------------------------------------------------- */
+
+static ccos_bitmask_t* get_bitmask(ccos_disk_t* disk) {
+  ccos_bitmask_t* bitmask = ccos_disk_read(disk, ccos_disk_bitmap(disk));
+  if (bitmask == NULL) {
+    return NULL;
+  }
+
+  if (bitmask->header.file_id != ccos_disk_bitmap(disk)) {
+    // TODO: return error.
+    return NULL;
+  }
+
+  return bitmask;
+}
+
+ccos_bitmask_list_t ccos_find_bitmask_sectors(ccos_disk_t* disk) {
+  ccos_bitmask_list_t result = {0};
+  ccos_bitmask_t* first_bitmask_block = get_bitmask(disk);
+  if (first_bitmask_block == NULL) {
+    fprintf(stderr, "Unable to get bitmask blocks: No bitmask in image!\n");
+    return result;
+  }
+
+  size_t block_size = ccos_disk_sector_size(disk);
+
+  uint16_t bitmask_id = first_bitmask_block->header.file_id;
+  uint32_t bitmask_addr = bitmask_id * block_size;
+
+  for (size_t i = 0; i < MAX_BITMASK_BLOCKS_IN_IMAGE; i++) {
+    uint32_t offset = bitmask_addr + i * block_size;
+    ccos_block_header_t* header = (ccos_block_header_t*)ccos_disk_read(disk, (uint16_t)(offset / block_size));
+    if (header != NULL && header->file_id == bitmask_id) {
+      if (header->file_fragment_index != i) {
+        fprintf(stderr, "WARN: 0x%x: Invalid bitmask fragment index: expected: " SIZE_T "; actual: %d!\n", offset, i,
+                header->file_fragment_index);
+      }
+
+      result.bitmask_blocks[i] = (ccos_bitmask_t*)header;
+      result.length = i + 1;
+    } else {
+      // previous block was the last bitnmask block
+      break;
+    }
+  }
+
+  return result;
+}
+
+static ccos_error_t validate_bitmask_list(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list,
+                                           size_t block_count) {
+  if (bitmask_list == NULL || bitmask_list->length == 0) {
+    return CCOS_EINVAL;
+  }
+
+  size_t bitmask_blocks = ccos_get_bitmask_sectors(disk);
+  size_t bitmask_capacity = bitmask_list->length * bitmask_blocks;
+  if (block_count > bitmask_capacity) {
+    return CCOS_ERANGE;
+  }
+
+  if (bitmask_list->bitmask_blocks[0] == NULL ||
+      bitmask_list->bitmask_blocks[0]->allocated > block_count) {
+    return CCOS_EINVAL;
+  }
+
+  for (size_t i = 1; i < bitmask_list->length; ++i) {
+    if (bitmask_list->bitmask_blocks[i] == NULL) {
+      return CCOS_EINVAL;
+    }
+  }
+
+  return CCOS_OK;
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define POPCOUNT64(x) ((size_t)__builtin_popcountll(x))
+#define CTZ64(x) ((size_t)__builtin_ctzll(x))
+#else
+static size_t popcount64(uint64_t x) {
+  x = x - ((x >> 1u) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2u) & 0x3333333333333333ULL);
+  x = (x + (x >> 4u)) & 0x0F0F0F0F0F0F0F0FULL;
+  return (size_t)((x * 0x0101010101010101ULL) >> 56u);
+}
+
+static size_t ctz64(uint64_t x) {
+  return popcount64((x & (~x + 1)) - 1);
+}
+
+#define POPCOUNT64(x) popcount64(x)
+#define CTZ64(x) ctz64(x)
+#endif
+
+// Load up to 64 bits of the bitmap starting at the given bit (which must be a multiple of 8), so that bit N of the
+// result is the allocation bit of block (start + N). Bytes past the end of the bitmap read as zeros.
+static uint64_t load_bitmask_word(const uint8_t* bytes, size_t bytes_count, size_t start) {
+  const uint8_t* p = bytes + start / 8;
+  size_t length = bytes_count - start / 8;
+  if (length >= sizeof(uint64_t)) {
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8u | (uint64_t)p[2] << 16u | (uint64_t)p[3] << 24u |
+           (uint64_t)p[4] << 32u | (uint64_t)p[5] << 40u | (uint64_t)p[6] << 48u | (uint64_t)p[7] << 56u;
+  }
+
+  uint64_t word = 0;
+  for (size_t i = 0; i < length; ++i) {
+    word |= (uint64_t)p[i] << (8u * i);
+  }
+
+  return word;
+}
+
+// Mask of `bits` lowest bits, bits <= 64.
+static uint64_t low_bits_mask(size_t bits) {
+  return bits >= 64 ? UINT64_MAX : ((uint64_t)1 << bits) - 1;
+}
+
+// Counting and searching handle one bitmask block at a time: bitmask blocks store a whole number of bytes, which is
+// not a multiple of 8, so 64-bit words never cross a bitmask block boundary.
+static size_t count_free_bitmask_blocks(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list,
+                                        size_t block_count) {
+  size_t bitmask_blocks = ccos_get_bitmask_sectors(disk);
+  size_t bitmask_size = ccos_get_bitmask_size(disk);
+  size_t free_count = 0;
+
+  for (size_t base = 0, i = 0; base < block_count && i < bitmask_list->length; base += bitmask_blocks, ++i) {
+    size_t bits = block_count - base < bitmask_blocks ? block_count - base : bitmask_blocks;
+    const uint8_t* bytes = ccos_get_bitmask_bytes(bitmask_list->bitmask_blocks[i]);
+
+    size_t allocated = 0;
+    for (size_t bit = 0; bit < bits; bit += 64) {
+      uint64_t word = load_bitmask_word(bytes, bitmask_size, bit) & low_bits_mask(bits - bit);
+      allocated += POPCOUNT64(word);
+    }
+
+    free_count += bits - allocated;
+  }
+
+  return free_count;
+}
+
+// Bitmap summary groups match 64-bit words of the bitmask blocks.
+#define BITMAP_GROUP_BITS 64
+
+static size_t get_group_start(ccos_disk_t* disk, const ccos_bitmap_summary_t* summary, size_t group) {
+  return (group / summary->groups_per_bitmask) * ccos_get_bitmask_sectors(disk) +
+         (group % summary->groups_per_bitmask) * BITMAP_GROUP_BITS;
+}
+
+static size_t get_block_group(ccos_disk_t* disk, const ccos_bitmap_summary_t* summary, size_t block) {
+  size_t bitmask_blocks = ccos_get_bitmask_sectors(disk);
+  size_t bitmask_index = block / bitmask_blocks;
+  return bitmask_index * summary->groups_per_bitmask + (block - bitmask_index * bitmask_blocks) / BITMAP_GROUP_BITS;
+}
+
+// Number of image blocks in the group: the last group of a bitmask block is shorter, and groups past the end of the
+// image are empty.
+static size_t get_group_size(ccos_disk_t* disk, const ccos_bitmap_summary_t* summary, size_t group) {
+  size_t bitmask_blocks = ccos_get_bitmask_sectors(disk);
+  size_t block_count = ccos_disk_size(disk) / ccos_disk_sector_size(disk);
+  size_t local_start = (group % summary->groups_per_bitmask) * BITMAP_GROUP_BITS;
+  size_t start = get_group_start(disk, summary, group);
+
+  size_t end = start + (bitmask_blocks - local_start < BITMAP_GROUP_BITS ? bitmask_blocks - local_start
+                                                                         : BITMAP_GROUP_BITS);
+  if (end > block_count) {
+    end = block_count;
+  }
+
+  return end > start ? end - start : 0;
+}
+
+static void set_summary_bit(uint64_t* bits, size_t index, bool value) {
+  if (value) {
+    bits[index / 64] |= (uint64_t)1 << (index % 64);
+  } else {
+    bits[index / 64] &= ~((uint64_t)1 << (index % 64));
+  }
+}
+
+static void set_group_free_count(ccos_bitmap_summary_t* summary, size_t group, size_t free_count, size_t group_size) {
+  summary->free_count[group] = (uint8_t)free_count;
+  set_summary_bit(summary->nonfull, group, free_count > 0);
+  set_summary_bit(summary->nonempty, group, free_count < group_size);
+}
+
+// Return first group in [from, groups_count) which bit is set, or groups_count if there is none.
+static size_t find_summary_group(const uint64_t* bits, size_t groups_count, size_t from) {
+  while (from < groups_count) {
+    size_t word_start = from & ~(size_t)63;
+    uint64_t word = bits[from / 64] & ~low_bits_mask(from - word_start);
+    if (word != 0) {
+      size_t group = word_start + CTZ64(word);
+      return group < groups_count ? group : groups_count;
+    }
+
+    from = word_start + 64;
+  }
+
+  return groups_count;
+}
+
+static void free_bitmap_summary(ccos_bitmap_summary_t* summary) {
+  free(summary->free_count);
+  free(summary->nonfull);
+  free(summary->nonempty);
+  memset(summary, 0, sizeof(ccos_bitmap_summary_t));
+}
+
+// Return bitmap summary of the disk, building it if needed, or NULL if it can't be built. Bitmask list should be valid.
+static const ccos_bitmap_summary_t* get_bitmap_summary(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list) {
+  ccos_bitmap_summary_t* summary = ccos_disk_bitmap_summary(disk);
+  if (summary == NULL) {
+    return NULL;
+  }
+
+  size_t bitmask_blocks = ccos_get_bitmask_sectors(disk);
+  size_t groups_per_bitmask = (bitmask_blocks + BITMAP_GROUP_BITS - 1) / BITMAP_GROUP_BITS;
+  size_t groups_count = groups_per_bitmask * bitmask_list->length;
+  if (summary->valid && summary->groups_count == groups_count) {
+    return summary;
+  }
+
+  TRACE("Building bitmap summary of " SIZE_T " groups...", groups_count);
+
+  size_t words_count = (groups_count + 63) / 64;
+  if (summary->groups_count != groups_count || summary->free_count == NULL) {
+    free_bitmap_summary(summary);
+    summary->free_count = calloc(groups_count, sizeof(uint8_t));
+    summary->nonfull = calloc(words_count, sizeof(uint64_t));
+    summary->nonempty = calloc(words_count, sizeof(uint64_t));
+    if (summary->free_count == NULL || summary->nonfull == NULL || summary->nonempty == NULL) {
+      free_bitmap_summary(summary);
+      return NULL;
+    }
+
+    summary->groups_per_bitmask = groups_per_bitmask;
+    summary->groups_count = groups_count;
+  }
+
+  size_t bitmask_size = ccos_get_bitmask_size(disk);
+  for (size_t group = 0; group < groups_count; ++group) {
+    size_t group_size = get_group_size(disk, summary, group);
+    size_t local_start = (group % groups_per_bitmask) * BITMAP_GROUP_BITS;
+    const uint8_t* bytes = ccos_get_bitmask_bytes(bitmask_list->bitmask_blocks[group / groups_per_bitmask]);
+    uint64_t word = group_size == 0 ? 0 : load_bitmask_word(bytes, bitmask_size, local_start);
+
+    set_group_free_count(summary, group, group_size - POPCOUNT64(word & low_bits_mask(group_size)), group_size);
+  }
+
+  summary->valid = true;
+  return summary;
+}
+
+// Keep valid bitmap summary in sync with a single block flipped in the bitmap.
+static void update_bitmap_summary(ccos_disk_t* disk, size_t block, bool allocated) {
+  ccos_bitmap_summary_t* summary = ccos_disk_bitmap_summary(disk);
+  if (summary == NULL || !summary->valid || block >= ccos_disk_size(disk) / ccos_disk_sector_size(disk)) {
+    return;
+  }
+
+  size_t group = get_block_group(disk, summary, block);
+  size_t free_count = summary->free_count[group] + (allocated ? -1 : 1);
+  set_group_free_count(summary, group, free_count, get_group_size(disk, summary, group));
+}
+
+void ccos_invalidate_bitmap_summary(ccos_disk_t* disk) {
+  ccos_bitmap_summary_t* summary = ccos_disk_bitmap_summary(disk);
+  if (summary != NULL) {
+    summary->valid = false;
+  }
+}
+
+bool ccos_validate_disk_bitmap(ccos_disk_t* disk) {
+  ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
+  size_t block_count = ccos_disk_size(disk) / ccos_disk_sector_size(disk);
+  if (validate_bitmask_list(disk, &bitmask_list, block_count) != CCOS_OK) {
+    return false;
+  }
+
+  bool valid = true;
+  uint16_t expected_allocated = bitmask_list.bitmask_blocks[0]->allocated;
+  for (size_t i = 0; i < bitmask_list.length; i++) {
+    ccos_bitmask_t* bitmask = bitmask_list.bitmask_blocks[i];
+    uint16_t checksum = ccos_calc_bitmask_checksum(disk, bitmask);
+    if (bitmask->checksum != checksum) {
+      fprintf(stderr, "Warn: bitmask #" SIZE_T " checksum mismatch! Expected: 0x%x, got: 0x%x!\n", i,
+              bitmask->checksum, checksum);
+      valid = false;
+    }
+  }
+
+  size_t free_count = count_free_bitmask_blocks(disk, &bitmask_list, block_count);
+  if ((block_count - expected_allocated) != free_count) {
+    fprintf(stderr, "Warn: free block count (" SIZE_T ") mismatches found free blocks (" SIZE_T ")!\n",
+            block_count - expected_allocated, free_count);
+    valid = false;
+  }
+
+  return valid;
+}
+
+// Return first block in [from, to) which is allocated (or free, if `allocated` is false), or `to` if there is none.
+static size_t find_bitmask_block(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list, size_t from, size_t to,
+                                 bool allocated) {
+  size_t bitmask_blocks = ccos_get_bitmask_sectors(disk);
+  size_t bitmask_size = ccos_get_bitmask_size(disk);
+  const ccos_bitmap_summary_t* summary = get_bitmap_summary(disk, bitmask_list);
+
+  while (from < to) {
+    if (summary != NULL) {
+      // Skip groups which have no blocks we are looking for.
+      size_t group = get_block_group(disk, summary, from);
+      size_t next = find_summary_group(allocated ? summary->nonempty : summary->nonfull, summary->groups_count, group);
+      if (next == summary->groups_count) {
+        return to;
+      }
+
+      if (next != group) {
+        from = get_group_start(disk, summary, next);
+        continue;
+      }
+    }
+
+    size_t bitmask_index = from / bitmask_blocks;
+    size_t base = bitmask_index * bitmask_blocks;
+    size_t local_block = from - base;
+    size_t local_end = to - base < bitmask_blocks ? to - base : bitmask_blocks;
+    const uint8_t* bytes = ccos_get_bitmask_bytes(bitmask_list->bitmask_blocks[bitmask_index]);
+
+    size_t word_start = local_block & ~(size_t)(BITMAP_GROUP_BITS - 1);
+    uint64_t word = load_bitmask_word(bytes, bitmask_size, word_start);
+    if (!allocated) {
+      word = ~word;
+    }
+
+    word &= ~low_bits_mask(local_block - word_start);
+    word &= low_bits_mask(local_end - word_start);
+    if (word != 0) {
+      return base + word_start + CTZ64(word);
+    }
+
+    size_t word_end = word_start + BITMAP_GROUP_BITS;
+    from = base + (word_end < local_end ? word_end : local_end);
+  }
+
+  return to;
+}
+
+uint16_t ccos_get_free_sector(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list) {
+  size_t block_count = ccos_disk_size(disk) / ccos_disk_sector_size(disk);
+
+  if (validate_bitmask_list(disk, bitmask_list, block_count) != CCOS_OK) {
+    return CCOS_INVALID_BLOCK;
+  }
+
+  ccos_allocator_t* allocator = ccos_disk_allocator(disk);
+  size_t cursor = allocator->cursor < block_count ? allocator->cursor : 0;
+
+  size_t block = find_bitmask_block(disk, bitmask_list, cursor, block_count, false);
+  if (block == block_count) {
+    block = find_bitmask_block(disk, bitmask_list, 0, cursor, false);
+    if (block == cursor) {
+      return CCOS_INVALID_BLOCK;
+    }
+  }
+
+  allocator->cursor = block;
+  return (uint16_t)block;
+}
+
+uint16_t ccos_allocate_sector(ccos_disk_t* disk, ccos_bitmask_list_t* bitmask_list) {
+  uint16_t block = ccos_get_free_sector(disk, bitmask_list);
+  if (block == CCOS_INVALID_BLOCK) {
+    return CCOS_INVALID_BLOCK;
+  }
+
+  ccos_mark_sector(disk, bitmask_list, block, 1);
+  ccos_disk_allocator(disk)->cursor = (size_t)block + 1;
+
+  return block;
+}
+
+ccos_error_t ccos_allocate_sectors(ccos_disk_t* disk, ccos_bitmask_list_t* bitmask_list, size_t count,
+                                   uint16_t* sectors) {
+  if (bitmask_list == NULL || (sectors == NULL && count > 0)) {
+    return CCOS_EINVAL;
+  }
+
+  size_t block_count = ccos_disk_size(disk) / ccos_disk_sector_size(disk);
+  ccos_error_t err = validate_bitmask_list(disk, bitmask_list, block_count);
+  if (err != CCOS_OK) {
+    return err;
+  }
+
+  if (count == 0) {
+    return CCOS_OK;
+  }
+
+  ccos_allocator_t* allocator = ccos_disk_allocator(disk);
+  size_t cursor = allocator->cursor < block_count ? allocator->cursor : 0;
+
+  // Walk free runs starting from the cursor. The first run long enough for the whole request wins; until it's found,
+  // free blocks are collected in the order of the walk, as a fallback for a fragmented disk.
+  size_t found = 0;
+  bool contiguous = false;
+  for (int pass = 0; pass < 2 && !contiguous; ++pass) {
+    size_t from = pass == 0 ? cursor : 0;
+    size_t to = pass == 0 ? block_count : cursor;
+
+    while (from < to) {
+      size_t run_start = find_bitmask_block(disk, bitmask_list, from, to, false);
+      if (run_start == to) {
+        break;
+      }
+
+      size_t run_end = find_bitmask_block(disk, bitmask_list, run_start, to, true);
+      if (run_end - run_start >= count) {
+        for (size_t i = 0; i < count; ++i) {
+          sectors[i] = (uint16_t)(run_start + i);
+        }
+
+        contiguous = true;
+        break;
+      }
+
+      for (size_t block = run_start; block < run_end && found < count; ++block) {
+        sectors[found++] = (uint16_t)block;
+      }
+
+      from = run_end;
+    }
+  }
+
+  if (!contiguous && found < count) {
+    TRACE("Unable to allocate " SIZE_T " blocks: only " SIZE_T " are free", count, found);
+    return CCOS_ENOSPC;
+  }
+
+  TRACE("Allocating " SIZE_T " %s blocks starting at 0x%x", count, contiguous ? "contiguous" : "fragmented", sectors[0]);
+
+  ccos_begin_bitmask_update(disk);
+  for (size_t i = 0; i < count; ++i) {
+    ccos_mark_sector(disk, bitmask_list, sectors[i], 1);
+  }
+  ccos_commit_bitmask_update(disk, bitmask_list);
+
+  allocator->cursor = (size_t)sectors[count - 1] + 1;
+  return CCOS_OK;
+}
+
+ccos_error_t ccos_find_free_run(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list, size_t count,
+                                ccos_fit_policy_t policy, uint16_t* start) {
+  if (bitmask_list == NULL || start == NULL || count == 0) {
+    return CCOS_EINVAL;
+  }
+
+  size_t block_count = ccos_disk_size(disk) / ccos_disk_sector_size(disk);
+  ccos_error_t err = validate_bitmask_list(disk, bitmask_list, block_count);
+  if (err != CCOS_OK) {
+    return err;
+  }
+
+  // Sliding window of summary groups [window_first, window_end) that a run starting in window_first can reach, with
+  // the count of free blocks in them: if there are less than `count`, no run can start in window_first.
+  const ccos_bitmap_summary_t* summary = get_bitmap_summary(disk, bitmask_list);
+  size_t window_first = 0;
+  size_t window_end = 0;
+  size_t window_free = 0;
+
+  size_t best_start = block_count;
+  size_t best_length = 0;
+  for (size_t from = 0; from < block_count;) {
+    size_t run_start = find_bitmask_block(disk, bitmask_list, from, block_count, false);
+    if (run_start == block_count) {
+      break;
+    }
+
+    if (summary != NULL) {
+      size_t group = get_block_group(disk, summary, run_start);
+      if (window_end < group) {
+        window_first = window_end = group;
+        window_free = 0;
+      }
+
+      for (; window_first < group; ++window_first) {
+        window_free -= summary->free_count[window_first];
+      }
+
+      size_t reach = get_group_start(disk, summary, group) + get_group_size(disk, summary, group) + count - 1;
+      for (; window_end < summary->groups_count && get_group_start(disk, summary, window_end) < reach; ++window_end) {
+        window_free += summary->free_count[window_end];
+      }
+
+      if (window_free < count) {
+        from = get_group_start(disk, summary, group + 1);
+        continue;
+      }
+    }
+
+    size_t run_end = find_bitmask_block(disk, bitmask_list, run_start, block_count, true);
+    size_t run_length = run_end - run_start;
+    if (run_length >= count && (best_length == 0 || run_length < best_length)) {
+      best_start = run_start;
+      best_length = run_length;
+      if (policy == CCOS_FIT_FIRST || run_length == count) {
+        break;
+      }
+    }
+
+    from = run_end;
+  }
+
+  if (best_length == 0) {
+    TRACE("Unable to find " SIZE_T " contiguous free blocks", count);
+    return CCOS_ENOSPC;
+  }
+
+  *start = (uint16_t)best_start;
+  return CCOS_OK;
+}
+
+ccos_error_t ccos_get_free_sectors_count(ccos_disk_t* disk, ccos_bitmask_list_t* bitmask_list,
+                                   size_t* free_blocks_count) {
+  if (bitmask_list == NULL || free_blocks_count == NULL) {
+    return CCOS_EINVAL;
+  }
+
+  size_t block_count = ccos_disk_size(disk) / ccos_disk_sector_size(disk);
+  ccos_error_t err = validate_bitmask_list(disk, bitmask_list, block_count);
+  if (err != CCOS_OK) {
+    return err;
+  }
+
+  *free_blocks_count = count_free_bitmask_blocks(disk, bitmask_list, block_count);
+  TRACE("Free blocks: %zu", *free_blocks_count);
+
+  return CCOS_OK;
+}
+
+ccos_error_t ccos_get_allocated_sectors_count(ccos_disk_t* disk, ccos_bitmask_list_t* bitmask_list,
+                                              size_t* allocated_count) {
+  if (bitmask_list == NULL || allocated_count == NULL) {
+    return CCOS_EINVAL;
+  }
+
+  size_t block_count = ccos_disk_size(disk) / ccos_disk_sector_size(disk);
+  ccos_error_t err = validate_bitmask_list(disk, bitmask_list, block_count);
+  if (err != CCOS_OK) {
+    return err;
+  }
+
+  int32_t allocated = (int32_t)bitmask_list->bitmask_blocks[0]->allocated + ccos_disk_allocator(disk)->pending_allocated;
+  if (allocated < 0 || (size_t)allocated > block_count) {
+    return CCOS_EINVAL;
+  }
+
+  *allocated_count = (size_t)allocated;
+  TRACE("Allocated blocks: %zu", *allocated_count);
+
+  return CCOS_OK;
+}
+
+ccos_error_t ccos_reconcile_allocated_count(ccos_disk_t* disk, ccos_bitmask_list_t* bitmask_list, bool repair,
+                                            size_t* free_blocks_count) {
+  if (bitmask_list == NULL || free_blocks_count == NULL || bitmask_list->length == 0 ||
+      ccos_disk_allocator(disk)->batch_depth != 0) {
+    return CCOS_EINVAL;
+  }
+
+  size_t block_count = ccos_disk_size(disk) / ccos_disk_sector_size(disk);
+  size_t bitmask_capacity = bitmask_list->length * ccos_get_bitmask_sectors(disk);
+  if (block_count > bitmask_capacity) {
+    return CCOS_ERANGE;
+  }
+
+  size_t free_count = count_free_bitmask_blocks(disk, bitmask_list, block_count);
+  uint16_t allocated = (uint16_t)(block_count - free_count);
+  *free_blocks_count = free_count;
+
+  bool consistent = true;
+  for (size_t i = 0; i < bitmask_list->length; i++) {
+    ccos_bitmask_t* bitmask = bitmask_list->bitmask_blocks[i];
+    if (bitmask == NULL) {
+      return CCOS_EINVAL;
+    }
+
+    if (bitmask->allocated != allocated) {
+      fprintf(stderr, "Warn: bitmask #" SIZE_T " allocated count (%u) mismatches allocated blocks (%u)!\n", i,
+              bitmask->allocated, allocated);
+      consistent = false;
+    }
+  }
+
+  if (consistent) {
+    return CCOS_OK;
+  }
+
+  if (!repair) {
+    return CCOS_EINVAL;
+  }
+
+  // Recompute checksums from scratch: a delta update would preserve a checksum that is broken as well.
+  for (size_t i = 0; i < bitmask_list->length; i++) {
+    bitmask_list->bitmask_blocks[i]->allocated = allocated;
+    ccos_update_bitmask_checksum(disk, bitmask_list->bitmask_blocks[i]);
+  }
+
+  return CCOS_OK;
+}
+
+void ccos_mark_sector(ccos_disk_t* disk, ccos_bitmask_list_t* bitmask_list, uint16_t block, uint8_t mode) {
+  TRACE("Mark block %x as %s...", block, mode ? "used" : "free");
+
+  size_t bitmask_blocks = ccos_get_bitmask_sectors(disk);
+
+  if (block >= bitmask_list->length * bitmask_blocks) {
+    fprintf(stderr, "Unable to mark block 0x%x: out of bitmask bounds of %lx!\n", block,
+            bitmask_list->length * bitmask_blocks);
+    return;
+  }
+
+  size_t bitmask_index = block / bitmask_blocks;
+  size_t local_block = block - (bitmask_index * bitmask_blocks);
+  ccos_bitmask_t* bitmask = bitmask_list->bitmask_blocks[bitmask_index];
+  uint8_t* byte = &ccos_get_bitmask_bytes(bitmask)[local_block >> 3u];
+  uint8_t value;
+  if (mode) {
+    value = *byte | (1u << (local_block & 0b111u));
+  } else {
+    value = *byte & ~(1u << (local_block & 0b111u));
+  }
+
+  if (value == *byte) {
+    // Already marked: neither the bitmap nor the "allocated" counter change.
+    return;
+  }
+
+  write_bitmask(disk, bitmask, byte, &value, sizeof(value));
+  update_bitmap_summary(disk, block, mode != 0);
+
+  ccos_allocator_t* allocator = ccos_disk_allocator(disk);
+  if (allocator->batch_depth > 0) {
+    allocator->pending_allocated += mode ? 1 : -1;
+    return;
+  }
+
+  for (size_t i = 0; i < bitmask_list->length; i++) {
+    // all bitmasks should have same "allocated" value (?)
+    bitmask = bitmask_list->bitmask_blocks[i];
+    uint16_t allocated = bitmask->allocated + (mode ? 1 : -1);
+    ccos_bitmask_write(disk, bitmask, &bitmask->allocated, &allocated, sizeof(allocated));
+  }
+}
+
+void ccos_begin_bitmask_update(ccos_disk_t* disk) {
+  ccos_disk_allocator(disk)->batch_depth++;
+}
+
+void ccos_commit_bitmask_update(ccos_disk_t* disk, ccos_bitmask_list_t* bitmask_list) {
+  ccos_allocator_t* allocator = ccos_disk_allocator(disk);
+  if (allocator->batch_depth == 0 || --allocator->batch_depth > 0) {
+    return;
+  }
+
+  TRACE("Commit bitmask update: allocated %+d", allocator->pending_allocated);
+
+  if (allocator->pending_allocated != 0) {
+    for (size_t i = 0; i < bitmask_list->length; i++) {
+      ccos_bitmask_t* bitmask = bitmask_list->bitmask_blocks[i];
+      uint16_t allocated = bitmask->allocated + allocator->pending_allocated;
+      ccos_bitmask_write(disk, bitmask, &bitmask->allocated, &allocated, sizeof(allocated));
+    }
+  }
+
+  allocator->pending_allocated = 0;
+}
+
+
+/* -------------------------------------------------------------------------- */
+/*                           LOW LEVEL FS OPERATIONS                          */
+/* -------------------------------------------------------------------------- */
+
+ccos_inode_t* ccos_init_inode(ccos_disk_t* disk, uint16_t block, uint16_t parent_dir_block) {
+  TRACE("Initializing inode at 0x%x!", block);
+  ccos_invalidate_file_sectors(disk, block);
+  ccos_invalidate_dir_cache(disk, block);
+  ccos_inode_t* inode = ccos_disk_read(disk, block);
+  memset(inode, 0, ccos_disk_sector_size(disk));
+  ccos_disk_mark_dirty(disk, inode, ccos_disk_sector_size(disk));
+  inode->header.file_id = block;
+  inode->desc.dir_file_id = parent_dir_block;
+  inode->content_inode_info.header.file_id = block;
+  inode->content_inode_info.block_next = CCOS_INVALID_BLOCK;
+  inode->content_inode_info.block_current = block;
+  inode->content_inode_info.block_prev = CCOS_INVALID_BLOCK;
+
+  size_t inode_max_blocks = ccos_get_inode_max_sectors(disk);
+  uint16_t* content_blocks = ccos_get_inode_content_sectors(inode);
+
+  for (int i = 0; i < inode_max_blocks; ++i) {
+    content_blocks[i] = CCOS_CONTENT_BLOCKS_END_MARKER;
+  }
+
+  ccos_update_inode_checksums(disk, inode);
+  return inode;
+}
+
+// Content blocks list at the end of the file: the one of the last content inode, or of the inode itself.
+static uint16_t* get_tail_sectors(ccos_disk_t* disk, ccos_inode_t* file, const ccos_file_tail_t* tail,
+                                  ccos_content_inode_t** content_inode, size_t* count) {
+  if (tail->content_inode == CCOS_INVALID_BLOCK) {
+    *content_inode = NULL;
+    *count = ccos_get_inode_max_sectors(disk);
+    return ccos_get_inode_content_sectors(file);
+  }
+
+  *content_inode = ccos_disk_read(disk, tail->content_inode);
+  *count = ccos_get_content_inode_max_sectors(disk);
+  return ccos_get_content_inode_content_sectors(*content_inode);
+}
+
+// The cached tail may be stale if the image was changed bypassing the tail updates (e.g. the file was deleted and its
+// inode reused); check that it still matches the image.
+static bool is_valid_file_tail(ccos_disk_t* disk, ccos_inode_t* file, const ccos_file_tail_t* tail) {
+  if (tail->file_id != file->header.file_id) {
+    return false;
+  }
+
+  if (tail->content_inode == CCOS_INVALID_BLOCK) {
+    if (file->content_inode_info.block_next != CCOS_INVALID_BLOCK) {
+      return false;
+    }
+  } else {
+    const ccos_content_inode_t* content_inode = ccos_disk_read(disk, tail->content_inode);
+    if (content_inode == NULL || content_inode->content_inode_info.header.file_id != file->header.file_id ||
+        content_inode->content_inode_info.block_current != tail->content_inode ||
+        content_inode->content_inode_info.block_next != CCOS_INVALID_BLOCK) {
+      return false;
+    }
+  }
+
+  ccos_content_inode_t* content_inode = NULL;
+  size_t count = 0;
+  const uint16_t* content_blocks = get_tail_sectors(disk, file, tail, &content_inode, &count);
+  if (tail->free_slot > count) {
+    return false;
+  }
+
+  return (tail->free_slot == 0 || content_blocks[tail->free_slot - 1] != CCOS_INVALID_BLOCK) &&
+         (tail->free_slot == count || content_blocks[tail->free_slot] == CCOS_INVALID_BLOCK);
+}
+
+static ccos_file_tail_t* get_file_tail(ccos_disk_t* disk, ccos_inode_t* file) {
+  ccos_file_tail_t* tail = ccos_disk_file_tail(disk);
+  if (is_valid_file_tail(disk, file, tail)) {
+    return tail;
+  }
+
+  TRACE("Looking up content inode chain tail of 0x%x...", file->header.file_id);
+  tail->file_id = file->header.file_id;
+  tail->content_inode = CCOS_INVALID_BLOCK;
+  for (uint16_t block = file->content_inode_info.block_next; block != CCOS_INVALID_BLOCK;) {
+    const ccos_content_inode_t* content_inode = ccos_disk_read(disk, block);
+    if (content_inode == NULL) {
+      break;
+    }
+
+    tail->content_inode = block;
+    block = content_inode->content_inode_info.block_next;
+  }
+
+  ccos_content_inode_t* content_inode = NULL;
+  size_t count = 0;
+  const uint16_t* content_blocks = get_tail_sectors(disk, file, tail, &content_inode, &count);
+  for (tail->free_slot = 0; tail->free_slot < count; ++tail->free_slot) {
+    if (content_blocks[tail->free_slot] == CCOS_INVALID_BLOCK) {
+      break;
+    }
+  }
+
+  return tail;
+}
+
+// Fill in a newly allocated content inode which follows `prev` in the chain. Its content blocks list is empty, and
+// the checksum is left for the caller to calculate.
+static void init_content_inode(ccos_disk_t* disk, ccos_content_inode_t* content_inode, uint16_t block,
+                               const ccos_block_data_t* prev) {
+  content_inode->content_inode_info.header.file_id = prev->header.file_id;
+  content_inode->content_inode_info.header.file_fragment_index = prev->header.file_fragment_index;
+  content_inode->content_inode_info.block_next = CCOS_INVALID_BLOCK;
+  content_inode->content_inode_info.block_current = block;
+  content_inode->content_inode_info.block_prev = prev->block_current;
+
+  memset(ccos_get_content_inode_content_sectors(content_inode), 0xFF,
+         ccos_get_content_inode_max_sectors(disk) * sizeof(uint16_t));
+  ccos_disk_mark_dirty(disk, content_inode, ccos_disk_sector_size(disk));
+}
+
+ccos_content_inode_t* ccos_add_content_inode(ccos_disk_t* disk, ccos_inode_t* file, ccos_bitmask_list_t* bitmask_list) {
+  ccos_block_data_t* content_inode_info = &(file->content_inode_info);
+  ccos_content_inode_t* last_content_inode = ccos_get_last_content_inode(disk, file);
+  if (last_content_inode != NULL) {
+    content_inode_info = &(last_content_inode->content_inode_info);
+  }
+
+  uint16_t new_block = ccos_allocate_sector(disk, bitmask_list);
+  if (new_block == CCOS_INVALID_BLOCK) {
+    fprintf(stderr, "Unable to allocate new content inode: No free space!\n");
+    return NULL;
+  }
+
+  ccos_content_inode_t* content_inode = ccos_disk_read(disk, new_block);
+  init_content_inode(disk, content_inode, new_block, content_inode_info);
+  ccos_update_content_inode_checksums(disk, content_inode);
+  if (last_content_inode != NULL) {
+    ccos_content_inode_write(disk, last_content_inode, &content_inode_info->block_next, &new_block, sizeof(new_block));
+  } else {
+    ccos_inode_write(disk, file, &content_inode_info->block_next, &new_block, sizeof(new_block));
+  }
+
+  ccos_file_tail_t* tail = ccos_disk_file_tail(disk);
+  tail->content_inode = new_block;
+  tail->free_slot = 0;
+
+  return content_inode;
+}
+
+ccos_content_inode_t* ccos_get_last_content_inode(ccos_disk_t* disk, ccos_inode_t* file) {
+  ccos_file_tail_t* tail = get_file_tail(disk, file);
+  if (tail->content_inode == CCOS_INVALID_BLOCK) {
+    return NULL;
+  }
+
+  return ccos_disk_read(disk, tail->content_inode);
+}
+
+void ccos_erase_sector(ccos_disk_t* disk, uint16_t block, ccos_bitmask_list_t* bitmask_list) {
   size_t block_size = ccos_disk_sector_size(disk);
+  ccos_invalidate_file_sectors(disk, block);
+  ccos_invalidate_dir_cache(disk, block);
   uint8_t* ptr = ccos_disk_read(disk, block);
   if (ptr != NULL) {
     memset(ptr, 0, block_size);
     *(uint32_t*)ptr = CCOS_EMPTY_BLOCK_MARKER;
+    ccos_disk_mark_dirty(disk, ptr, block_size);
   }
   ccos_mark_sector(disk, bitmask_list, block, 0);
 }
@@ -470,29 +2083,52 @@ ccos_error_t ccos_remove_content_inode(ccos_disk_t* disk, ccos_inode_t* file, cc
     return CCOS_EINVAL;
   }
 
-  ccos_content_inode_t* prev_inode = NULL;
-  ccos_block_data_t* prev_block_data = &(file->content_inode_info);
-  ccos_content_inode_t* last_content_inode = ccos_disk_read(disk, file->content_inode_info.block_next);
+  ccos_content_inode_t* last_content_inode = ccos_get_last_content_inode(disk, file);
   if (last_content_inode == NULL) {
     return CCOS_EIO;
   }
 
-  while (last_content_inode->content_inode_info.block_next != CCOS_INVALID_BLOCK) {
-    prev_inode = last_content_inode;
-    prev_block_data = &(last_content_inode->content_inode_info);
-    last_content_inode = ccos_disk_read(disk, last_content_inode->content_inode_info.block_next);
-    if (last_content_inode == NULL) {
-      return CCOS_EIO;
+  // Content inodes are linked both ways, so the previous one is usually known without walking the list from the start.
+  uint16_t last_block = last_content_inode->content_inode_info.block_current;
+  uint16_t prev_block = last_content_inode->content_inode_info.block_prev;
+  ccos_content_inode_t* prev_inode = NULL;
+  if (prev_block != file->header.file_id) {
+    prev_inode = ccos_disk_read(disk, prev_block);
+  }
+
+  if (prev_inode == NULL ? file->content_inode_info.block_next != last_block
+                         : prev_inode->content_inode_info.block_next != last_block) {
+    TRACE("Back link of content inode 0x%x is broken, walking the list...", last_block);
+    prev_inode = NULL;
+    prev_block = file->header.file_id;
+    for (uint16_t block = file->content_inode_info.block_next; block != last_block;) {
+      prev_inode = ccos_disk_read(disk, block);
+      if (prev_inode == NULL) {
+        return CCOS_EIO;
+      }
+
+      prev_block = block;
+      block = prev_inode->content_inode_info.block_next;
     }
   }
 
-  ccos_erase_sector(disk, last_content_inode->content_inode_info.block_current, bitmask_list);
+  ccos_block_data_t* prev_block_data = &(file->content_inode_info);
+  if (prev_inode != NULL) {
+    prev_block_data = &(prev_inode->content_inode_info);
+  }
+
+  ccos_erase_sector(disk, last_block, bitmask_list);
 
-  prev_block_data->block_next = CCOS_INVALID_BLOCK;
+  const uint16_t invalid_block = CCOS_INVALID_BLOCK;
+  ccos_file_tail_t* tail = ccos_disk_file_tail(disk);
   if (prev_inode != NULL) {
-    ccos_update_content_inode_checksums(disk, prev_inode);
+    ccos_content_inode_write(disk, prev_inode, &prev_block_data->block_next, &invalid_block, sizeof(invalid_block));
+    tail->content_inode = prev_block;
+    tail->free_slot = ccos_get_content_inode_max_sectors(disk);
   } else {
-    ccos_update_inode_checksums(disk, file);
+    ccos_inode_write(disk, file, &prev_block_data->block_next, &invalid_block, sizeof(invalid_block));
+    tail->content_inode = CCOS_INVALID_BLOCK;
+    tail->free_slot = ccos_get_inode_max_sectors(disk);
   }
 
   return CCOS_OK;
@@ -500,38 +2136,30 @@ ccos_error_t ccos_remove_content_inode(ccos_disk_t* disk, ccos_inode_t* file, cc
 
 // remove last content block from the file
 ccos_error_t ccos_remove_sector_from_file(ccos_disk_t* disk, ccos_inode_t* file, ccos_bitmask_list_t* bitmask_list) {
-  uint16_t* content_blocks = ccos_get_inode_content_sectors(file);
-  ccos_content_inode_t* last_content_inode = ccos_get_last_content_inode(disk, file);
-  int content_blocks_count = ccos_get_inode_max_sectors(disk);
-  if (last_content_inode != NULL) {
-    content_blocks = ccos_get_content_inode_content_sectors(last_content_inode);
-    content_blocks_count = ccos_get_content_inode_max_sectors(disk);
-  }
-
-  uint16_t last_content_block = CCOS_INVALID_BLOCK;
-  int last_content_block_index = 0;
-  for (; last_content_block_index < content_blocks_count; ++last_content_block_index) {
-    if (content_blocks[last_content_block_index] == CCOS_INVALID_BLOCK) {
-      if (last_content_block_index > 0) {
-        last_content_block = content_blocks[last_content_block_index - 1];
-      } else {
-        TRACE("File 0x%hx does not have content blocks yet!", file->header.file_id);
-      }
-
-      break;
+  ccos_content_inode_t* last_content_inode = NULL;
+  size_t content_blocks_count = 0;
+  ccos_file_tail_t* tail = get_file_tail(disk, file);
+  uint16_t* content_blocks = get_tail_sectors(disk, file, tail, &last_content_inode, &content_blocks_count);
+
+  size_t last_content_block_index = tail->free_slot;
+  if (last_content_block_index > 0) {
+    ccos_erase_sector(disk, content_blocks[last_content_block_index - 1], bitmask_list);
+
+    const uint16_t invalid_block = CCOS_INVALID_BLOCK;
+    uint16_t* last_entry = &content_blocks[last_content_block_index - 1];
+    if (last_content_inode != NULL) {
+      ccos_content_inode_write(disk, last_content_inode, last_entry, &invalid_block, sizeof(invalid_block));
+    } else {
+      ccos_inode_write(disk, file, last_entry, &invalid_block, sizeof(invalid_block));
     }
-  }
-
-  if (last_content_block_index == content_blocks_count) {
-    last_content_block = content_blocks[last_content_block_index - 1];
-  }
 
-  if (last_content_block != CCOS_INVALID_BLOCK) {
-    ccos_erase_sector(disk, last_content_block, bitmask_list);
-    *(uint16_t*)&(content_blocks[last_content_block_index - 1]) = CCOS_INVALID_BLOCK;
+    tail->free_slot--;
+  } else {
+    TRACE("File 0x%hx does not have content blocks yet!", file->header.file_id);
   }
 
-  if (last_content_block_index <= 1) {
+  // drop the content inode once its last block is gone; the inode itself always keeps its list
+  if (last_content_inode != NULL && last_content_block_index <= 1) {
     ccos_error_t err = ccos_remove_content_inode(disk, file, bitmask_list);
     if (err != CCOS_OK) {
       fprintf(stderr, "Unable to remove content inode after freeing block at file 0x%x!\n", file->header.file_id);
@@ -539,60 +2167,157 @@ ccos_error_t ccos_remove_sector_from_file(ccos_disk_t* disk, ccos_inode_t* file,
     }
   }
 
-  if (last_content_inode != NULL) {
-    ccos_update_content_inode_checksums(disk, last_content_inode);
-  } else {
-    ccos_update_inode_checksums(disk, file);
+  return CCOS_OK;
+}
+
+// Count up to `limit` content blocks in the list, skipping the same entries as read_file_sectors() does; `end` is set
+// to the index right after the last counted one.
+static size_t count_content_entries(ccos_disk_t* disk, const uint16_t* content_blocks, size_t max_count, size_t limit,
+                                    size_t* end) {
+  size_t total_blocks = ccos_disk_size(disk) / ccos_disk_sector_size(disk);
+  size_t count = 0;
+  *end = 0;
+  for (size_t i = 0; i < max_count && count < limit; ++i) {
+    if (content_blocks[i] != CCOS_CONTENT_BLOCKS_END_MARKER && content_blocks[i] < total_blocks) {
+      count++;
+      *end = i + 1;
+    }
   }
 
-  return CCOS_OK;
+  return count;
 }
 
-// get new block from empty blocks, modify it's header properly, reference it in the inode
-uint16_t ccos_add_sector_to_file(ccos_disk_t* disk, ccos_inode_t* file, ccos_bitmask_list_t* bitmask_list) {
-  ccos_content_inode_t* last_content_inode = NULL;
+ccos_error_t ccos_remove_sectors_from_file(ccos_disk_t* disk, ccos_inode_t* file, ccos_bitmask_list_t* bitmask_list,
+                                           size_t count) {
+  if (count == 0) {
+    return CCOS_OK;
+  }
 
-  size_t block_size = ccos_disk_sector_size(disk);
+  size_t blocks_count = 0;
+  const uint16_t* blocks = NULL;
+  ccos_error_t err = ccos_get_cached_file_sectors(disk, file, &blocks_count, &blocks);
+  if (err != CCOS_OK) {
+    return err;
+  }
 
-  uint16_t* content_blocks = ccos_get_inode_content_sectors(file);
-  size_t max_content_blocks = ccos_get_inode_max_sectors(disk);
+  size_t keep = count < blocks_count ? blocks_count - count : 0;
+  TRACE("Removing " SIZE_T " of " SIZE_T " blocks from the file 0x%x", blocks_count - keep, blocks_count,
+        file->header.file_id);
 
-  int content_blocks_count = max_content_blocks;
-  if (file->content_inode_info.block_next != CCOS_INVALID_BLOCK) {
-    TRACE("Has content inode!");
-    last_content_inode = ccos_get_last_content_inode(disk, file);
-    content_blocks = ccos_get_content_inode_content_sectors(last_content_inode);
-    content_blocks_count = ccos_get_content_inode_max_sectors(disk);
+  ccos_begin_bitmask_update(disk);
+
+  // Data blocks go first: the borrowed list is dropped from the cache as soon as the content lists are changed.
+  for (size_t i = keep; i < blocks_count; ++i) {
+    ccos_erase_sector(disk, blocks[i], bitmask_list);
   }
 
-  uint16_t last_content_block = 0;
-  int last_content_block_index = 0;
-  TRACE("%x (%*s): %d content blocks", file->header.file_id, file->desc.name_length, file->desc.name, content_blocks_count);
-  for (; last_content_block_index < content_blocks_count; ++last_content_block_index) {
-    if (content_blocks[last_content_block_index] == CCOS_INVALID_BLOCK) {
-      if (last_content_block_index > 0) {
-        last_content_block = content_blocks[last_content_block_index - 1];
-      } else {
-        TRACE("File 0x%hx does not have content blocks yet!", file->header.file_id);
-        last_content_block = CCOS_INVALID_BLOCK;
-      }
+  // Find the content inode (or the inode) which holds the new last content block.
+  ccos_content_inode_t* content_inode = NULL;
+  uint16_t content_inode_block = CCOS_INVALID_BLOCK;
+  uint16_t* content_blocks = ccos_get_inode_content_sectors(file);
+  size_t max_entries = ccos_get_inode_max_sectors(disk);
+  size_t end = 0;
+  size_t entries = count_content_entries(disk, content_blocks, max_entries, SIZE_MAX, &end);
+  size_t seen = 0;
+  uint16_t next = file->content_inode_info.block_next;
+  while (seen + entries < keep && next != CCOS_INVALID_BLOCK) {
+    ccos_content_inode_t* next_inode = ccos_disk_read(disk, next);
+    if (next_inode == NULL) {
+      ccos_commit_bitmask_update(disk, bitmask_list);
+      return CCOS_EIO;
+    }
+
+    seen += entries;
+    content_inode = next_inode;
+    content_inode_block = next;
+    content_blocks = ccos_get_content_inode_content_sectors(content_inode);
+    max_entries = ccos_get_content_inode_max_sectors(disk);
+    entries = count_content_entries(disk, content_blocks, max_entries, SIZE_MAX, &end);
+    next = content_inode->content_inode_info.block_next;
+  }
 
+  // Content inodes past it are not needed anymore.
+  for (uint16_t block = next; block != CCOS_INVALID_BLOCK;) {
+    const ccos_content_inode_t* doomed = ccos_disk_read(disk, block);
+    if (doomed == NULL) {
       break;
     }
+
+    uint16_t doomed_next = doomed->content_inode_info.block_next;
+    TRACE("Erasing content inode 0x%x of 0x%x...", block, file->header.file_id);
+    ccos_erase_sector(disk, block, bitmask_list);
+    block = doomed_next;
+  }
+
+  // Clear the list past the last kept block.
+  count_content_entries(disk, content_blocks, max_entries, keep - seen, &end);
+  bool has_removed_entries = false;
+  for (size_t i = end; i < max_entries; ++i) {
+    has_removed_entries |= content_blocks[i] != CCOS_INVALID_BLOCK;
+  }
+
+  if (has_removed_entries) {
+    uint16_t* cleared = malloc((max_entries - end) * sizeof(uint16_t));
+    if (cleared == NULL) {
+      ccos_commit_bitmask_update(disk, bitmask_list);
+      return CCOS_ENOMEM;
+    }
+
+    memset(cleared, 0xFF, (max_entries - end) * sizeof(uint16_t));
+    if (content_inode != NULL) {
+      ccos_content_inode_write(disk, content_inode, &content_blocks[end], cleared,
+                               (max_entries - end) * sizeof(uint16_t));
+    } else {
+      ccos_inode_write(disk, file, &content_blocks[end], cleared, (max_entries - end) * sizeof(uint16_t));
+    }
+    free(cleared);
   }
 
-  if (last_content_block_index == content_blocks_count) {
+  const uint16_t invalid_block = CCOS_INVALID_BLOCK;
+  ccos_block_data_t* block_data = content_inode == NULL ? &file->content_inode_info : &content_inode->content_inode_info;
+  if (block_data->block_next != CCOS_INVALID_BLOCK) {
+    if (content_inode != NULL) {
+      ccos_content_inode_write(disk, content_inode, &block_data->block_next, &invalid_block, sizeof(invalid_block));
+    } else {
+      ccos_inode_write(disk, file, &block_data->block_next, &invalid_block, sizeof(invalid_block));
+    }
+  }
+
+  ccos_invalidate_file_sectors(disk, file->header.file_id);
+
+  ccos_file_tail_t* tail = ccos_disk_file_tail(disk);
+  tail->file_id = file->header.file_id;
+  tail->content_inode = content_inode_block;
+  tail->free_slot = end;
+
+  ccos_commit_bitmask_update(disk, bitmask_list);
+  return CCOS_OK;
+}
+
+// get new block from empty blocks, modify it's header properly, reference it in the inode
+uint16_t ccos_add_sector_to_file(ccos_disk_t* disk, ccos_inode_t* file, ccos_bitmask_list_t* bitmask_list) {
+  ccos_content_inode_t* last_content_inode = NULL;
+  size_t content_blocks_count = 0;
+  ccos_file_tail_t* tail = get_file_tail(disk, file);
+  uint16_t* content_blocks = get_tail_sectors(disk, file, tail, &last_content_inode, &content_blocks_count);
+
+  size_t last_content_block_index = tail->free_slot;
+  uint16_t last_content_block = CCOS_INVALID_BLOCK;
+  TRACE("%x (%*s): " SIZE_T " content blocks", file->header.file_id, file->desc.name_length, file->desc.name,
+        content_blocks_count);
+  if (last_content_block_index > 0) {
     last_content_block = content_blocks[last_content_block_index - 1];
+  } else {
+    TRACE("File 0x%hx does not have content blocks yet!", file->header.file_id);
   }
 
-  uint16_t new_block = ccos_get_free_sector(disk, bitmask_list);
+  uint16_t new_block = ccos_allocate_sector(disk, bitmask_list);
   if (new_block == CCOS_INVALID_BLOCK) {
     fprintf(stderr, "Unable to allocate new content block: No free space!\n");
     return CCOS_INVALID_BLOCK;
   }
 
-  TRACE("Allocating content block 0x%x for file id 0x%x.", new_block, file->header.file_id);
-  ccos_mark_sector(disk, bitmask_list, new_block, 1);
+  TRACE("Allocated content block 0x%x for file id 0x%x.", new_block, file->header.file_id);
 
   TRACE("Last content block is 0x%x", last_content_block);
   ccos_block_header_t* new_block_header = (ccos_block_header_t*)ccos_disk_read(disk, new_block);
@@ -607,37 +2332,168 @@ uint16_t ccos_add_sector_to_file(ccos_disk_t* disk, ccos_inode_t* file, ccos_bit
     new_block_header->file_fragment_index = 0;
   }
 
-  TRACE("New block header: %04x:%04x", new_block_header->file_id, new_block_header->file_fragment_index);
+  ccos_disk_mark_dirty(disk, new_block_header, sizeof(ccos_block_header_t));
+  TRACE("New block header: %04x:%04x", new_block_header->file_id, new_block_header->file_fragment_index);
+
+  if (last_content_block_index == content_blocks_count) {
+    TRACE("Allocating new content inode for 0x%x...", file->header.file_id);
+    // we're run out of space for content blocks; we should allocate next content inode
+
+    ccos_content_inode_t* new_content_inode = ccos_add_content_inode(disk, file, bitmask_list);
+    if (new_content_inode == NULL) {
+      fprintf(stderr, "Unable to append new content inode to the file: no free space!\n");
+      return CCOS_INVALID_BLOCK;
+    }
+
+    last_content_inode = new_content_inode;
+    content_blocks = ccos_get_content_inode_content_sectors(new_content_inode);
+    content_blocks_count = ccos_get_content_inode_max_sectors(disk);
+    last_content_block_index = 0;
+  }
+
+  // append new content block to the list; mark next block in the list as invalid; update checksum;
+  uint16_t entries[2] = {new_block, CCOS_INVALID_BLOCK};
+  size_t entries_size = last_content_block_index + 1 < content_blocks_count ? sizeof(entries) : sizeof(entries[0]);
+  if (last_content_inode != NULL) {
+    ccos_content_inode_write(disk, last_content_inode, &content_blocks[last_content_block_index], entries, entries_size);
+  } else {
+    ccos_inode_write(disk, file, &content_blocks[last_content_block_index], entries, entries_size);
+  }
+  TRACE("Content block at " SIZE_T " is now 0x%x.", last_content_block_index, content_blocks[last_content_block_index]);
+  tail->free_slot = last_content_block_index + 1;
+
+  return new_block;
+}
+
+ccos_error_t ccos_add_sectors_to_file(ccos_disk_t* disk, ccos_inode_t* file, ccos_bitmask_list_t* bitmask_list,
+                                      size_t count) {
+  if (count == 0) {
+    return CCOS_OK;
+  }
+
+  ccos_content_inode_t* content_inode = NULL;
+  size_t content_blocks_count = 0;
+  ccos_file_tail_t* tail = get_file_tail(disk, file);
+  uint16_t* content_blocks = get_tail_sectors(disk, file, tail, &content_inode, &content_blocks_count);
+
+  size_t free_entries = content_blocks_count - tail->free_slot;
+  size_t content_inode_capacity = ccos_get_content_inode_max_sectors(disk);
+  size_t new_content_inodes = 0;
+  if (count > free_entries) {
+    new_content_inodes = (count - free_entries + content_inode_capacity - 1) / content_inode_capacity;
+  }
+
+  // Data blocks go first to keep them contiguous, new content inodes follow them.
+  uint16_t* sectors = calloc(count + new_content_inodes, sizeof(uint16_t));
+  if (sectors == NULL) {
+    return CCOS_ENOMEM;
+  }
+
+  ccos_error_t err = ccos_allocate_sectors(disk, bitmask_list, count + new_content_inodes, sectors);
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to allocate " SIZE_T " blocks for the file 0x%x!\n", count + new_content_inodes,
+            file->header.file_id);
+    free(sectors);
+    return err;
+  }
+
+  uint16_t fragment_index = 0;
+  if (tail->free_slot > 0) {
+    const ccos_block_header_t* last_block_header = ccos_disk_read(disk, content_blocks[tail->free_slot - 1]);
+    fragment_index = last_block_header->file_fragment_index + 1;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    ccos_block_header_t* header = (ccos_block_header_t*)ccos_disk_read(disk, sectors[i]);
+    header->file_id = file->header.file_id;
+    header->file_fragment_index = fragment_index + i;
+    ccos_disk_mark_dirty(disk, header, sizeof(ccos_block_header_t));
+  }
 
-  if (last_content_block_index == content_blocks_count) {
-    TRACE("Allocating new content inode for 0x%x...", file->header.file_id);
-    // we're run out of space for content blocks; we should allocate next content inode
+  // Existing lists are updated with checksum deltas; content inodes allocated here are filled in completely, and their
+  // checksum is calculated once, when the next one is linked or the sweep is over.
+  const uint16_t invalid_block = CCOS_INVALID_BLOCK;
+  const uint16_t* next_content_inode = sectors + count;
+  bool is_new_content_inode = false;
+  size_t added = 0;
+  for (;;) {
+    size_t entries = count - added < content_blocks_count - tail->free_slot ? count - added
+                                                                             : content_blocks_count - tail->free_slot;
+    uint16_t* dest = &content_blocks[tail->free_slot];
+    size_t end = tail->free_slot + entries;
+    if (is_new_content_inode) {
+      memcpy(dest, &sectors[added], entries * sizeof(uint16_t));
+    } else if (content_inode != NULL) {
+      ccos_content_inode_write(disk, content_inode, dest, &sectors[added], entries * sizeof(uint16_t));
+      if (end < content_blocks_count) {
+        ccos_content_inode_write(disk, content_inode, &content_blocks[end], &invalid_block, sizeof(invalid_block));
+      }
+    } else {
+      ccos_inode_write(disk, file, dest, &sectors[added], entries * sizeof(uint16_t));
+      if (end < content_blocks_count) {
+        ccos_inode_write(disk, file, &content_blocks[end], &invalid_block, sizeof(invalid_block));
+      }
+    }
 
-    ccos_content_inode_t* new_content_inode = ccos_add_content_inode(disk, file, bitmask_list);
-    if (new_content_inode == NULL) {
-      fprintf(stderr, "Unable to append new content inode to the file: no free space!\n");
-      return CCOS_INVALID_BLOCK;
+    added += entries;
+    tail->free_slot = end;
+    if (added == count) {
+      break;
     }
 
-    last_content_inode = new_content_inode;
-    content_blocks = ccos_get_content_inode_content_sectors(new_content_inode);
-    content_blocks_count = ccos_get_content_inode_max_sectors(disk);
-    last_content_block_index = 0;
+    uint16_t block = *next_content_inode++;
+    TRACE("Allocating new content inode 0x%x for 0x%x...", block, file->header.file_id);
+    ccos_content_inode_t* new_content_inode = ccos_disk_read(disk, block);
+    ccos_block_data_t* prev = content_inode == NULL ? &file->content_inode_info : &content_inode->content_inode_info;
+    init_content_inode(disk, new_content_inode, block, prev);
+
+    if (is_new_content_inode) {
+      content_inode->content_inode_info.block_next = block;
+      ccos_update_content_inode_checksums(disk, content_inode);
+    } else if (content_inode != NULL) {
+      ccos_content_inode_write(disk, content_inode, &prev->block_next, &block, sizeof(block));
+    } else {
+      ccos_inode_write(disk, file, &prev->block_next, &block, sizeof(block));
+    }
+
+    content_inode = new_content_inode;
+    content_blocks = ccos_get_content_inode_content_sectors(content_inode);
+    content_blocks_count = content_inode_capacity;
+    is_new_content_inode = true;
+    tail->content_inode = block;
+    tail->free_slot = 0;
   }
 
-  // append new content block to the list; mark next block in the list as invalid; update checksum;
-  content_blocks[last_content_block_index] = new_block;
-  TRACE("Content block at %d is now 0x%x.", last_content_block_index, content_blocks[last_content_block_index]);
-  if (last_content_block_index + 1 < content_blocks_count) {
-    content_blocks[last_content_block_index + 1] = CCOS_INVALID_BLOCK;
+  if (is_new_content_inode) {
+    ccos_update_content_inode_checksums(disk, content_inode);
   }
 
-  ccos_update_inode_checksums(disk, file);
-  if (last_content_inode != NULL) {
-    ccos_update_content_inode_checksums(disk, last_content_inode);
+  free(sectors);
+  return CCOS_OK;
+}
+
+ccos_error_t ccos_add_files_to_directory(ccos_disk_t* disk, ccos_inode_t* directory, ccos_inode_t** files,
+                                         size_t count) {
+  if (count > UINT16_MAX - directory->desc.dir_count) {
+    fprintf(stderr, "Unable to add " SIZE_T " files to directory with id 0x%x: Too many files!\n", count,
+            directory->header.file_id);
+    return CCOS_EINVAL;
   }
 
-  return new_block;
+  ccos_error_t err = ccos_add_file_entries_to_dir_contents(disk, directory, files, count);
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to add " SIZE_T " files to directory with id 0x%x!\n", count, directory->header.file_id);
+    return err;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    ccos_inode_write(disk, files[i], &files[i]->desc.dir_file_id, &directory->header.file_id, sizeof(uint16_t));
+  }
+
+  uint16_t dir_count = directory->desc.dir_count + count;
+  ccos_inode_write(disk, directory, &directory->desc.dir_count, &dir_count, sizeof(dir_count));
+
+  return CCOS_OK;
 }
 
 ccos_error_t ccos_add_file_to_directory(ccos_disk_t* disk, ccos_inode_t* directory, ccos_inode_t* file) {
@@ -648,11 +2504,9 @@ ccos_error_t ccos_add_file_to_directory(ccos_disk_t* disk, ccos_inode_t* directo
     return err;
   }
 
-  file->desc.dir_file_id = directory->header.file_id;
-  directory->desc.dir_count += 1;
-
-  ccos_update_inode_checksums(disk, file);
-  ccos_update_inode_checksums(disk, directory);
+  uint16_t dir_count = directory->desc.dir_count + 1;
+  ccos_inode_write(disk, file, &file->desc.dir_file_id, &directory->header.file_id, sizeof(uint16_t));
+  ccos_inode_write(disk, directory, &directory->desc.dir_count, &dir_count, sizeof(dir_count));
 
   return CCOS_OK;
 }
@@ -703,303 +2557,620 @@ ccos_error_t ccos_parse_directory_data(ccos_disk_t* disk,
   return CCOS_OK;
 }
 
-// Create new directory entry:
-//
-// offset |  00  01  |   02    | 03 04 05 ... NN |    NN+1    |    NN+2    |
-// -------|----------|---------|-----------------|------------|------------|
-//        | file id  |  name   |      name       |    NN+1    | last entry |
-//        |          | length  |                 |            |    flag    |
-static ccos_error_t create_directory_entry(ccos_inode_t* file, int is_last, size_t* entry_size, uint8_t** directory_entry) {
-  if (file == NULL || entry_size == NULL || directory_entry == NULL || file->desc.name_length > CCOS_MAX_FILE_NAME) {
-    return CCOS_EINVAL;
+static bool is_same_file_name(const ccos_inode_t* file, const ccos_inode_t* other) {
+  return file != NULL && other != NULL && file->desc.name_length == other->desc.name_length &&
+         strncasecmp(file->desc.name, other->desc.name, file->desc.name_length) == 0;
+}
+
+// Position of an entry in the merged directory: index of the existing entry if less than parsed->count, otherwise
+// parsed->count + index of the new file.
+static const ccos_dir_key_t* get_merged_key(const ccos_parsed_dir_t* parsed, const ccos_dir_key_t* keys,
+                                            size_t source) {
+  return source < parsed->count ? &parsed->keys[source] : &keys[source - parsed->count];
+}
+
+static ccos_inode_t* get_merged_file(const ccos_parsed_dir_t* parsed, ccos_inode_t** files, size_t source) {
+  return source < parsed->count ? parsed->elements[source].file : files[source - parsed->count];
+}
+
+static ccos_error_t report_existing_file(const ccos_inode_t* file) {
+  // TODO: add option to overwrite existing file
+  fprintf(stderr, "Unable to add file %*s to the directory: File exists!\n", file->desc.name_length, file->desc.name);
+  return CCOS_EEXIST;
+}
+
+// Same order as adding the files one at a time: each one goes before the first entry which is not less than it.
+static ccos_error_t insert_dir_entries_one_by_one(const ccos_parsed_dir_t* parsed, ccos_inode_t** files,
+                                                  const ccos_dir_key_t* keys, size_t count, size_t* order) {
+  size_t total = parsed->count;
+  for (size_t i = 0; i < total; ++i) {
+    order[i] = i;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    size_t index;
+    for (index = 0; index < total; ++index) {
+      if (compare_dir_keys(get_merged_key(parsed, keys, order[index]), &keys[i]) >= 0) {
+        break;
+      }
+    }
+
+    if (index < total && is_same_file_name(files[i], get_merged_file(parsed, files, order[index]))) {
+      return report_existing_file(files[i]);
+    }
+
+    memmove(&order[index + 1], &order[index], (total - index) * sizeof(size_t));
+    order[index] = parsed->count + i;
+    total++;
+  }
+
+  return CCOS_OK;
+}
+
+typedef struct {
+  const ccos_dir_key_t* key;
+  size_t index;
+} new_dir_entry_t;
+
+static int compare_new_dir_entries(const void* a, const void* b) {
+  const new_dir_entry_t* first = (const new_dir_entry_t*)a;
+  const new_dir_entry_t* second = (const new_dir_entry_t*)b;
+  int res = strcmp(first->key->name, second->key->name);
+  if (res == 0) {
+    res = strcmp(first->key->type, second->key->type);
+  }
+
+  if (res == 0) {
+    res = (first->index > second->index) - (first->index < second->index);
+  }
+
+  return res;
+}
+
+// Merge sorted new files into the sorted directory entries. When the result is ordered (see is_ordered_key_pair()),
+// it's the same as adding the files one at a time, and duplicate names end up next to each other. Otherwise, the
+// order is built one file at a time.
+static ccos_error_t merge_dir_entries(const ccos_parsed_dir_t* parsed, ccos_inode_t** files,
+                                      const ccos_dir_key_t* keys, size_t count, size_t* order) {
+  if (parsed->unordered_pairs > 0) {
+    return insert_dir_entries_one_by_one(parsed, files, keys, count, order);
   }
 
-  uint8_t reverse_length = file->desc.name_length + sizeof(dir_entry_t) + sizeof(reverse_length);
-  uint8_t last_entry_flag = is_last ? CCOS_DIR_LAST_ENTRY_MARKER : 0;
-  *entry_size = reverse_length + sizeof(last_entry_flag);
-  *directory_entry = (uint8_t*)calloc(*entry_size, sizeof(uint8_t));
-  if (*directory_entry == NULL) {
+  new_dir_entry_t* sorted = calloc(count, sizeof(new_dir_entry_t));
+  if (sorted == NULL) {
     return CCOS_ENOMEM;
   }
 
-  size_t offset = 0;
-  ((uint16_t*)*directory_entry)[offset] = file->header.file_id;
+  for (size_t i = 0; i < count; ++i) {
+    sorted[i] = (new_dir_entry_t){.key = &keys[i], .index = i};
+  }
+
+  qsort(sorted, count, sizeof(new_dir_entry_t), compare_new_dir_entries);
+
+  size_t total = 0;
+  size_t existing = 0;
+  for (size_t i = 0; i < count; ++i) {
+    size_t index = ccos_find_parsed_dir_index(parsed, sorted[i].key);
+    while (existing < index) {
+      order[total++] = existing++;
+    }
 
-  offset += sizeof(file->header.file_id);
-  (*directory_entry)[offset] = file->desc.name_length;
+    order[total++] = parsed->count + sorted[i].index;
+  }
+
+  while (existing < parsed->count) {
+    order[total++] = existing++;
+  }
+
+  free(sorted);
 
-  offset += sizeof(file->desc.name_length);
-  memcpy(*directory_entry + offset, file->desc.name, file->desc.name_length);
+  for (size_t i = 1; i < total; ++i) {
+    if (order[i - 1] < parsed->count && order[i] < parsed->count) {
+      continue;
+    }
 
-  offset += file->desc.name_length;
-  (*directory_entry)[offset] = reverse_length;
+    if (!is_ordered_key_pair(get_merged_key(parsed, keys, order[i - 1]), get_merged_key(parsed, keys, order[i]))) {
+      TRACE("New entries break the directory order, inserting them one by one");
+      return insert_dir_entries_one_by_one(parsed, files, keys, count, order);
+    }
+  }
 
-  offset += sizeof(reverse_length);
-  (*directory_entry)[offset] = last_entry_flag;
+  for (size_t i = 1; i < total; ++i) {
+    ccos_inode_t* first = get_merged_file(parsed, files, order[i - 1]);
+    ccos_inode_t* second = get_merged_file(parsed, files, order[i]);
+    if ((order[i - 1] >= parsed->count || order[i] >= parsed->count) && is_same_file_name(first, second)) {
+      return report_existing_file(order[i] >= parsed->count ? second : first);
+    }
+  }
 
   return CCOS_OK;
 }
 
-// find a place for the new filename in dir contents (all files are located there in alphabetical, case-insensitive
-// order), and insert it there
-ccos_error_t ccos_add_file_entry_to_dir_contents(ccos_disk_t* disk, ccos_inode_t* directory, ccos_inode_t* file) {
-  TRACE("Directory size: %d bytes, length: %d, has %d entries",
-        directory->desc.file_size, directory->desc.dir_length,
-        directory->desc.dir_count);
+// Directory entry:
+//
+// offset |  00  01  |   02    | 03 04 05 ... NN |    NN+1    |    NN+2    |
+// -------|----------|---------|-----------------|------------|------------|
+//        | file id  |  name   |      name       |    NN+1    | last entry |
+//        |          | length  |                 |            |    flag    |
+static size_t write_directory_entry(uint16_t file_id, const char* name, uint8_t name_length, uint8_t* directory_entry) {
+  uint8_t reverse_length = name_length + sizeof(dir_entry_t) + sizeof(reverse_length);
 
+  size_t offset = 0;
+  memcpy(directory_entry + offset, &file_id, sizeof(file_id));
+
+  offset += sizeof(file_id);
+  directory_entry[offset] = name_length;
+
+  offset += sizeof(name_length);
+  memcpy(directory_entry + offset, name, name_length);
+
+  offset += name_length;
+  directory_entry[offset] = reverse_length;
+
+  return reverse_length;
+}
+
+// Build directory contents with the entries in the given order and write them, filling in parsed contents of the
+// result.
+static ccos_error_t write_merged_dir(ccos_disk_t* disk, ccos_inode_t* directory, const ccos_parsed_dir_t* parsed,
+                                     ccos_inode_t** files, const ccos_dir_key_t* keys, size_t count,
+                                     const size_t* order, ccos_parsed_dir_t* merged) {
   uint8_t* directory_data = NULL;
   size_t dir_size = 0;
   ccos_error_t err = ccos_read_file(disk, directory, &directory_data, &dir_size);
   if (err != CCOS_OK) {
     fprintf(stderr, "Unable to get directory contents: Unable to read directory!\n");
-    if (directory_data != NULL) {
-      free(directory_data);
-    }
     return err;
   }
 
-  parsed_directory_element_t* elements = NULL;
-  err = ccos_parse_directory_data(disk, directory_data, dir_size, directory->desc.dir_count, &elements);
-  if (err != CCOS_OK) {
-    fprintf(stderr, "Unable to add file to directory files list: Unable to parse directory data!\n");
-    free(directory_data);
-    return err;
-  }
-
-  // 1. Find place for the new file to insert
-  int i = ccos_find_file_index_in_directory_data(file, directory, elements);
-  if ((i < directory->desc.dir_count) && (file->desc.name_length == elements[i].file->desc.name_length) &&
-      !(strncasecmp(file->desc.name, elements[i].file->desc.name, file->desc.name_length))) {
-    // TODO: add option to overwrite existing file
-    fprintf(stderr, "Unable to add file %*s to the directory: File exists!\n", file->desc.name_length, file->desc.name);
-    free(directory_data);
-    free(elements);
-    return CCOS_EEXIST;
+  size_t real_dir_size = 1;
+  if (parsed->count > 0) {
+    real_dir_size = parsed->elements[parsed->count - 1].offset + parsed->elements[parsed->count - 1].size + 1;
   }
 
-  int new_entry_is_last = i == directory->desc.dir_count;
-
-  // 2. Create new directory entry
-  uint8_t* new_file_entry = NULL;
-  size_t file_entry_size = 0;
-  err = create_directory_entry(file, new_entry_is_last, &file_entry_size, &new_file_entry);
-  if (err != CCOS_OK) {
-    fprintf(stderr, "Unable to add new entry to the directory: Unable to create entry!\n");
+  if (parsed->count > 0 && real_dir_size > dir_size) {
+    fprintf(stderr, "Unable to add file to directory: Directory entries exceed its size!\n");
     free(directory_data);
-    free(elements);
-    return err;
+    return CCOS_EINVAL;
   }
 
-  // 3. Insert new entry into directory data
-  size_t real_dir_size = 1;
-  if (directory->desc.dir_count > 0) {
-    real_dir_size = elements[directory->desc.dir_count - 1].offset + elements[directory->desc.dir_count - 1].size + 1;
+  size_t new_dir_size = real_dir_size;
+  for (size_t i = 0; i < count; ++i) {
+    new_dir_size += sizeof(dir_entry_t) + files[i]->desc.name_length + sizeof(uint8_t) + sizeof(uint8_t);
   }
 
   TRACE("Real directory size: " SIZE_T " bytes", real_dir_size);
-  size_t new_dir_size = real_dir_size + file_entry_size;
   TRACE("Dir size " SIZE_T " -> " SIZE_T ".", dir_size, new_dir_size);
 
-  uint8_t* new_directory_data = realloc(directory_data, new_dir_size);
-  if (new_directory_data == NULL) {
-    fprintf(stderr, "Unable to realloc " SIZE_T " bytes for the directory contents: %s!\n", new_dir_size,
+  size_t total = parsed->count + count;
+  *merged = (ccos_parsed_dir_t){.dir_id = parsed->dir_id, .dir_count = parsed->dir_count};
+  uint8_t* new_directory_data = calloc(new_dir_size, sizeof(uint8_t));
+  if (new_directory_data == NULL || reserve_parsed_dir(merged, total) != CCOS_OK) {
+    fprintf(stderr, "Unable to allocate " SIZE_T " bytes for the directory contents: %s!\n", new_dir_size,
             strerror(errno));
+    free(new_directory_data);
     free(directory_data);
-    free(elements);
-    free(new_file_entry);
+    ccos_free_parsed_dir(merged);
     return CCOS_ENOMEM;
-  } else {
-    directory_data = new_directory_data;
   }
 
-  if (new_entry_is_last) {
-    size_t last_entry_offset;
-    if (directory->desc.dir_count == 0) {
-      last_entry_offset = CCOS_DIR_ENTRIES_OFFSET;
+  // Empty directory contains only last entry flag
+  new_directory_data[0] = parsed->count > 0 ? directory_data[0] : 0;
+  size_t offset = CCOS_DIR_ENTRIES_OFFSET;
+  for (size_t i = 0; i < total; ++i) {
+    size_t source = order[i];
+    size_t entry_size;
+    uint8_t last_entry_flag;
+    if (source < parsed->count) {
+      const parsed_directory_element_t* element = &parsed->elements[source];
+      entry_size = element->size;
+      last_entry_flag = directory_data[element->offset + entry_size];
+      memcpy(new_directory_data + offset, directory_data + element->offset, entry_size);
+
+      // Previous last entry is followed by the new ones now
+      if (source == parsed->count - 1 && i != total - 1) {
+        last_entry_flag = 0;
+      }
     } else {
-      // |  <------------ elements[i-1].size ------------->  |
-      // |  .-- elements[i-1].offset                         |
-      // |  V                                                |
-      // |  00  01  |   02    | 03 04 05 ... NN |    NN+1    |    NN+2    |
-      // |----------|---------|-----------------|------------|------------|
-      // | file id  |  name   |      name       |  reversed  | last entry |
-      // |          | length  |                 |  length    |    flag    |
-      last_entry_offset = elements[i - 1].offset + elements[i - 1].size + sizeof(uint8_t);
+      const ccos_inode_t* file = files[source - parsed->count];
+      entry_size = write_directory_entry(file->header.file_id, file->desc.name, file->desc.name_length,
+                                         new_directory_data + offset);
+      last_entry_flag = i == total - 1 ? CCOS_DIR_LAST_ENTRY_MARKER : 0;
     }
 
-    memcpy(directory_data + last_entry_offset, new_file_entry, file_entry_size);
-  } else {
-    memmove(directory_data + elements[i].offset + file_entry_size, directory_data + elements[i].offset,
-            dir_size - elements[i].offset);
-    memcpy(directory_data + elements[i].offset, new_file_entry, file_entry_size);
+    merged->elements[i] = (parsed_directory_element_t){
+        .offset = offset, .size = entry_size, .file = get_merged_file(parsed, files, source)};
+    merged->keys[i] = *get_merged_key(parsed, keys, source);
+    offset += entry_size;
+    new_directory_data[offset] = last_entry_flag;
+    offset += sizeof(last_entry_flag);
+  }
+
+  merged->count = total;
+  free(directory_data);
+
+  err = ccos_write_file_unindexed(disk, directory, new_directory_data, new_dir_size);
+  free(new_directory_data);
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to update directory contents of dir with id=0x%x!\n", directory->header.file_id);
+    ccos_free_parsed_dir(merged);
+    return err;
+  }
+
+  return CCOS_OK;
+}
+
+// Merge the new files into the directory entries (all files are located there in alphabetical, case-insensitive
+// order) and rewrite the directory once.
+ccos_error_t ccos_add_file_entries_to_dir_contents(ccos_disk_t* disk, ccos_inode_t* directory, ccos_inode_t** files,
+                                                   size_t count) {
+  TRACE("Directory size: %d bytes, length: %d, has %d entries, adding " SIZE_T " entries",
+        directory->desc.file_size, directory->desc.dir_length,
+        directory->desc.dir_count, count);
+
+  if (count == 0) {
+    return CCOS_OK;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    if (files[i] == NULL || files[i]->desc.name_length > CCOS_MAX_FILE_NAME) {
+      fprintf(stderr, "Unable to add new entry to the directory: Invalid file!\n");
+      return CCOS_EINVAL;
+    }
+  }
+
+  ccos_parsed_dir_t parsed = {0};
+  ccos_error_t err = ccos_detach_cached_dir(disk, directory, &parsed);
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to add file to directory files list: Unable to parse directory data!\n");
+    return err;
+  }
+
+  ccos_dir_key_t* keys = calloc(count, sizeof(ccos_dir_key_t));
+  size_t* order = calloc(parsed.count + count, sizeof(size_t));
+  if (keys == NULL || order == NULL) {
+    fprintf(stderr, "Unable to add files to directory: %s!\n", strerror(errno));
+    free(order);
+    free(keys);
+    ccos_free_parsed_dir(&parsed);
+    return CCOS_ENOMEM;
   }
 
-  free(new_file_entry);
+  // 1. Find places for the new entries
+  for (size_t i = 0; i < count; ++i) {
+    ccos_make_dir_key(files[i], &keys[i]);
+  }
 
-  // 4. Remove last entry flag from previous last entry if necessary
-  if (new_entry_is_last) {
-    if (directory->desc.dir_count == 0) {
-      // Empty directory contains only last entry flag
-      directory_data[0] = 0;
+  err = merge_dir_entries(&parsed, files, keys, count, order);
+  if (err != CCOS_OK) {
+    free(order);
+    free(keys);
+    if (err == CCOS_EEXIST) {
+      ccos_attach_cached_dir(disk, &parsed);
     } else {
-      directory_data[elements[i - 1].offset + elements[i - 1].size] = 0;
+      ccos_free_parsed_dir(&parsed);
     }
+
+    return err;
   }
 
-  // 5. Save changes
-  err = ccos_write_file(disk, directory, directory_data, new_dir_size);
-  free(directory_data);
-  free(elements);
+  // 2. Write directory data with the new entries
+  ccos_parsed_dir_t merged = {0};
+  err = write_merged_dir(disk, directory, &parsed, files, keys, count, order, &merged);
+  free(order);
+  free(keys);
   if (err != CCOS_OK) {
-    fprintf(stderr, "Unable to update directory contents of dir with id=0x%x!\n", directory->header.file_id);
+    ccos_free_parsed_dir(&parsed);
     return err;
   }
 
+  // 3. Update cached directory contents; dir_count is expected to be increased by the caller.
+  merged.dir_count += count;
+  merged.unordered_pairs = count_unordered_pairs(&merged, 0, merged.count);
+  merged.name_index = parsed.name_index;
+  merged.name_index_size = parsed.name_index_size;
+  merged.name_index_count = parsed.name_index_count;
+  merged.duplicate_names = parsed.duplicate_names;
+  parsed.name_index = NULL;
+  for (size_t i = 0; i < count; ++i) {
+    add_name_index_file(&merged, files[i]);
+  }
+
+  ccos_free_parsed_dir(&parsed);
+  ccos_attach_cached_dir(disk, &merged);
   return CCOS_OK;
 }
 
-ccos_error_t ccos_delete_file_from_parent_dir(ccos_disk_t* disk, ccos_inode_t* file) {
-    ccos_inode_t* parent_dir = ccos_get_parent_dir(disk, file);
+ccos_error_t ccos_add_file_entry_to_dir_contents(ccos_disk_t* disk, ccos_inode_t* directory, ccos_inode_t* file) {
+  return ccos_add_file_entries_to_dir_contents(disk, directory, &file, 1);
+}
 
-    TRACE("Reading contents of the directory %*s (0x%x)",
-          parent_dir->desc.name_length, parent_dir->desc.name,
-          parent_dir->header.file_id);
+ccos_error_t ccos_delete_files_from_dir(ccos_disk_t* disk, ccos_inode_t* directory, ccos_inode_t** files,
+                                        size_t count) {
+  TRACE("Reading contents of the directory %*s (0x%x)",
+        directory->desc.name_length, directory->desc.name,
+        directory->header.file_id);
 
-    size_t dir_size = 0;
-    uint8_t* directory_data = NULL;
+  if (count == 0) {
+    return CCOS_OK;
+  }
 
-    ccos_error_t err = ccos_read_file(disk, parent_dir, &directory_data, &dir_size);
-    if (err != CCOS_OK) {
-      fprintf(stderr, "Unable to read directory contents at directory id 0x%x\n", parent_dir->header.file_id);
-      return err;
-    }
+  ccos_parsed_dir_t parsed = {0};
+  ccos_error_t err = ccos_detach_cached_dir(disk, directory, &parsed);
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to delete file from directory files list: Unable to parse directory data!\n");
+    return err;
+  }
 
-    parsed_directory_element_t* elements = NULL;
-    err = ccos_parse_directory_data(disk, directory_data, dir_size, parent_dir->desc.dir_count, &elements);
-    if (err != CCOS_OK) {
-      fprintf(stderr, "Unable to add file to directory files list: Unable to parse directory data!\n");
-      free(directory_data);
-      return err;
-    }
+  parsed_directory_element_t* elements = parsed.elements;
+  bool* removed = calloc(parsed.count > 0 ? parsed.count : 1, sizeof(bool));
+  if (removed == NULL) {
+    ccos_free_parsed_dir(&parsed);
+    return CCOS_ENOMEM;
+  }
 
-    // Find place of the file to delete in directory data
-    int i = ccos_find_file_index_in_directory_data(file, parent_dir, elements);
-    if ((i < parent_dir->desc.dir_count) && (file->desc.name_length == elements[i].file->desc.name_length) &&
-        !(strncasecmp(file->desc.name, elements[i].file->desc.name, file->desc.name_length))) {
+  // 1. Find places of the files to delete in directory data
+  size_t removed_count = 0;
+  for (size_t k = 0; k < count; ++k) {
+    ccos_dir_key_t key;
+    ccos_make_dir_key(files[k], &key);
+    size_t i = ccos_find_parsed_dir_index(&parsed, &key);
+    if (i < parsed.count && is_same_file_name(files[k], elements[i].file)) {
       TRACE("File is found!");
+      removed_count += !removed[i];
+      removed[i] = true;
     } else {
       fprintf(stderr, "Unable to find file \"%*s\" in directory \"%*s\"!\n",
-              file->desc.name_length, file->desc.name,
-              parent_dir->desc.name_length, parent_dir->desc.name);
-      free(directory_data);
-      free(elements);
+              files[k]->desc.name_length, files[k]->desc.name,
+              directory->desc.name_length, directory->desc.name);
+      free(removed);
+      ccos_attach_cached_dir(disk, &parsed);
       return CCOS_ENOENT;
     }
+  }
 
-    int entry_to_delete_is_last = i == (parent_dir->desc.dir_count - 1);
+  size_t dir_size = 0;
+  uint8_t* directory_data = NULL;
+  err = ccos_read_file(disk, directory, &directory_data, &dir_size);
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to read directory contents at directory id 0x%x\n", directory->header.file_id);
+    free(removed);
+    ccos_free_parsed_dir(&parsed);
+    return err;
+  }
 
-    // If we remove last entry, mark the one before it as last.
-    if (entry_to_delete_is_last) {
-      if (parent_dir->desc.dir_count == 1) {
-        directory_data[0] = CCOS_DIR_LAST_ENTRY_MARKER;
-      } else {
-        directory_data[elements[i - 1].offset + elements[i - 1].size] = CCOS_DIR_LAST_ENTRY_MARKER;
+  // 2. Move the remaining entries together with their last entry flags in one pass.
+  //
+  // |  <------------- elements[i].size -------------->  |            |
+  // |  .-- elements[i].offset                           |            |  .-- elements[i+1].offset
+  // |  V                                                |            |  V
+  // |  00  01  |   02    | 03 04 05 ... NN |    NN+1    |    NN+2    |  +3  +4  |   +5    |
+  // |----------|---------|-----------------|------------|------------|----------|---------|
+  // | file id  |  name   |      name       |  reversed  | last entry | file id  |  name   |
+  // |          | length  |                 |  length    |    flag    |          | length  |
+  size_t shrink_size = 0;
+  size_t last_kept = SIZE_MAX;
+  for (size_t i = 0; i < parsed.count; ++i) {
+    size_t entry_size = elements[i].size + sizeof(uint8_t);
+    if (removed[i]) {
+      shrink_size += entry_size;
+    } else {
+      if (shrink_size > 0) {
+        memmove(directory_data + elements[i].offset - shrink_size, directory_data + elements[i].offset, entry_size);
       }
+
+      last_kept = i;
     }
+  }
 
-    // |  <------------- elements[i].size -------------->  |            |
-    // |  .-- elements[i].offset                           |            |  .-- elements[i+1].offset
-    // |  V                                                |            |  V
-    // |  00  01  |   02    | 03 04 05 ... NN |    NN+1    |    NN+2    |  +3  +4  |   +5    |
-    // |----------|---------|-----------------|------------|------------|----------|---------|
-    // | file id  |  name   |      name       |  reversed  | last entry | file id  |  name   |
-    // |          | length  |                 |  length    |    flag    |          | length  |
-    size_t next_entry_offset = elements[i].offset + elements[i].size + sizeof(uint8_t);
+  // If we remove the last entry, mark the one before it as last.
+  if (parsed.count > 0 && removed[parsed.count - 1]) {
+    if (last_kept == SIZE_MAX) {
+      directory_data[0] = CCOS_DIR_LAST_ENTRY_MARKER;
+    } else {
+      size_t shift = 0;
+      for (size_t i = 0; i < last_kept; ++i) {
+        shift += removed[i] ? elements[i].size + sizeof(uint8_t) : 0;
+      }
 
-    if (parent_dir->desc.dir_count > 1) {
-      memmove(directory_data + elements[i].offset, directory_data + next_entry_offset, dir_size - next_entry_offset);
+      directory_data[elements[last_kept].offset + elements[last_kept].size - shift] = CCOS_DIR_LAST_ENTRY_MARKER;
     }
+  }
 
-    // Zero last bytes at the end of dir contents. It's not necessary if you have last entry marker set correctly, but
-    // it'll help read image in HEX editor if removed dir entry will be nice and zeroed.
-    size_t shrink_size = elements[i].size + sizeof(uint8_t);
-    memset(directory_data + dir_size - shrink_size, 0, shrink_size);
-    size_t new_dir_size = dir_size - shrink_size;
+  // Bytes after the last entry stay after it.
+  if (parsed.count > 0) {
+    size_t real_dir_size = elements[parsed.count - 1].offset + elements[parsed.count - 1].size + sizeof(uint8_t);
+    if (real_dir_size < dir_size) {
+      memmove(directory_data + real_dir_size - shrink_size, directory_data + real_dir_size, dir_size - real_dir_size);
+    }
+  }
 
-    // Write dir contents back with old size to overwrite bytes at the end of dir with zeroes.
-    err = ccos_write_file(disk, parent_dir, directory_data, dir_size);
+  // Zero last bytes at the end of dir contents. It's not necessary if you have last entry marker set correctly, but
+  // it'll help read image in HEX editor if removed dir entries will be nice and zeroed.
+  memset(directory_data + dir_size - shrink_size, 0, shrink_size);
+  size_t new_dir_size = dir_size - shrink_size;
 
-    // Do that once more with new size to clear freed up content block.
-    if (err == CCOS_OK) {
-      err = ccos_write_file(disk, parent_dir, directory_data, new_dir_size);
-    }
+  // 3. Write dir contents back with old size to overwrite bytes at the end of dir with zeroes, then cut off the
+  // freed up content blocks.
+  err = ccos_write_file_unindexed(disk, directory, directory_data, dir_size);
+  if (err == CCOS_OK) {
+    err = ccos_truncate_unindexed(disk, directory, new_dir_size);
+  }
 
-    free(directory_data);
-    free(elements);
+  free(directory_data);
 
-    if (err != CCOS_OK) {
-      fprintf(stderr, "Unable to update directory contents of dir with id=0x%x!\n", parent_dir->header.file_id);
-      return err;
-    }
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to update directory contents of dir with id=0x%x!\n", directory->header.file_id);
+    free(removed);
+    ccos_free_parsed_dir(&parsed);
+    return err;
+  }
 
-    parent_dir->desc.file_size = new_dir_size;
-    parent_dir->desc.dir_length = new_dir_size;
-    parent_dir->desc.dir_count -= 1;
+  uint16_t dir_count = directory->desc.dir_count - removed_count;
+  ccos_inode_write(disk, directory, &directory->desc.dir_count, &dir_count, sizeof(dir_count));
 
-    ccos_update_inode_checksums(disk, parent_dir);
+  ccos_remove_parsed_dir_entries(&parsed, removed);
+  parsed.dir_count = dir_count;
+  ccos_attach_cached_dir(disk, &parsed);
+  free(removed);
 
-    return CCOS_OK;
+  return CCOS_OK;
 }
 
-void ccos_rename_file_unchecked(ccos_disk_t* disk, ccos_inode_t* file, const char* new_name) {
-  size_t len = strlen(new_name);
+ccos_error_t ccos_delete_file_from_parent_dir(ccos_disk_t* disk, ccos_inode_t* file) {
+  return ccos_delete_files_from_dir(disk, ccos_get_parent_dir(disk, file), &file, 1);
+}
 
-  memset(file->desc.name, ' ', CCOS_MAX_FILE_NAME);
-  memcpy(file->desc.name, new_name, len);
+static void set_dir_entry_flag(uint8_t* directory_data, const parsed_directory_element_t* element, uint8_t flag) {
+  directory_data[element->offset + element->size] = flag;
+}
 
-  file->desc.name_length = len;
+// Both the directory entry and the file inode get the new name. If the entry keeps its place among the sorted entries
+// and its size, only the entry is written; otherwise the entries between its old and new places are moved with one
+// memmove, and the directory is written once.
+ccos_error_t ccos_rename_file_in_parent_dir(ccos_disk_t* disk, ccos_inode_t* file, const char* new_name,
+                                            size_t new_name_length) {
+  if (new_name_length == 0 || new_name_length > CCOS_MAX_FILE_NAME) {
+    fprintf(stderr, "Unable to rename file: invalid file name length!\n");
+    return CCOS_EINVAL;
+  }
 
-  ccos_update_inode_checksums(disk, file);
-}
+  ccos_inode_t* parent_dir = ccos_get_parent_dir(disk, file);
+  ccos_inode_t* existing = NULL;
+  ccos_error_t err = ccos_find_cached_dir_file(disk, parent_dir, new_name, new_name_length, &existing);
+  if (err == CCOS_OK && existing != file) {
+    fprintf(stderr, "Unable to rename file to %*s: File exists!\n", (int)new_name_length, new_name);
+    return CCOS_EEXIST;
+  } else if (err != CCOS_OK && err != CCOS_ENOENT) {
+    return err;
+  }
 
-int ccos_find_file_index_in_directory_data(ccos_inode_t* file, ccos_inode_t* directory,
-                                      parsed_directory_element_t* elements) {
-  char basename[CCOS_MAX_FILE_NAME] = {0};
-  char type[CCOS_MAX_FILE_NAME] = {0};
-  size_t basename_length = 0;
-  size_t type_length = 0;
-  ccos_parse_file_name(file, basename, type, &basename_length, &type_length);
+  ccos_parsed_dir_t parsed = {0};
+  err = ccos_detach_cached_dir(disk, parent_dir, &parsed);
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to rename file: Unable to parse directory data!\n");
+    return err;
+  }
 
-  char entry_name[CCOS_MAX_FILE_NAME] = {0};
-  char entry_type[CCOS_MAX_FILE_NAME] = {0};
-  size_t entry_name_length = 0;
-  size_t entry_type_length = 0;
+  ccos_dir_key_t key;
+  ccos_make_dir_key(file, &key);
+  size_t i = ccos_find_parsed_dir_index(&parsed, &key);
+  if (i >= parsed.count || !is_same_file_name(file, parsed.elements[i].file)) {
+    fprintf(stderr, "Unable to find file \"%*s\" in directory \"%*s\"!\n",
+            file->desc.name_length, file->desc.name,
+            parent_dir->desc.name_length, parent_dir->desc.name);
+    ccos_attach_cached_dir(disk, &parsed);
+    return CCOS_ENOENT;
+  }
+
+  size_t count = parsed.count;
+  size_t real_dir_size = parsed.elements[count - 1].offset + parsed.elements[count - 1].size + sizeof(uint8_t);
+  size_t old_offset = parsed.elements[i].offset;
+  size_t old_size = parsed.elements[i].size;
+  size_t new_size = sizeof(dir_entry_t) + new_name_length + sizeof(uint8_t);
+  ccos_inode_t* old_last = parsed.elements[count - 1].file;
+
+  // New place of the entry is the one it would get if removed and added again with the new name.
+  ccos_remove_parsed_dir_entry(&parsed, i);
+  struct {
+    uint8_t length;
+    char data[CCOS_MAX_FILE_NAME];
+  } short_name = {.length = (uint8_t)new_name_length};
+  memcpy(short_name.data, new_name, new_name_length);
+  make_dir_key((const short_string_t*)&short_name, &key);
+  size_t j = ccos_find_parsed_dir_index(&parsed, &key);
+  size_t new_offset = CCOS_DIR_ENTRIES_OFFSET;
+  if (j < parsed.count) {
+    new_offset = parsed.elements[j].offset;
+  } else if (parsed.count > 0) {
+    new_offset = parsed.elements[parsed.count - 1].offset + parsed.elements[parsed.count - 1].size + sizeof(uint8_t);
+  }
+
+  uint8_t entry[sizeof(dir_entry_t) + CCOS_MAX_FILE_NAME + sizeof(uint8_t)];
+  write_directory_entry(file->header.file_id, new_name, new_name_length, entry);
+
+  if (j == i && new_size == old_size) {
+    TRACE("Entry keeps its place, patching it in place");
+    err = ccos_pwrite_unindexed(disk, parent_dir, old_offset, entry, new_size, NULL, NULL);
+  } else {
+    uint8_t* directory_data = NULL;
+    size_t dir_size = 0;
+    err = ccos_read_file(disk, parent_dir, &directory_data, &dir_size);
+    size_t new_dir_size = real_dir_size + new_size - old_size;
+    uint8_t* new_directory_data = NULL;
+    if (err == CCOS_OK && real_dir_size > dir_size) {
+      fprintf(stderr, "Unable to rename file: Directory entries exceed its size!\n");
+      err = CCOS_EINVAL;
+    } else if (err == CCOS_OK) {
+      new_directory_data = realloc(directory_data, new_dir_size > dir_size ? new_dir_size : dir_size);
+      if (new_directory_data == NULL) {
+        err = CCOS_ENOMEM;
+      } else {
+        directory_data = new_directory_data;
+      }
+    }
 
-  int i;
-  for (i = 0; i < directory->desc.dir_count; ++i) {
-    TRACE("Parsing entry # %d...", i);
+    if (err == CCOS_OK) {
+      // Offsets after the removal of the entry: entries [i, j) are moved to the left, [j, i) - to the right.
+      size_t old_end = old_offset + old_size + sizeof(uint8_t);
+      size_t tail_offset = j >= i ? old_end + (new_offset - old_offset) : old_end;
+      if (j >= i) {
+        memmove(directory_data + old_offset, directory_data + old_end, new_offset - old_offset);
+        memmove(directory_data + new_offset + new_size + 1, directory_data + tail_offset, real_dir_size - tail_offset);
+      } else {
+        memmove(directory_data + old_offset + new_size + 1, directory_data + tail_offset, real_dir_size - tail_offset);
+        memmove(directory_data + new_offset + new_size + 1, directory_data + new_offset, old_offset - new_offset);
+      }
 
-    memset(entry_name, 0, CCOS_MAX_FILE_NAME);
-    memset(entry_type, 0, CCOS_MAX_FILE_NAME);
-    ccos_parse_short_file_name((const short_string_t*)&(elements[i].file->desc.name_length), entry_name, entry_type, &entry_name_length,
-                    &entry_type_length);
+      memcpy(directory_data + new_offset, entry, new_size);
+      directory_data[new_offset + new_size] = j == parsed.count ? CCOS_DIR_LAST_ENTRY_MARKER : 0;
 
-    TRACE("%s", entry_name);
+      // Entries before and after the renamed one have their flags moved with them, except for the last one.
+      if (j != parsed.count && old_last == file) {
+        parsed_directory_element_t last = parsed.elements[parsed.count - 1];
+        last.offset += last.offset >= new_offset ? new_size + 1 : 0;
+        set_dir_entry_flag(directory_data, &last, CCOS_DIR_LAST_ENTRY_MARKER);
+      } else if (j == parsed.count && old_last != file) {
+        set_dir_entry_flag(directory_data, &parsed.elements[parsed.count - 1], 0);
+      }
 
-    // Compare filename and file type separately
-    int res = strcasecmp(entry_name, basename);
-    TRACE("%s %s %s", entry_name, res < 0 ? "<" : res > 0 ? ">" : "==", basename);
-    if (res == 0) {
-      res = strncasecmp(entry_type, type, MIN(entry_type_length, type_length));
-      TRACE("%s %s %s", entry_type, res < 0 ? "<" : res > 0 ? ">" : "==", type);
+      err = ccos_write_file_unindexed(disk, parent_dir, directory_data, new_dir_size);
     }
 
-    if (res >= 0) {
-      break;
-    }
+    free(directory_data);
+  }
+
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to update directory contents of dir with id=0x%x!\n", parent_dir->header.file_id);
+    ccos_free_parsed_dir(&parsed);
+    return err;
   }
 
-  return i;
+  char name[CCOS_MAX_FILE_NAME] = {0};
+  uint8_t name_length = new_name_length;
+  memcpy(name, new_name, new_name_length);
+  ccos_inode_write(disk, file, file->desc.name, name, CCOS_MAX_FILE_NAME);
+  ccos_inode_write(disk, file, &file->desc.name_length, &name_length, sizeof(name_length));
+
+  if (ccos_insert_parsed_dir_entry(&parsed, j, file, new_offset, new_size) == CCOS_OK) {
+    ccos_attach_cached_dir(disk, &parsed);
+  } else {
+    ccos_free_parsed_dir(&parsed);
+  }
+
+  return CCOS_OK;
+}
+
+void ccos_rename_file_unchecked(ccos_disk_t* disk, ccos_inode_t* file, const char* new_name) {
+  size_t len = strlen(new_name);
+
+  memset(file->desc.name, ' ', CCOS_MAX_FILE_NAME);
+  memcpy(file->desc.name, new_name, len);
+
+  file->desc.name_length = len;
+
+  ccos_update_inode_checksums(disk, file);
+  ccos_invalidate_dir_cache(disk, file->desc.dir_file_id);
 }
 
 ccos_error_t ccos_parse_short_file_name(const short_string_t* file_name, char* basename, char* type, size_t* name_length,
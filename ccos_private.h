@@ -27,8 +27,152 @@ typedef struct {
 
 typedef enum { CREATED, MODIF, EXPIR } date_type_t;
 
+typedef struct {
+  size_t cursor;               // next-fit position: free sector search starts here and wraps around
+  int batch_depth;             // bitmask "allocated" updates are deferred while non-zero
+  int32_t pending_allocated;   // "allocated" delta accumulated by the current batch
+} ccos_allocator_t;
+
+typedef struct {
+  uint16_t file_id;            // inode of the cached file, CCOS_INVALID_BLOCK if nothing is cached
+  uint16_t content_inode;      // last content inode of the file, CCOS_INVALID_BLOCK if the file has none
+  size_t free_slot;            // first free entry in the content blocks list of the last content inode (or the inode)
+} ccos_file_tail_t;
+
+#define CCOS_FILE_SECTORS_CACHE_SIZE 64
+
+typedef struct {
+  uint16_t file_id;            // inode of the cached file, CCOS_INVALID_BLOCK if the entry is empty
+  size_t count;                // number of the file content blocks
+  uint16_t* blocks;            // file content blocks, in order
+} ccos_file_sectors_t;
+
+#define CCOS_DIR_CACHE_SIZE 16
+
+// Directory entry name split into basename and type and case-folded, so entries may be ordered with strcmp().
+typedef struct {
+  char name[CCOS_MAX_FILE_NAME + 1];
+  char type[CCOS_MAX_FILE_NAME + 1];
+  size_t type_length;
+} ccos_dir_key_t;
+
+typedef struct {
+  uint16_t dir_id;             // inode of the cached directory, CCOS_INVALID_BLOCK if the entry is empty
+  uint16_t dir_count;          // dir_count of the directory inode the entry matches
+  size_t count;                // number of parsed directory entries
+  size_t capacity;             // number of entries allocated in elements and keys
+  size_t unordered_pairs;      // adjacent entries whose order doesn't allow binary search over the keys
+  parsed_directory_element_t* elements;
+  ccos_dir_key_t* keys;        // name keys of the elements, in the same order
+  ccos_inode_t** name_index;   // open-addressing hash of the files by case-folded full name, NULL until first lookup
+  size_t name_index_size;      // number of slots in name_index, power of two
+  size_t name_index_count;     // number of files in name_index
+  bool duplicate_names;        // some files share the name, only the first of them is in name_index
+} ccos_parsed_dir_t;
+
+typedef struct {
+  ccos_inode_t* file;          // indexed file, NULL if the slot is empty
+  ccos_inode_t* parent;        // directory which lists the file
+} ccos_image_name_t;
+
+// Image-wide index of the files by case-folded full name. Unlike the per-directory one, it keeps all the files with
+// the same name, as they may be in different directories.
+typedef struct {
+  bool valid;                  // index has all the files of the image; it's rebuilt on the next lookup otherwise
+  size_t size;                 // number of slots, power of two
+  size_t count;                // number of indexed files
+  ccos_image_name_t* slots;    // open-addressing hash of the files
+} ccos_image_names_t;
+
+// In-memory summary of the bitmap: every bitmask block is split into groups of 64 blocks (the last group of a bitmask
+// block may be shorter), and for every group we keep the number of free blocks in it, plus two bit arrays that allow
+// to skip 64 full or 64 empty groups at once.
+typedef struct {
+  bool valid;                  // summary matches the bitmap; it's rebuilt on the next search otherwise
+  size_t groups_per_bitmask;   // groups in every bitmask block
+  size_t groups_count;         // groups in all bitmask blocks of the image
+  uint8_t* free_count;         // free blocks in the group
+  uint64_t* nonfull;           // bit per group, set if the group has free blocks
+  uint64_t* nonempty;          // bit per group, set if the group has allocated blocks
+} ccos_bitmap_summary_t;
+
+typedef enum {
+  CCOS_FIT_FIRST,              // lowest free run which is long enough
+  CCOS_FIT_BEST,               // shortest free run which is long enough, lowest of them on a tie
+} ccos_fit_policy_t;
+
 void* ccos_disk_read(ccos_disk_t* disk, uint16_t sector);
 
+/**
+ * @brief      Record the image sectors holding the given bytes as changed, to be written by ccos_disk_flush().
+ *
+ * @param[in]  disk  Compass disk image.
+ * @param[in]  data  Changed bytes of the image data. Pointers outside of the image are ignored.
+ * @param[in]  size  Number of the changed bytes.
+ */
+void ccos_disk_mark_dirty(ccos_disk_t* disk, const void* data, size_t size);
+
+/**
+ * @brief      Record all the image sectors as changed, e.g. after the image is created in memory.
+ *
+ * @param[in]  disk  Compass disk image.
+ */
+void ccos_disk_mark_all_dirty(ccos_disk_t* disk);
+
+/**
+ * @brief      Get sector allocator state of the disk.
+ *
+ * @param[in]  disk  Compass disk image.
+ *
+ * @return     Allocator state owned by the disk handle.
+ */
+ccos_allocator_t* ccos_disk_allocator(ccos_disk_t* disk);
+
+/**
+ * @brief      Get cached content inode chain tail of the file that was last grown or shrunk on the disk.
+ *
+ * @param[in]  disk  Compass disk image.
+ *
+ * @return     Content inode chain tail cache owned by the disk handle.
+ */
+ccos_file_tail_t* ccos_disk_file_tail(ccos_disk_t* disk);
+
+/**
+ * @brief      Get cached content block lists of the disk files, indexed by file_id % CCOS_FILE_SECTORS_CACHE_SIZE.
+ *
+ * @param[in]  disk  Compass disk image.
+ *
+ * @return     Array of CCOS_FILE_SECTORS_CACHE_SIZE entries owned by the disk handle.
+ */
+ccos_file_sectors_t* ccos_disk_file_sectors(ccos_disk_t* disk);
+
+/**
+ * @brief      Get cached parsed directories of the disk, indexed by file_id % CCOS_DIR_CACHE_SIZE.
+ *
+ * @param[in]  disk  Compass disk image.
+ *
+ * @return     Array of CCOS_DIR_CACHE_SIZE entries owned by the disk handle.
+ */
+ccos_parsed_dir_t* ccos_disk_dir_cache(ccos_disk_t* disk);
+
+/**
+ * @brief      Get image-wide name index of the disk.
+ *
+ * @param[in]  disk  Compass disk image.
+ *
+ * @return     Name index owned by the disk handle.
+ */
+ccos_image_names_t* ccos_disk_image_names(ccos_disk_t* disk);
+
+/**
+ * @brief      Get in-memory bitmap summary of the disk.
+ *
+ * @param[in]  disk  Compass disk image.
+ *
+ * @return     Bitmap summary owned by the disk handle.
+ */
+ccos_bitmap_summary_t* ccos_disk_bitmap_summary(ccos_disk_t* disk);
+
 /**
  * @brief      Calculate checksum of the file metadata.
  *
@@ -102,18 +246,270 @@ void ccos_update_content_inode_checksums(ccos_disk_t* disk, ccos_content_inode_t
  */
 void ccos_update_bitmask_checksum(ccos_disk_t* disk, ccos_bitmask_t* bitmask);
 
+/**
+ * @brief      Overwrite a field of the inode and adjust its checksums by the difference.
+ *
+ * CCOS checksums are additive 16-bit word sums, so the stored metadata and blocks checksums are updated with the
+ * delta of the changed bytes instead of re-summing the whole inode. Bytes outside of both checksummed regions are
+ * copied as is.
+ *
+ * @param[in]  disk   Compass disk image.
+ * @param      inode  The inode.
+ * @param      dest   Field inside of the inode sector to overwrite.
+ * @param[in]  src    New field value.
+ * @param[in]  size   Field size in bytes.
+ */
+void ccos_inode_write(ccos_disk_t* disk, ccos_inode_t* inode, void* dest, const void* src, size_t size);
+
+/**
+ * @brief      Overwrite a field of the content inode and adjust its checksum by the difference.
+ *
+ * @param[in]  disk           Compass disk image.
+ * @param      content_inode  The content inode.
+ * @param      dest           Field inside of the content inode sector to overwrite.
+ * @param[in]  src            New field value.
+ * @param[in]  size           Field size in bytes.
+ */
+void ccos_content_inode_write(ccos_disk_t* disk, ccos_content_inode_t* content_inode, void* dest, const void* src,
+                              size_t size);
+
+/**
+ * @brief      Overwrite a field of the bitmask block and adjust its checksum by the difference.
+ *
+ * @param[in]  disk     Compass disk image.
+ * @param      bitmask  CCOS image bitmask.
+ * @param      dest     Field inside of the bitmask sector to overwrite.
+ * @param[in]  src      New field value.
+ * @param[in]  size     Field size in bytes.
+ */
+void ccos_bitmask_write(ccos_disk_t* disk, ccos_bitmask_t* bitmask, void* dest, const void* src, size_t size);
+
 /**
  * @brief      Parse an inode and return the list of the file content blocks.
  *
  * @param[in]  disk          Compass disk image.
  * @param[in]  file          Inode first block number.
  * @param      blocks_count  The file content blocks count.
- * @param      blocks        The file content block numbers.
+ * @param      blocks        The file content block numbers. Should be freed by the caller.
  *
  * @return     CCOS_OK on success, error code otherwise.
  */
 ccos_error_t ccos_get_file_sectors(ccos_disk_t* disk, ccos_inode_t* file, size_t* blocks_count, uint16_t** blocks);
 
+/**
+ * @brief      Return the list of the file content blocks from the per-disk cache, parsing the inode on a miss.
+ *
+ * The list is owned by the disk and stays valid until the next change of the file block lists (or of any file which
+ * shares the cache entry), so it must not be used across calls which modify the image.
+ *
+ * @param[in]  disk          Compass disk image.
+ * @param[in]  file          The file.
+ * @param      blocks_count  The file content blocks count.
+ * @param      blocks        The file content block numbers.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_get_cached_file_sectors(ccos_disk_t* disk, ccos_inode_t* file, size_t* blocks_count,
+                                          const uint16_t** blocks);
+
+/**
+ * @brief      Drop cached content blocks list of the file.
+ *
+ * Lists are dropped automatically by ccos_inode_write(), ccos_content_inode_write(), ccos_init_inode() and
+ * ccos_erase_sector(); call this after changing block lists in any other way.
+ *
+ * @param[in]  disk     Compass disk image.
+ * @param[in]  file_id  Inode of the file, or CCOS_INVALID_BLOCK to drop lists of all files.
+ */
+void ccos_invalidate_file_sectors(ccos_disk_t* disk, uint16_t file_id);
+
+/**
+ * @brief      Fill in the name key of the directory entry.
+ *
+ * Names which can't be parsed get empty basename and type.
+ *
+ * @param[in]  file  The file.
+ * @param[out] key   The key.
+ */
+void ccos_make_dir_key(const ccos_inode_t* file, ccos_dir_key_t* key);
+
+/**
+ * @brief      Return parsed directory contents from the per-disk cache, parsing the directory on a miss.
+ *
+ * The entry is owned by the disk and stays valid until the next change of the directory (or of any directory which
+ * shares the cache entry), so it must not be used across calls which modify the image.
+ *
+ * @param[in]  disk    Compass disk image.
+ * @param[in]  dir     The directory.
+ * @param[out] parsed  Parsed directory contents.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_get_cached_dir(ccos_disk_t* disk, ccos_inode_t* dir, const ccos_parsed_dir_t** parsed);
+
+/**
+ * @brief      Take parsed directory contents out of the per-disk cache, parsing the directory on a miss.
+ *
+ * The directory is not cached until the contents are put back with ccos_attach_cached_dir(), so it may be modified in
+ * the meantime; the caller should either attach or free them with ccos_free_parsed_dir().
+ *
+ * @param[in]  disk    Compass disk image.
+ * @param[in]  dir     The directory.
+ * @param[out] parsed  Parsed directory contents, owned by the caller.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_detach_cached_dir(ccos_disk_t* disk, ccos_inode_t* dir, ccos_parsed_dir_t* parsed);
+
+/**
+ * @brief      Put parsed directory contents into the per-disk cache.
+ *
+ * @param[in]  disk    Compass disk image.
+ * @param      parsed  Parsed directory contents; the cache takes ownership of them, and the struct is cleared.
+ */
+void ccos_attach_cached_dir(ccos_disk_t* disk, ccos_parsed_dir_t* parsed);
+
+/**
+ * @brief      Free parsed directory contents which are not in the cache.
+ *
+ * @param      parsed  Parsed directory contents.
+ */
+void ccos_free_parsed_dir(ccos_parsed_dir_t* parsed);
+
+/**
+ * @brief      Insert new entry into parsed directory contents, shifting offsets of the entries after it.
+ *
+ * @param      parsed  Parsed directory contents.
+ * @param[in]  index   Index of the new entry.
+ * @param[in]  file    The file of the new entry.
+ * @param[in]  offset  Offset of the new entry in the directory data.
+ * @param[in]  size    Size of the new entry, without the last entry flag that follows it.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_insert_parsed_dir_entry(ccos_parsed_dir_t* parsed, size_t index, ccos_inode_t* file, uint16_t offset,
+                                          size_t size);
+
+/**
+ * @brief      Remove entry from parsed directory contents, shifting offsets of the entries after it.
+ *
+ * @param      parsed  Parsed directory contents.
+ * @param[in]  index   Index of the entry to remove.
+ */
+void ccos_remove_parsed_dir_entry(ccos_parsed_dir_t* parsed, size_t index);
+
+/**
+ * @brief      Remove entries from parsed directory contents in one pass, shifting offsets of the entries after them.
+ *
+ * @param      parsed   Parsed directory contents.
+ * @param[in]  removed  Flag per entry, set for the entries to remove.
+ */
+void ccos_remove_parsed_dir_entries(ccos_parsed_dir_t* parsed, const bool* removed);
+
+/**
+ * @brief      Find the position of the file name in parsed directory contents.
+ *
+ * Entries are ordered case-insensitively by basename and then by type, where types are compared up to the length of
+ * the shorter one. Binary search is used unless the directory has entries out of this order, or entries with the same
+ * basename where one type starts with the other, as the result would differ from a linear scan then.
+ *
+ * @param[in]  parsed  Parsed directory contents.
+ * @param[in]  key     Name key of the file.
+ *
+ * @return     Index of the first entry which is not less than the key, parsed->count if there is none.
+ */
+size_t ccos_find_parsed_dir_index(const ccos_parsed_dir_t* parsed, const ccos_dir_key_t* key);
+
+/**
+ * @brief      Find the file in the directory by its full name, case-insensitively.
+ *
+ * Uses the hash index of the cached directory contents, which is built on the first lookup and kept up to date by
+ * ccos_insert_parsed_dir_entry() and ccos_remove_parsed_dir_entry(). If the index can't be allocated, the entries
+ * are scanned instead.
+ *
+ * @param[in]  disk    Compass disk image.
+ * @param[in]  dir     The directory.
+ * @param[in]  name    Full name of the file (e.g. "File~Type~").
+ * @param[in]  length  Length of the name.
+ * @param[out] file    The file, NULL if not found.
+ *
+ * @return     CCOS_OK if found, CCOS_ENOENT if not found, error code otherwise.
+ */
+ccos_error_t ccos_find_cached_dir_file(ccos_disk_t* disk, ccos_inode_t* dir, const char* name, size_t length,
+                                       ccos_inode_t** file);
+
+/**
+ * @brief      Drop cached parsed contents of the directory.
+ *
+ * Directories are dropped automatically by ccos_write_file(), ccos_replace_file(), ccos_pwrite(), ccos_truncate(),
+ * ccos_init_inode() and ccos_erase_sector(); call this after changing directory contents in any other way.
+ *
+ * @param[in]  disk    Compass disk image.
+ * @param[in]  dir_id  Inode of the directory, or CCOS_INVALID_BLOCK to drop all directories along with the image name
+ *                     index.
+ */
+void ccos_invalidate_dir_cache(ccos_disk_t* disk, uint16_t dir_id);
+
+/**
+ * @brief      Find all the files in the image with the given full name, case-insensitively.
+ *
+ * The image name index is built with a single pass over all the directories on the first lookup, and then kept up to
+ * date with ccos_add_image_names() and ccos_remove_image_name().
+ *
+ * @param[in]  disk    Compass disk image.
+ * @param[in]  name    Full name of the file (e.g. "File~Type~").
+ * @param[in]  length  Length of the name.
+ * @param[out] files   Found files in the depth-first order of the image, NULL if none found. Should be free()-d.
+ * @param[out] count   Number of found files.
+ *
+ * @return     CCOS_OK if found, CCOS_ENOENT if not found, error code otherwise.
+ */
+ccos_error_t ccos_find_image_files(ccos_disk_t* disk, const char* name, size_t length, ccos_inode_t*** files,
+                                   size_t* count);
+
+/**
+ * @brief      Add files which were listed in the directory to the image name index, if it's built.
+ *
+ * @param[in]  disk   Compass disk image.
+ * @param[in]  dir    The directory.
+ * @param[in]  files  The files.
+ * @param[in]  count  Number of the files.
+ */
+void ccos_add_image_names(ccos_disk_t* disk, ccos_inode_t* dir, ccos_inode_t** files, size_t count);
+
+/**
+ * @brief      Remove the file from the image name index, if it's built. Should be called before the file name changes.
+ *
+ * @param[in]  disk  Compass disk image.
+ * @param[in]  file  The file.
+ */
+void ccos_remove_image_name(ccos_disk_t* disk, const ccos_inode_t* file);
+
+/**
+ * @brief      Drop the image name index, so it's rebuilt on the next lookup.
+ *
+ * @param[in]  disk  Compass disk image.
+ */
+void ccos_drop_image_names(ccos_disk_t* disk);
+
+/**
+ * @brief      Same as ccos_write_file(), but keeps the image name index built even if the file is a directory. Used by
+ * the functions which update the index themselves.
+ */
+ccos_error_t ccos_write_file_unindexed(ccos_disk_t* disk, ccos_inode_t* file, const uint8_t* file_data,
+                                       size_t file_size);
+
+/**
+ * @brief      Same as ccos_pwrite(), but keeps the image name index built even if the file is a directory.
+ */
+ccos_error_t ccos_pwrite_unindexed(ccos_disk_t* disk, ccos_inode_t* file, size_t offset, const uint8_t* data,
+                                   size_t len, uint16_t** dirty_sectors, size_t* dirty_count);
+
+/**
+ * @brief      Same as ccos_truncate(), but keeps the image name index built even if the file is a directory.
+ */
+ccos_error_t ccos_truncate_unindexed(ccos_disk_t* disk, ccos_inode_t* file, size_t new_size);
+
 /**
  * @brief      Get all bitmask blocks from the image.
  *
@@ -132,9 +528,21 @@ ccos_bitmask_list_t ccos_find_bitmask_sectors(ccos_disk_t* disk);
  */
 bool ccos_validate_disk_bitmap(ccos_disk_t* disk);
 
+/**
+ * @brief      Drop in-memory bitmap summary of the disk, so it's rebuilt from the bitmap on the next search.
+ *
+ * The summary follows ccos_mark_sector() and ccos_bitmask_write(); call this after changing the bitmap in any other way.
+ *
+ * @param[in]  disk  Compass disk image.
+ */
+void ccos_invalidate_bitmap_summary(ccos_disk_t* disk);
+
 /**
  * @brief      Find available free block in the image and return it's number.
  *
+ * The search is next-fit: it starts at the disk's allocator cursor, skips fully allocated bitmask words, and wraps
+ * around to the beginning of the image. The cursor is moved to the returned block.
+ *
  * @param[in]  disk          Compass disk image.
  * @param[in]  bitmask_list  List of CCOS image bitmask blocks.
  *
@@ -142,6 +550,46 @@ bool ccos_validate_disk_bitmap(ccos_disk_t* disk);
  */
 uint16_t ccos_get_free_sector(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list);
 
+/**
+ * @brief      Find free block in the image and mark it as used.
+ *
+ * @param[in]  disk          Compass disk image.
+ * @param      bitmask_list  List of CCOS image bitmask blocks.
+ *
+ * @return     The allocated block on success, CCOS_INVALID_BLOCK if no free space in the image.
+ */
+uint16_t ccos_allocate_sector(ccos_disk_t* disk, ccos_bitmask_list_t* bitmask_list);
+
+/**
+ * @brief      Find free blocks in the image and mark them as used.
+ *
+ * The bitmap is walked once, starting at the disk's allocator cursor. The first free run that fits all the blocks is
+ * taken; if there is none, the first free blocks met on the way are used instead. Nothing is allocated on failure.
+ *
+ * @param[in]  disk          Compass disk image.
+ * @param      bitmask_list  List of CCOS image bitmask blocks.
+ * @param[in]  count         Number of blocks to allocate.
+ * @param[out] sectors       Array of at least count elements that receives the allocated block numbers.
+ *
+ * @return     CCOS_OK on success, CCOS_ENOSPC if there is not enough free space, error code otherwise.
+ */
+ccos_error_t ccos_allocate_sectors(ccos_disk_t* disk, ccos_bitmask_list_t* bitmask_list, size_t count,
+                                   uint16_t* sectors);
+
+/**
+ * @brief      Find a run of contiguous free blocks in the image without allocating it.
+ *
+ * @param[in]  disk          Compass disk image.
+ * @param[in]  bitmask_list  List of CCOS image bitmask blocks.
+ * @param[in]  count         Required run length, in blocks.
+ * @param[in]  policy        Which of the suitable runs to choose.
+ * @param[out] start         First block of the found run.
+ *
+ * @return     CCOS_OK on success, CCOS_ENOSPC if there is no free run long enough, error code otherwise.
+ */
+ccos_error_t ccos_find_free_run(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list, size_t count,
+                                ccos_fit_policy_t policy, uint16_t* start);
+
 /**
  * @brief      Return count of free blocks in a CCOS image.
  *
@@ -154,6 +602,37 @@ uint16_t ccos_get_free_sector(ccos_disk_t* disk, const ccos_bitmask_list_t* bitm
 ccos_error_t ccos_get_free_sectors_count(ccos_disk_t* disk, ccos_bitmask_list_t* bitmask_list,
                                    size_t* free_blocks_count);
 
+/**
+ * @brief      Return count of allocated blocks in a CCOS image as recorded in the bitmask "allocated" counter.
+ *
+ * Does not look at the bitmap itself, so it costs the same regardless of image size. Updates deferred by an open
+ * bitmask batch are taken into account.
+ *
+ * @param[in]  disk             Compass disk image.
+ * @param[in]  bitmask_list     List of CCOS image bitmask blocks.
+ * @param[out] allocated_count  Pointer to allocated blocks count.
+ *
+ * @return     CCOS_OK on success, CCOS_EINVAL if the counter is out of range, error code otherwise.
+ */
+ccos_error_t ccos_get_allocated_sectors_count(ccos_disk_t* disk, ccos_bitmask_list_t* bitmask_list,
+                                              size_t* allocated_count);
+
+/**
+ * @brief      Compare the "allocated" counter of every bitmask block with the bitmap and optionally fix it.
+ *
+ * Must not be called while a bitmask batch is open.
+ *
+ * @param[in]  disk               Compass disk image.
+ * @param      bitmask_list       List of CCOS image bitmask blocks.
+ * @param[in]  repair             Rewrite mismatching counters (and the bitmask checksums) when true.
+ * @param[out] free_blocks_count  Pointer to free blocks count as found in the bitmap.
+ *
+ * @return     CCOS_OK if counters match the bitmap or were repaired, CCOS_EINVAL on mismatch without repair, error
+ *             code otherwise.
+ */
+ccos_error_t ccos_reconcile_allocated_count(ccos_disk_t* disk, ccos_bitmask_list_t* bitmask_list, bool repair,
+                                            size_t* free_blocks_count);
+
 /**
  * @brief      Mark block in the bitmask as free or used.
  *
@@ -164,6 +643,23 @@ ccos_error_t ccos_get_free_sectors_count(ccos_disk_t* disk, ccos_bitmask_list_t*
  */
 void ccos_mark_sector(ccos_disk_t* disk, ccos_bitmask_list_t* bitmask_list, uint16_t block, uint8_t mode);
 
+/**
+ * @brief      Start batched bitmask update. Until the matching ccos_commit_bitmask_update() call, ccos_mark_sector()
+ * only flips bits and adjusts the checksum of the touched bitmask block; "allocated" counters of all bitmask blocks
+ * are updated once on commit. Batches may be nested, only the outermost commit writes the changes.
+ *
+ * @param[in]  disk  Compass disk image.
+ */
+void ccos_begin_bitmask_update(ccos_disk_t* disk);
+
+/**
+ * @brief      Finish batched bitmask update started with ccos_begin_bitmask_update().
+ *
+ * @param[in]  disk          Compass disk image.
+ * @param      bitmask_list  List of CCOS image bitmask blocks.
+ */
+void ccos_commit_bitmask_update(ccos_disk_t* disk, ccos_bitmask_list_t* bitmask_list);
+
 /**
  * @brief      Initialize inode at the given block.
  *
@@ -189,12 +685,14 @@ ccos_content_inode_t* ccos_add_content_inode(ccos_disk_t* disk, ccos_inode_t* fi
 /**
  * @brief      Gets the last content inode in the content inode list of the given file.
  *
+ * The chain tail is cached in the disk handle, so repeated calls for the same file don't walk the content inode list.
+ *
  * @param[in]  disk  Compass disk image.
  * @param[in]  file  The file.
  *
  * @return     The last content inode on success, NULL otherwise.
  */
-ccos_content_inode_t* ccos_get_last_content_inode(ccos_disk_t* disk, const ccos_inode_t* file);
+ccos_content_inode_t* ccos_get_last_content_inode(ccos_disk_t* disk, ccos_inode_t* file);
 
 /**
  * @brief      Cleanup image block at the given number and mark it as empty both in the image and in the image bitmask.
@@ -227,6 +725,23 @@ ccos_error_t ccos_remove_content_inode(ccos_disk_t* disk, ccos_inode_t* file, cc
  */
 ccos_error_t ccos_remove_sector_from_file(ccos_disk_t* disk, ccos_inode_t* file, ccos_bitmask_list_t* bitmask_list);
 
+/**
+ * @brief      Removes several content blocks from the end of the file at once.
+ *
+ * Content inodes left without content blocks are erased as well; the content blocks list and block_next of the new
+ * last content inode (or the inode) are fixed up once. Bitmask allocated counters are updated in a single batch.
+ *
+ * @param[in]  disk          Compass disk image.
+ * @param      file          The file.
+ * @param      bitmask_list  List of CCOS image bitmask blocks.
+ * @param[in]  count         Number of blocks to remove; all the content blocks of the file are removed if it's larger
+ * than their number.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_remove_sectors_from_file(ccos_disk_t* disk, ccos_inode_t* file, ccos_bitmask_list_t* bitmask_list,
+                                           size_t count);
+
 /**
  * @brief      Adds content block to the file.
  *
@@ -238,6 +753,22 @@ ccos_error_t ccos_remove_sector_from_file(ccos_disk_t* disk, ccos_inode_t* file,
  */
 uint16_t ccos_add_sector_to_file(ccos_disk_t* disk, ccos_inode_t* file, ccos_bitmask_list_t* bitmask_list);
 
+/**
+ * @brief      Adds several content blocks to the file at once.
+ *
+ * Data blocks and the content inodes needed to reference them are allocated with a single ccos_allocate_sectors()
+ * call; content block lists are then filled in one sweep.
+ *
+ * @param[in]  disk          Compass disk image.
+ * @param      file          The file.
+ * @param      bitmask_list  List of CCOS image bitmask blocks.
+ * @param[in]  count         Number of blocks to add.
+ *
+ * @return     CCOS_OK on success, error code otherwise. Nothing is allocated on failure.
+ */
+ccos_error_t ccos_add_sectors_to_file(ccos_disk_t* disk, ccos_inode_t* file, ccos_bitmask_list_t* bitmask_list,
+                                      size_t count);
+
 /**
  * @brief      Add new file entry to the list of files in the given directory.
  *
@@ -249,6 +780,21 @@ uint16_t ccos_add_sector_to_file(ccos_disk_t* disk, ccos_inode_t* file, ccos_bit
  */
 ccos_error_t ccos_add_file_to_directory(ccos_disk_t* disk, ccos_inode_t* directory, ccos_inode_t* file);
 
+/**
+ * @brief      Add new file entries to the list of files in the given directory at once.
+ *
+ * Nothing is added if any of the names is already taken by a file in the directory or by another file in the list.
+ *
+ * @param[in]  disk       Compass disk image.
+ * @param      directory  The directory to add file entries to.
+ * @param      files      The files to add to the directory.
+ * @param[in]  count      Number of the files.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_add_files_to_directory(ccos_disk_t* disk, ccos_inode_t* directory, ccos_inode_t** files,
+                                         size_t count);
+
 /**
  * @brief      Insert new directory entry into the directory, effectively making this directory a parent for the given
  * file.
@@ -261,6 +807,37 @@ ccos_error_t ccos_add_file_to_directory(ccos_disk_t* disk, ccos_inode_t* directo
  */
 ccos_error_t ccos_add_file_entry_to_dir_contents(ccos_disk_t* disk, ccos_inode_t* directory, ccos_inode_t* file);
 
+/**
+ * @brief      Insert new directory entries into the directory, merging them with the existing ones and rewriting the
+ * directory once.
+ *
+ * The entries end up in the same order as if they were added one by one with ccos_add_file_entry_to_dir_contents().
+ *
+ * @param[in]  disk       Compass disk image.
+ * @param      directory  The directory.
+ * @param      files      The files.
+ * @param[in]  count      Number of the files.
+ *
+ * @return     CCOS_OK on success, CCOS_EEXIST if any of the names is taken, error code otherwise.
+ */
+ccos_error_t ccos_add_file_entries_to_dir_contents(ccos_disk_t* disk, ccos_inode_t* directory, ccos_inode_t** files,
+                                                   size_t count);
+
+/**
+ * @brief      Delete file entries from the directory, rewriting it once.
+ *
+ * Nothing is changed if any of the files is not found in the directory.
+ *
+ * @param[in]  disk       Compass disk image.
+ * @param      directory  The directory.
+ * @param      files      The files, all of them in the directory.
+ * @param[in]  count      Number of the files.
+ *
+ * @return     CCOS_OK on success, error code otherwise.
+ */
+ccos_error_t ccos_delete_files_from_dir(ccos_disk_t* disk, ccos_inode_t* directory, ccos_inode_t** files,
+                                        size_t count);
+
 /**
  * @brief      Delete file entry from the parent directory.
  *
@@ -271,6 +848,19 @@ ccos_error_t ccos_add_file_entry_to_dir_contents(ccos_disk_t* disk, ccos_inode_t
  */
 ccos_error_t ccos_delete_file_from_parent_dir(ccos_disk_t* disk, ccos_inode_t* file);
 
+/**
+ * @brief      Rename file and its entry in the parent directory, keeping the entries sorted.
+ *
+ * @param[in]  disk             Compass disk image.
+ * @param      file             The file.
+ * @param[in]  new_name         New full name of the file (e.g. "File~Type~"), not NUL-terminated.
+ * @param[in]  new_name_length  Length of the new name.
+ *
+ * @return     CCOS_OK on success, CCOS_EEXIST if other file in the directory has this name, error code otherwise.
+ */
+ccos_error_t ccos_rename_file_in_parent_dir(ccos_disk_t* disk, ccos_inode_t* file, const char* new_name,
+                                            size_t new_name_length);
+
 /**
  * @brief      Rename file inode without directory changes.
  *
@@ -322,18 +912,6 @@ ccos_error_t ccos_parse_directory_data(ccos_disk_t* disk,
  */
 ccos_error_t ccos_get_sector_data(ccos_disk_t* disk, uint16_t block, const uint8_t** start, size_t* size);
 
-/**
- * @brief      Find the index of a file in the directory data.
- *
- * @param[in]  file      The file to find.
- * @param[in]  directory The directory to search in.
- * @param[in]  elements  Array of parsed directory elements.
- *
- * @return     Index of the file in the directory on success, -1 otherwise.
- */
-int ccos_find_file_index_in_directory_data(ccos_inode_t* file, ccos_inode_t* directory,
-                                      parsed_directory_element_t* elements);
-
 /**
  * @brief      Checks if the directory is root.
  *
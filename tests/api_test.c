@@ -4,10 +4,13 @@
 
 #include <criterion/criterion.h>
 
+#include <ccos_format.h>
 #include <ccos_image.h>
 #include <ccos_private.h>
 
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 static const uint8_t test_inode_data[] = {
@@ -61,3 +64,751 @@ Test(ccos_image, get_file_name) {
   cr_assert_eq(name->length, 21);
   cr_assert_eq(strncmp(name->data, "GRiDPaint~Run Canvas~", name->length), 0);
 }
+
+Test(ccos_image, incremental_checksums_match_full_recalculation) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  ccos_inode_t* inode = ccos_get_root_dir(disk);
+  cr_assert_not_null(inode);
+
+  // Odd and even offsets in the metadata, the content blocks list, and the list tail which is not checksummed.
+  const char name[] = "Delta~Test~";
+  uint16_t dir_count = 0x1234;
+  uint16_t blocks[] = {0xABCD, 0x0102};
+  size_t max_blocks = ccos_get_inode_max_sectors(disk);
+  ccos_inode_write(disk, inode, &inode->desc.name[1], name, sizeof(name) - 1);
+  ccos_inode_write(disk, inode, &inode->desc.dir_count, &dir_count, sizeof(dir_count));
+  ccos_inode_write(disk, inode, &ccos_get_inode_content_sectors(inode)[3], blocks, sizeof(blocks));
+  ccos_inode_write(disk, inode, &ccos_get_inode_content_sectors(inode)[max_blocks - 1], blocks, sizeof(blocks[0]));
+  cr_assert_eq(inode->desc.metadata_checksum, ccos_calc_inode_metadata_checksum(inode));
+  cr_assert_eq(inode->content_inode_info.blocks_checksum, ccos_calc_inode_sectors_checksum(disk, inode));
+
+  ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
+  cr_assert_gt(bitmask_list.length, 0);
+  ccos_bitmask_t* bitmask = bitmask_list.bitmask_blocks[0];
+  uint8_t* bytes = ccos_get_bitmask_bytes(bitmask);
+  const uint8_t pattern[] = {0x5A, 0xA5, 0x0F};
+  ccos_bitmask_write(disk, bitmask, &bytes[7], pattern, sizeof(pattern));
+  cr_assert_eq(bitmask->checksum, ccos_calc_bitmask_checksum(disk, bitmask));
+
+  ccos_disk_free(disk);
+}
+
+static void assert_cached_sectors_match_inode(ccos_disk_t* disk, ccos_inode_t* file, size_t expected_count) {
+  size_t cached_count = 0;
+  uint16_t* cached = NULL;
+  cr_assert_eq(ccos_get_file_sectors(disk, file, &cached_count, &cached), CCOS_OK);
+  cr_assert_eq(cached_count, expected_count);
+
+  size_t parsed_count = 0;
+  uint16_t* parsed = NULL;
+  ccos_invalidate_file_sectors(disk, CCOS_INVALID_BLOCK);
+  cr_assert_eq(ccos_get_file_sectors(disk, file, &parsed_count, &parsed), CCOS_OK);
+  cr_assert_eq(parsed_count, expected_count);
+  cr_assert_eq(memcmp(parsed, cached, expected_count * sizeof(uint16_t)), 0);
+
+  free(cached);
+  free(parsed);
+}
+
+Test(ccos_image, file_sectors_cache_follows_changes) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+  cr_assert_not_null(root);
+
+  // Spans the inode block list and a content inode.
+  size_t log_sector_size = ccos_get_log_sector_size(disk);
+  size_t large_count = ccos_get_inode_max_sectors(disk) + 10;
+  uint8_t* data = calloc(large_count, log_sector_size);
+  cr_assert_not_null(data);
+
+  ccos_inode_t* file = ccos_add_file(disk, root, data, 3 * log_sector_size, "Cached~Data~");
+  cr_assert_not_null(file);
+
+  size_t count = 0;
+  const uint16_t* first = NULL;
+  const uint16_t* second = NULL;
+  cr_assert_eq(ccos_get_cached_file_sectors(disk, file, &count, &first), CCOS_OK);
+  cr_assert_eq(ccos_get_cached_file_sectors(disk, file, &count, &second), CCOS_OK);
+  cr_assert_eq(first, second, "Second lookup should be served from the cache");
+  cr_assert_eq(count, 3);
+
+  cr_assert_eq(ccos_write_file(disk, file, data, large_count * log_sector_size), CCOS_OK);
+  assert_cached_sectors_match_inode(disk, file, large_count);
+
+  cr_assert_eq(ccos_write_file(disk, file, data, log_sector_size), CCOS_OK);
+  assert_cached_sectors_match_inode(disk, file, 1);
+
+  // A new file may reuse the inode of the deleted one.
+  uint16_t file_id = file->header.file_id;
+  cr_assert_eq(ccos_get_cached_file_sectors(disk, file, &count, &first), CCOS_OK);
+  cr_assert_eq(ccos_delete_file(disk, file), CCOS_OK);
+  ccos_disk_allocator(disk)->cursor = file_id;
+  ccos_inode_t* new_file = ccos_add_file(disk, root, data, 2 * log_sector_size, "Other~Data~");
+  cr_assert_not_null(new_file);
+  cr_assert_eq(new_file->header.file_id, file_id);
+  assert_cached_sectors_match_inode(disk, new_file, 2);
+
+  free(data);
+  ccos_disk_free(disk);
+}
+
+static void assert_cached_dir_matches_data(ccos_disk_t* disk, ccos_inode_t* dir) {
+  const ccos_parsed_dir_t* cached = NULL;
+  cr_assert_eq(ccos_get_cached_dir(disk, dir, &cached), CCOS_OK);
+  cr_assert_eq(cached->count, dir->desc.dir_count);
+
+  uint8_t* data = NULL;
+  size_t size = 0;
+  cr_assert_eq(ccos_read_file(disk, dir, &data, &size), CCOS_OK);
+  parsed_directory_element_t* elements = NULL;
+  cr_assert_eq(ccos_parse_directory_data(disk, data, size, dir->desc.dir_count, &elements), CCOS_OK);
+
+  for (size_t i = 0; i < cached->count; ++i) {
+    cr_assert_eq(cached->elements[i].offset, elements[i].offset, "Entry #%zu offset mismatch", i);
+    cr_assert_eq(cached->elements[i].size, elements[i].size, "Entry #%zu size mismatch", i);
+    cr_assert_eq(cached->elements[i].file, elements[i].file, "Entry #%zu file mismatch", i);
+
+    ccos_dir_key_t key;
+    ccos_make_dir_key(elements[i].file, &key);
+    cr_assert_eq(memcmp(&key, &cached->keys[i], sizeof(key)), 0, "Entry #%zu key mismatch", i);
+  }
+
+  free(elements);
+  free(data);
+}
+
+Test(ccos_image, dir_cache_follows_changes) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+  cr_assert_not_null(root);
+
+  uint8_t data[16] = {0};
+  const char* names[] = {"Beta~Run~", "alpha~Text~", "ALPHA~Data~", "Gamma~Run~", "b~Run~", "Zz~Run~", "mm~Runx~"};
+  ccos_inode_t* files[sizeof(names) / sizeof(names[0])] = {0};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+    files[i] = ccos_add_file(disk, root, data, sizeof(data), names[i]);
+    cr_assert_not_null(files[i]);
+    assert_cached_dir_matches_data(disk, root);
+  }
+
+  const ccos_parsed_dir_t* first = NULL;
+  const ccos_parsed_dir_t* second = NULL;
+  cr_assert_eq(ccos_get_cached_dir(disk, root, &first), CCOS_OK);
+  const parsed_directory_element_t* elements = first->elements;
+  cr_assert_eq(ccos_get_cached_dir(disk, root, &second), CCOS_OK);
+  cr_assert_eq(second->elements, elements, "Second lookup should be served from the cache");
+
+  ccos_inode_t* found = NULL;
+  cr_assert_eq(ccos_find_file_by_name(disk, root, "GAMMA~run~", &found), CCOS_OK);
+  cr_assert_eq(found, files[3]);
+
+  cr_assert_eq(ccos_rename_file(disk, files[1], "Omega", NULL), CCOS_OK);
+  assert_cached_dir_matches_data(disk, root);
+
+  cr_assert_eq(ccos_delete_file(disk, files[0]), CCOS_OK);
+  assert_cached_dir_matches_data(disk, root);
+  cr_assert_eq(ccos_delete_file(disk, files[5]), CCOS_OK);
+  assert_cached_dir_matches_data(disk, root);
+
+  // Deleted directory may leave its inode to a new directory.
+  ccos_inode_t* dir = ccos_create_dir(disk, root, "Sub");
+  cr_assert_not_null(dir);
+  cr_assert_not_null(ccos_add_file(disk, dir, data, sizeof(data), "Inner~Run~"));
+  assert_cached_dir_matches_data(disk, dir);
+  uint16_t dir_id = dir->header.file_id;
+  cr_assert_eq(ccos_delete_file(disk, dir), CCOS_OK);
+  ccos_disk_allocator(disk)->cursor = dir_id;
+  dir = ccos_create_dir(disk, root, "Other");
+  cr_assert_not_null(dir);
+  cr_assert_eq(dir->header.file_id, dir_id);
+  assert_cached_dir_matches_data(disk, dir);
+  assert_cached_dir_matches_data(disk, root);
+
+  ccos_disk_free(disk);
+}
+
+static size_t find_dir_index_linear(const ccos_dir_key_t* keys, size_t count, const ccos_dir_key_t* key) {
+  for (size_t i = 0; i < count; ++i) {
+    int res = strcmp(keys[i].name, key->name);
+    if (res == 0) {
+      size_t type_length = keys[i].type_length < key->type_length ? keys[i].type_length : key->type_length;
+      res = strncmp(keys[i].type, key->type, type_length);
+    }
+
+    if (res >= 0) {
+      return i;
+    }
+  }
+
+  return count;
+}
+
+Test(ccos_image, dir_insertion_order_matches_linear_scan) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+  cr_assert_not_null(root);
+
+  enum { FILES_COUNT = 96 };
+  static const char* types[] = {"Run", "Text", "Data", "Run Com", "Printer", "Font"};
+  ccos_dir_key_t keys[FILES_COUNT];
+  uint16_t ids[FILES_COUNT];
+  size_t count = 0;
+  uint8_t data[4] = {0};
+  uint32_t seed = 12345;
+
+  for (size_t i = 0; i < FILES_COUNT; ++i) {
+    seed = seed * 1103515245 + 12345;
+    char name[CCOS_MAX_FILE_NAME];
+    // "Run Com" starts with "Run", so it only shows up in the second half, when linear scan may become necessary.
+    const char* type = types[(seed >> 16) % (i < FILES_COUNT / 2 ? 3 : 6)];
+    snprintf(name, sizeof(name), "%s%u~%s~", (seed >> 8) % 2 ? "file" : "FILE", (unsigned)((seed >> 12) % 1000), type);
+
+    ccos_inode_t* file = ccos_add_file(disk, root, data, sizeof(data), name);
+    if (file == NULL) {
+      continue;  // duplicate name
+    }
+
+    ccos_dir_key_t key;
+    ccos_make_dir_key(file, &key);
+    size_t index = find_dir_index_linear(keys, count, &key);
+    memmove(&keys[index + 1], &keys[index], (count - index) * sizeof(ccos_dir_key_t));
+    memmove(&ids[index + 1], &ids[index], (count - index) * sizeof(uint16_t));
+    keys[index] = key;
+    ids[index] = file->header.file_id;
+    count++;
+
+    const ccos_parsed_dir_t* parsed = NULL;
+    cr_assert_eq(ccos_get_cached_dir(disk, root, &parsed), CCOS_OK);
+    cr_assert_eq(parsed->count, count);
+    for (size_t j = 0; j < count; ++j) {
+      cr_assert_eq(parsed->elements[j].file->header.file_id, ids[j], "Entry " SIZE_T " of " SIZE_T " differs", j, count);
+    }
+  }
+
+  assert_cached_dir_matches_data(disk, root);
+
+  // Same basename with "Run" followed by "Run Com" makes binary search unusable for the directory.
+  cr_assert_not_null(ccos_add_file(disk, root, data, sizeof(data), "Same~Run~"));
+  ccos_inode_t* longer = ccos_add_file(disk, root, data, sizeof(data), "Same~Run Com~");
+  cr_assert_not_null(longer);
+  const ccos_parsed_dir_t* parsed = NULL;
+  cr_assert_eq(ccos_get_cached_dir(disk, root, &parsed), CCOS_OK);
+  size_t unordered_pairs = parsed->unordered_pairs;
+  cr_assert_gt(unordered_pairs, 0);
+
+  ccos_dir_key_t key = {.name = "same", .type = "run b", .type_length = 5};
+  cr_assert_eq(ccos_find_parsed_dir_index(parsed, &key),
+               find_dir_index_linear(parsed->keys, parsed->count, &key));
+
+  cr_assert_eq(ccos_delete_file(disk, longer), CCOS_OK);
+  cr_assert_eq(ccos_get_cached_dir(disk, root, &parsed), CCOS_OK);
+  cr_assert_eq(parsed->unordered_pairs, unordered_pairs - 1);
+  assert_cached_dir_matches_data(disk, root);
+
+  ccos_disk_free(disk);
+}
+
+Test(ccos_image, name_index_follows_changes) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+  cr_assert_not_null(root);
+
+  enum { FILES_COUNT = 40 };
+  ccos_inode_t* files[FILES_COUNT] = {0};
+  uint8_t data[4] = {0};
+  char name[CCOS_MAX_FILE_NAME];
+  ccos_inode_t* found = NULL;
+
+  // The index is built by the first lookup, then grows with new entries.
+  cr_assert_eq(ccos_find_file_by_name(disk, root, "Missing~Run~", &found), CCOS_ENOENT);
+  cr_assert_null(found);
+  for (size_t i = 0; i < FILES_COUNT; ++i) {
+    snprintf(name, sizeof(name), "File%u~Run~", (unsigned)i);
+    files[i] = ccos_add_file(disk, root, data, sizeof(data), name);
+    cr_assert_not_null(files[i]);
+  }
+
+  for (size_t i = 0; i < FILES_COUNT; ++i) {
+    snprintf(name, sizeof(name), "FILE%u~rUN~", (unsigned)i);
+    cr_assert_eq(ccos_find_file_by_name(disk, root, name, &found), CCOS_OK, "%s not found", name);
+    cr_assert_eq(found, files[i]);
+  }
+
+  for (size_t i = 0; i < FILES_COUNT; i += 3) {
+    cr_assert_eq(ccos_delete_file(disk, files[i]), CCOS_OK);
+  }
+
+  for (size_t i = 1; i < FILES_COUNT; i += 3) {
+    snprintf(name, sizeof(name), "Renamed%u", (unsigned)i);
+    cr_assert_eq(ccos_rename_file(disk, files[i], name, NULL), CCOS_OK);
+  }
+
+  for (size_t i = 0; i < FILES_COUNT; ++i) {
+    snprintf(name, sizeof(name), "file%u~run~", (unsigned)i);
+    ret = ccos_find_file_by_name(disk, root, name, &found);
+    if (i % 3 == 2) {
+      cr_assert_eq(ret, CCOS_OK, "%s not found", name);
+      cr_assert_eq(found, files[i]);
+    } else {
+      cr_assert_eq(ret, CCOS_ENOENT, "%s should be gone", name);
+    }
+
+    snprintf(name, sizeof(name), "renamed%u~Run~", (unsigned)i);
+    ret = ccos_find_file_by_name(disk, root, name, &found);
+    cr_assert_eq(ret, i % 3 == 1 ? CCOS_OK : CCOS_ENOENT, "Unexpected lookup result for %s", name);
+  }
+
+  cr_assert_eq(ccos_find_file_by_name(disk, root, "file2~run", &found), CCOS_ENOENT);
+
+  ccos_disk_free(disk);
+}
+
+static void assert_same_dir_names(ccos_disk_t* disk, ccos_inode_t* dir, ccos_disk_t* other_disk, ccos_inode_t* other) {
+  uint16_t count = 0;
+  uint16_t other_count = 0;
+  ccos_inode_t** entries = NULL;
+  ccos_inode_t** other_entries = NULL;
+  cr_assert_eq(ccos_get_dir_contents(disk, dir, &count, &entries), CCOS_OK);
+  cr_assert_eq(ccos_get_dir_contents(other_disk, other, &other_count, &other_entries), CCOS_OK);
+  cr_assert_eq(count, other_count);
+  for (uint16_t i = 0; i < count; ++i) {
+    cr_assert_eq(entries[i]->desc.name_length, other_entries[i]->desc.name_length, "Entry #%d name mismatch", i);
+    cr_assert_eq(memcmp(entries[i]->desc.name, other_entries[i]->desc.name, entries[i]->desc.name_length), 0,
+                 "Entry #%d name mismatch", i);
+  }
+
+  free(other_entries);
+  free(entries);
+}
+
+Test(ccos_image, add_files_matches_one_by_one) {
+  ccos_disk_t* batch_disk = NULL;
+  ccos_disk_t* single_disk = NULL;
+  cr_assert_eq(ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &batch_disk), 0);
+  cr_assert_eq(ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &single_disk), 0);
+  ccos_inode_t* batch_root = ccos_get_root_dir(batch_disk);
+  ccos_inode_t* single_root = ccos_get_root_dir(single_disk);
+
+  uint8_t data[400] = {0};
+  const char* existing[] = {"Beta~Run~", "Delta~Text~", "Omega~Run~"};
+  for (size_t i = 0; i < sizeof(existing) / sizeof(existing[0]); ++i) {
+    cr_assert_not_null(ccos_add_file(batch_disk, batch_root, data, sizeof(data), existing[i]));
+    cr_assert_not_null(ccos_add_file(single_disk, single_root, data, sizeof(data), existing[i]));
+  }
+
+  // Second batch has types starting with each other, which can't be merged in sorted order.
+  const char* names[][5] = {{"zeta~Run~", "Alpha~Data~", "gamma~Run~", "ALPHA~Text~", "Epsilon~Run~"},
+                            {"Same~Run Com~", "Same~Run~", "Same~Ru~", "Beta~Run Com~", "A~Run~"}};
+  for (size_t batch = 0; batch < 2; ++batch) {
+    ccos_new_file_t files[5];
+    ccos_inode_t* new_files[5] = {0};
+    for (size_t i = 0; i < 5; ++i) {
+      files[i] = (ccos_new_file_t){.name = names[batch][i], .data = data, .size = i * 100};
+      cr_assert_not_null(ccos_add_file(single_disk, single_root, data, i * 100, names[batch][i]));
+    }
+
+    cr_assert_eq(ccos_add_files(batch_disk, batch_root, files, 5, new_files), CCOS_OK);
+    for (size_t i = 0; i < 5; ++i) {
+      cr_assert_not_null(new_files[i]);
+      cr_assert_eq(new_files[i]->desc.file_size, i * 100);
+      cr_assert_eq(new_files[i]->desc.dir_file_id, batch_root->header.file_id);
+      cr_assert_eq(ccos_validate_file(batch_disk, new_files[i]), CCOS_OK);
+    }
+
+    assert_cached_dir_matches_data(batch_disk, batch_root);
+    assert_same_dir_names(batch_disk, batch_root, single_disk, single_root);
+  }
+
+  // Nothing is added if any of the names is taken.
+  size_t free_space = 0;
+  cr_assert_eq(ccos_calc_free_space(batch_disk, &free_space), CCOS_OK);
+  uint16_t dir_count = batch_root->desc.dir_count;
+  ccos_new_file_t taken[] = {{.name = "New~Run~", .data = data, .size = 10},
+                             {.name = "ZETA~run~", .data = data, .size = 10}};
+  cr_assert_eq(ccos_add_files(batch_disk, batch_root, taken, 2, NULL), CCOS_EEXIST);
+  ccos_new_file_t twice[] = {{.name = "New~Run~", .data = data, .size = 10},
+                             {.name = "new~RUN~", .data = data, .size = 10}};
+  cr_assert_eq(ccos_add_files(batch_disk, batch_root, twice, 2, NULL), CCOS_EEXIST);
+
+  size_t new_free_space = 0;
+  cr_assert_eq(ccos_calc_free_space(batch_disk, &new_free_space), CCOS_OK);
+  cr_assert_eq(new_free_space, free_space);
+  cr_assert_eq(batch_root->desc.dir_count, dir_count);
+  assert_cached_dir_matches_data(batch_disk, batch_root);
+
+  ccos_disk_free(single_disk);
+  ccos_disk_free(batch_disk);
+}
+
+Test(ccos_image, rename_keeps_dir_sorted) {
+  ccos_disk_t* disk = NULL;
+  cr_assert_eq(ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk), 0);
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+
+  uint8_t data[16] = {0};
+  char names[5][CCOS_MAX_FILE_NAME] = {"Beta~Run~", "Delta~Text~", "Kappa~Run~", "Omega~Run~", "Zeta~Data~"};
+  ccos_inode_t* files[5] = {0};
+  for (size_t i = 0; i < 5; ++i) {
+    files[i] = ccos_add_file(disk, root, data, sizeof(data), names[i]);
+    cr_assert_not_null(files[i]);
+  }
+
+  // Same position and length, earlier, later, last entry moved away, other entry moved to the end, longer name.
+  const struct {
+    size_t index;
+    const char* name;
+    const char* type;
+  } renames[] = {{2, "Kappb", NULL},  {3, "Alpha", NULL}, {0, "Theta", NULL},
+                 {4, "Gamma", "Run"}, {1, "Zzz", NULL},   {2, "Kappa Longer Name", "Run Com"}};
+  for (size_t r = 0; r < sizeof(renames) / sizeof(renames[0]); ++r) {
+    ccos_inode_t* file = files[renames[r].index];
+    cr_assert_eq(ccos_rename_file(disk, file, renames[r].name, renames[r].type), CCOS_OK);
+    snprintf(names[renames[r].index], CCOS_MAX_FILE_NAME, "%.*s", file->desc.name_length, file->desc.name);
+    cr_assert_eq(ccos_validate_file(disk, file), CCOS_OK);
+    assert_cached_dir_matches_data(disk, root);
+
+    ccos_disk_t* expected_disk = NULL;
+    cr_assert_eq(ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &expected_disk), 0);
+    ccos_inode_t* expected_root = ccos_get_root_dir(expected_disk);
+    for (size_t i = 0; i < 5; ++i) {
+      cr_assert_not_null(ccos_add_file(expected_disk, expected_root, data, sizeof(data), names[i]));
+    }
+
+    assert_same_dir_names(disk, root, expected_disk, expected_root);
+    ccos_disk_free(expected_disk);
+  }
+
+  // Only case of the own name may change, other names are taken.
+  cr_assert_eq(ccos_rename_file(disk, files[0], "THETA", NULL), CCOS_OK);
+  cr_assert_eq(ccos_rename_file(disk, files[0], "alpha", NULL), CCOS_EEXIST);
+  cr_assert_eq(ccos_validate_file(disk, files[0]), CCOS_OK);
+  assert_cached_dir_matches_data(disk, root);
+
+  ccos_disk_free(disk);
+}
+
+Test(ccos_image, lookup_path) {
+  ccos_disk_t* disk = NULL;
+  cr_assert_eq(ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk), 0);
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+
+  uint8_t data[16] = {0};
+  ccos_inode_t* programs = ccos_create_dir(disk, root, "Programs");
+  ccos_inode_t* other = ccos_create_dir(disk, root, "Other");
+  cr_assert_not_null(programs);
+  cr_assert_not_null(other);
+  ccos_inode_t* first = ccos_add_file(disk, programs, data, sizeof(data), "Demo~Text~");
+  ccos_inode_t* second = ccos_add_file(disk, other, data, sizeof(data), "Demo~Text~");
+  ccos_inode_t* slashed = ccos_add_file(disk, other, data, sizeof(data), "Serial ETX/ACK~Printer~");
+  ccos_inode_t* top = ccos_add_file(disk, root, data, sizeof(data), "Top~Run~");
+  cr_assert(first != NULL && second != NULL && slashed != NULL && top != NULL);
+
+  ccos_inode_t* found = NULL;
+  cr_assert_eq(ccos_lookup_path(disk, "Programs~Subject~/Demo~Text~", &found), CCOS_OK);
+  cr_assert_eq(found, first);
+  cr_assert_eq(ccos_lookup_path(disk, "other~subject~/DEMO~Text~", &found), CCOS_OK);
+  cr_assert_eq(found, second);
+  cr_assert_eq(ccos_lookup_path(disk, "Other~Subject~/Serial ETX/ACK~Printer~", &found), CCOS_OK);
+  cr_assert_eq(found, slashed);
+  cr_assert_eq(ccos_lookup_path(disk, "Top~Run~", &found), CCOS_OK);
+  cr_assert_eq(found, top);
+  cr_assert_eq(ccos_lookup_path(disk, "Other~Subject~/", &found), CCOS_OK);
+  cr_assert_eq(found, other);
+
+  cr_assert_eq(ccos_lookup_path(disk, "Other~Subject~/Top~Run~", &found), CCOS_ENOENT);
+  cr_assert_null(found);
+  cr_assert_eq(ccos_lookup_path(disk, "Top~Run~/Demo~Text~", &found), CCOS_ENOENT);
+  cr_assert_eq(ccos_lookup_path(disk, "Missing~Subject~/Demo~Text~", &found), CCOS_ENOENT);
+  cr_assert_eq(ccos_lookup_path(disk, "", &found), CCOS_EINVAL);
+
+  ccos_disk_free(disk);
+}
+
+static void collect_named_files(ccos_disk_t* disk, ccos_inode_t* dir, const char* name, ccos_inode_t** found,
+                                size_t* count) {
+  uint16_t entry_count = 0;
+  ccos_inode_t** entries = NULL;
+  cr_assert_eq(ccos_get_dir_contents(disk, dir, &entry_count, &entries), CCOS_OK);
+  for (uint16_t i = 0; i < entry_count; ++i) {
+    if (entries[i]->desc.name_length == strlen(name) &&
+        strncasecmp(entries[i]->desc.name, name, entries[i]->desc.name_length) == 0) {
+      found[(*count)++] = entries[i];
+    }
+
+    if (ccos_is_dir(entries[i])) {
+      collect_named_files(disk, entries[i], name, found, count);
+    }
+  }
+
+  free(entries);
+}
+
+static void assert_image_names_match_scan(ccos_disk_t* disk, const char* name) {
+  ccos_inode_t* expected[16] = {0};
+  size_t expected_count = 0;
+  collect_named_files(disk, ccos_get_root_dir(disk), name, expected, &expected_count);
+
+  ccos_inode_t** found = NULL;
+  size_t found_count = 0;
+  ccos_error_t err = ccos_find_files_by_name(disk, name, &found, &found_count);
+  cr_assert_eq(err, expected_count > 0 ? CCOS_OK : CCOS_ENOENT, "%s lookup failed", name);
+  cr_assert_eq(found_count, expected_count, "%s: %zu files found, %zu expected", name, found_count, expected_count);
+  for (size_t i = 0; i < found_count; ++i) {
+    cr_assert_eq(found[i], expected[i], "%s: file #%zu mismatch", name, i);
+  }
+
+  free(found);
+}
+
+Test(ccos_image, image_name_index_follows_changes) {
+  ccos_disk_t* disk = NULL;
+  cr_assert_eq(ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk), 0);
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+
+  uint8_t data[16] = {0};
+  ccos_inode_t* first = ccos_create_dir(disk, root, "First");
+  ccos_inode_t* second = ccos_create_dir(disk, root, "Second");
+  cr_assert(first != NULL && second != NULL);
+  cr_assert_not_null(ccos_add_file(disk, root, data, sizeof(data), "Dup~Run~"));
+  cr_assert_not_null(ccos_add_file(disk, second, data, sizeof(data), "DUP~run~"));
+  cr_assert_not_null(ccos_add_file(disk, second, data, sizeof(data), "Other~Run~"));
+
+  // The index is built by the first lookup, then follows the changes.
+  assert_image_names_match_scan(disk, "dup~Run~");
+  assert_image_names_match_scan(disk, "Second~Subject~");
+
+  ccos_inode_t* added = ccos_add_file(disk, first, data, sizeof(data), "Dup~Run~");
+  cr_assert_not_null(added);
+  assert_image_names_match_scan(disk, "Dup~Run~");
+
+  ccos_new_file_t new_files[] = {{.name = "dup~RUN~", .data = data, .size = 4}, {.name = "New~Run~", .data = data}};
+  ccos_inode_t* third = ccos_create_dir(disk, root, "Third");
+  cr_assert_not_null(third);
+  cr_assert_eq(ccos_add_files(disk, third, new_files, 2, NULL), CCOS_OK);
+  assert_image_names_match_scan(disk, "Dup~Run~");
+  assert_image_names_match_scan(disk, "New~Run~");
+
+  cr_assert_eq(ccos_rename_file(disk, added, "Renamed", NULL), CCOS_OK);
+  assert_image_names_match_scan(disk, "Dup~Run~");
+  assert_image_names_match_scan(disk, "Renamed~Run~");
+
+  // Files of the deleted directory are removed from the index too.
+  cr_assert_eq(ccos_delete_file(disk, second), CCOS_OK);
+  assert_image_names_match_scan(disk, "Dup~Run~");
+  assert_image_names_match_scan(disk, "Other~Run~");
+  assert_image_names_match_scan(disk, "Second~Subject~");
+
+  ccos_disk_t* dest = NULL;
+  cr_assert_eq(ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &dest), 0);
+  assert_image_names_match_scan(dest, "Renamed~Run~");
+  cr_assert_eq(ccos_copy_file(disk, added, dest, ccos_get_root_dir(dest)), CCOS_OK);
+  assert_image_names_match_scan(dest, "Renamed~Run~");
+
+  ccos_disk_free(dest);
+  ccos_disk_free(disk);
+}
+
+Test(ccos_image, image_name_index_drops_on_dir_writes) {
+  ccos_disk_t* disk = NULL;
+  cr_assert_eq(ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk), 0);
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+
+  uint8_t data[16] = {0};
+  cr_assert_not_null(ccos_add_file(disk, root, data, sizeof(data), "A~Run~"));
+  cr_assert_not_null(ccos_add_file(disk, root, data, sizeof(data), "B~Run~"));
+  assert_image_names_match_scan(disk, "B~Run~");
+
+  uint8_t* dir_data = NULL;
+  size_t dir_size = 0;
+  cr_assert_eq(ccos_read_file(disk, root, &dir_data, &dir_size), CCOS_OK);
+
+  // Mark the first entry as the last one, so the second one is no longer listed.
+  const dir_entry_t* entry = (const dir_entry_t*)&dir_data[1];
+  size_t next_flag = 1 + sizeof(dir_entry_t) + entry->name_length + sizeof(uint8_t);
+  const uint8_t last_entry = CCOS_DIR_LAST_ENTRY_MARKER;
+  cr_assert_eq(ccos_pwrite(disk, root, next_flag, &last_entry, sizeof(last_entry), NULL, NULL), CCOS_OK);
+  ccos_inode_t* found = NULL;
+  cr_assert_eq(ccos_find_file_by_name(disk, root, "B~Run~", &found), CCOS_ENOENT);
+  assert_image_names_match_scan(disk, "B~Run~");
+  assert_image_names_match_scan(disk, "A~Run~");
+
+  cr_assert_eq(ccos_write_file(disk, root, dir_data, dir_size), CCOS_OK);
+  assert_image_names_match_scan(disk, "B~Run~");
+
+  cr_assert_eq(ccos_truncate(disk, root, next_flag), CCOS_OK);
+  assert_image_names_match_scan(disk, "A~Run~");
+  assert_image_names_match_scan(disk, "B~Run~");
+
+  free(dir_data);
+  ccos_disk_free(disk);
+}
+
+static uint8_t* read_test_image(const char* path, size_t* size) {
+  FILE* f = fopen(path, "rb");
+  cr_assert_not_null(f, "Unable to open %s", path);
+  fseek(f, 0, SEEK_END);
+  *size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t* data = malloc(*size);
+  cr_assert_not_null(data);
+  cr_assert_eq(fread(data, 1, *size, f), *size);
+  fclose(f);
+  return data;
+}
+
+static void write_test_image(const char* path, const uint8_t* data, size_t size) {
+  FILE* f = fopen(path, "wb");
+  cr_assert_not_null(f, "Unable to create %s", path);
+  cr_assert_eq(fwrite(data, 1, size, f), size);
+  fclose(f);
+}
+
+Test(ccos_image, disk_open_file) {
+  const char* image = "files/floppy 720k/empty.img";
+  size_t size = 0;
+  uint8_t* expected = read_test_image(image, &size);
+
+  // Private mapping sees the image, but doesn't change it.
+  ccos_disk_t* disk = ccos_disk_open_file(image, CCOS_DISK_MAP_PRIVATE, 512, DEFAULT_SUPERBLOCK,
+                                          DEFAULT_BITMASK_BLOCK_ID);
+  cr_assert_not_null(disk);
+  cr_assert_eq(ccos_disk_size(disk), size);
+  cr_assert_eq(memcmp(ccos_disk_data(disk), expected, size), 0);
+  uint8_t data[16] = {0};
+  cr_assert_not_null(ccos_add_file(disk, ccos_get_root_dir(disk), data, sizeof(data), "Private~Run~"));
+  ccos_disk_free(disk);
+
+  size_t new_size = 0;
+  uint8_t* actual = read_test_image(image, &new_size);
+  cr_assert_eq(new_size, size);
+  cr_assert_eq(memcmp(actual, expected, size), 0, "Private mapping changed the image");
+  free(actual);
+
+  // Shared mapping writes the changes to the file.
+  const char* path = "disk_open_file.tmp";
+  write_test_image(path, expected, size);
+
+  disk = ccos_disk_open_file(path, CCOS_DISK_MAP_SHARED, 512, DEFAULT_SUPERBLOCK, DEFAULT_BITMASK_BLOCK_ID);
+  cr_assert_not_null(disk);
+  cr_assert_not_null(ccos_add_file(disk, ccos_get_root_dir(disk), data, sizeof(data), "Shared~Run~"));
+  ccos_disk_free(disk);
+
+  disk = ccos_disk_open_file(path, CCOS_DISK_MAP_PRIVATE, 512, DEFAULT_SUPERBLOCK, DEFAULT_BITMASK_BLOCK_ID);
+  cr_assert_not_null(disk);
+  ccos_inode_t* found = NULL;
+  cr_assert_eq(ccos_find_file_by_name(disk, ccos_get_root_dir(disk), "Shared~Run~", &found), CCOS_OK);
+  cr_assert_eq(ccos_validate_file(disk, found), CCOS_OK);
+  ccos_disk_free(disk);
+  remove(path);
+
+  cr_assert_null(ccos_disk_open_file("files/missing.img", CCOS_DISK_MAP_PRIVATE, 512, DEFAULT_SUPERBLOCK,
+                                     DEFAULT_BITMASK_BLOCK_ID));
+  cr_assert_null(ccos_disk_open_file(image, CCOS_DISK_MAP_PRIVATE, 300, DEFAULT_SUPERBLOCK, DEFAULT_BITMASK_BLOCK_ID));
+  free(expected);
+}
+
+Test(ccos_image, disk_flush_writes_changed_sectors) {
+  ccos_disk_t* disk = NULL;
+  cr_assert_eq(ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk), 0);
+  size_t size = ccos_disk_size(disk);
+  size_t sector_size = 512;
+
+  // New image is written completely, creating the file.
+  const char* path = "disk_flush.tmp";
+  remove(path);
+  cr_assert_eq(ccos_disk_flush(disk, path), CCOS_OK);
+  size_t file_size = 0;
+  uint8_t* actual = read_test_image(path, &file_size);
+  cr_assert_eq(file_size, size);
+  cr_assert_eq(memcmp(actual, ccos_disk_data(disk), size), 0);
+  free(actual);
+
+  // Sector which is never changed is not written again, so the marker put there stays in the file.
+  uint8_t marker[512];
+  memset(marker, 0xA5, sizeof(marker));
+  size_t marker_offset = size - sector_size;
+  FILE* f = fopen(path, "r+b");
+  cr_assert_not_null(f);
+  fseek(f, (long)marker_offset, SEEK_SET);
+  cr_assert_eq(fwrite(marker, 1, sizeof(marker), f), sizeof(marker));
+  fclose(f);
+
+  uint8_t data[1500];
+  for (size_t i = 0; i < sizeof(data); ++i) {
+    data[i] = (uint8_t)(i * 7);
+  }
+
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+  ccos_inode_t* dir = ccos_create_dir(disk, root, "Flushed");
+  cr_assert_not_null(dir);
+  ccos_inode_t* file = ccos_add_file(disk, dir, data, sizeof(data), "Flushed~Run~");
+  cr_assert_not_null(file);
+  ccos_inode_t* doomed = ccos_add_file(disk, root, data, 100, "Doomed~Run~");
+  cr_assert_not_null(doomed);
+  cr_assert_eq(ccos_rename_file(disk, file, "Renamed", "Run"), CCOS_OK);
+  cr_assert_eq(ccos_pwrite(disk, file, 1400, data, 300, NULL, NULL), CCOS_OK);
+  cr_assert_eq(ccos_delete_file(disk, doomed), CCOS_OK);
+  cr_assert_neq(memcmp(ccos_disk_data(disk) + marker_offset, marker, sizeof(marker)), 0);
+
+  // Changed sectors alone don't make an image, so the missing file is not created.
+  const char* missing_path = "disk_flush_missing.tmp";
+  remove(missing_path);
+  cr_assert_eq(ccos_disk_flush(disk, missing_path), CCOS_ENOENT);
+  cr_assert_null(fopen(missing_path, "rb"));
+
+  cr_assert_eq(ccos_disk_flush(disk, path), CCOS_OK);
+  actual = read_test_image(path, &file_size);
+  cr_assert_eq(file_size, size);
+  cr_assert_eq(memcmp(actual, ccos_disk_data(disk), marker_offset), 0, "Changed sectors are not written");
+  cr_assert_eq(memcmp(actual + marker_offset, marker, sizeof(marker)), 0, "Unchanged sector is written");
+  free(actual);
+
+  // Write in the file bounds changes only the sectors reported by ccos_pwrite().
+  uint8_t* filler = malloc(size);
+  cr_assert_not_null(filler);
+  memset(filler, 0xA5, size);
+  f = fopen(path, "wb");
+  cr_assert_not_null(f);
+  cr_assert_eq(fwrite(filler, 1, size, f), size);
+  fclose(f);
+
+  uint16_t* dirty_sectors = NULL;
+  size_t dirty_count = 0;
+  cr_assert_eq(ccos_pwrite(disk, file, 10, data, 600, &dirty_sectors, &dirty_count), CCOS_OK);
+  cr_assert_eq(ccos_disk_flush(disk, path), CCOS_OK);
+  actual = read_test_image(path, &file_size);
+  for (size_t sector = 0; sector < size / sector_size; ++sector) {
+    bool is_dirty = false;
+    for (size_t i = 0; i < dirty_count; ++i) {
+      is_dirty |= dirty_sectors[i] == sector;
+    }
+
+    const uint8_t* expected = is_dirty ? ccos_disk_data(disk) + sector * sector_size : filler;
+    cr_assert_eq(memcmp(actual + sector * sector_size, expected, sector_size), 0, "Sector " SIZE_T " mismatch",
+                 sector);
+  }
+
+  free(actual);
+  free(dirty_sectors);
+  free(filler);
+
+  // Nothing is written when there are no changes.
+  cr_assert_eq(ccos_disk_flush(disk, path), CCOS_OK);
+  ccos_disk_free(disk);
+  remove(path);
+}
@@ -122,6 +122,13 @@ static void mark_all_real_blocks_used(ccos_disk_t* disk) {
   }
 }
 
+static bool is_block_allocated(ccos_disk_t* disk, const ccos_bitmask_list_t* bitmask_list, size_t block) {
+  size_t blocks_per_bitmask = ccos_get_bitmask_sectors(disk);
+  size_t local_block = block % blocks_per_bitmask;
+  const uint8_t* bytes = ccos_get_bitmask_bytes(bitmask_list->bitmask_blocks[block / blocks_per_bitmask]);
+  return (bytes[local_block / 8] & (1u << (local_block % 8))) != 0;
+}
+
 static void assert_fresh_image(disk_format_t format, size_t disk_size, uint16_t expected_sector_size) {
   ccos_disk_t* disk = NULL;
   int ret = ccos_new_disk_image(format, disk_size, &disk);
@@ -170,6 +177,51 @@ Test(bitmap, fresh_bubbles) {
   assert_fresh_image(CCOS_DISK_FORMAT_BUBMEM, 3 * 128 * 1024, 256);
 }
 
+Test(bitmap, fresh_max_size) {
+  assert_fresh_image(CCOS_DISK_FORMAT_COMPASS, 65528 * 512, 512);
+}
+
+Test(bitmap, word_scan_matches_bit_scan) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 10 * 1024 * 1024, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
+  cr_assert_gt(bitmask_list.length, 1);
+
+  size_t block_count = ccos_disk_size(disk) / ccos_disk_sector_size(disk);
+  size_t blocks_per_bitmask = ccos_get_bitmask_sectors(disk);
+
+  // Allocate everything but a sparse pattern around the bitmask block boundaries.
+  mark_all_real_blocks_used(disk);
+  for (size_t i = 1; i < bitmask_list.length && i * blocks_per_bitmask < block_count; ++i) {
+    ccos_mark_sector(disk, &bitmask_list, i * blocks_per_bitmask - 1, 0);
+    ccos_mark_sector(disk, &bitmask_list, i * blocks_per_bitmask + 63, 0);
+  }
+  ccos_mark_sector(disk, &bitmask_list, block_count - 1, 0);
+
+  size_t expected_free = 0;
+  for (size_t block = 0; block < block_count; ++block) {
+    size_t bitmask_index = block / blocks_per_bitmask;
+    size_t local_block = block % blocks_per_bitmask;
+    uint8_t* bytes = ccos_get_bitmask_bytes(bitmask_list.bitmask_blocks[bitmask_index]);
+    if ((bytes[local_block / 8] & (1u << (local_block % 8))) == 0) {
+      expected_free++;
+
+      // Each free block is found when the search starts anywhere after the previous free one.
+      ccos_disk_allocator(disk)->cursor = block > 5 ? block - 5 : 0;
+      cr_assert_eq(ccos_get_free_sector(disk, &bitmask_list), block);
+    }
+  }
+
+  size_t free_blocks_count = 0;
+  cr_assert_eq(ccos_get_free_sectors_count(disk, &bitmask_list, &free_blocks_count), CCOS_OK);
+  cr_assert_eq(free_blocks_count, expected_free);
+  assert_valid_bitmaps(disk);
+
+  ccos_disk_free(disk);
+}
+
 Test(bitmap, tail_bits_512) {
   assert_tail_free_bit_is_not_returned(CCOS_DISK_FORMAT_COMPASS, 720 * 512);
 }
@@ -178,6 +230,204 @@ Test(bitmap, tail_bits_256) {
   assert_tail_free_bit_is_not_returned(CCOS_DISK_FORMAT_BUBMEM, 3 * 128 * 1024);
 }
 
+Test(bitmap, allocator_is_next_fit) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 512, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
+  cr_assert_gt(bitmask_list.length, 0);
+
+  uint16_t first = ccos_allocate_sector(disk, &bitmask_list);
+  uint16_t second = ccos_allocate_sector(disk, &bitmask_list);
+  cr_assert_neq(first, CCOS_INVALID_BLOCK);
+  cr_assert_gt(second, first);
+
+  // Freed block is not reused until the cursor wraps around.
+  ccos_mark_sector(disk, &bitmask_list, first, 0);
+  uint16_t third = ccos_allocate_sector(disk, &bitmask_list);
+  cr_assert_gt(third, second);
+
+  mark_all_real_blocks_used(disk);
+  ccos_mark_sector(disk, &bitmask_list, first, 0);
+  cr_assert_eq(ccos_allocate_sector(disk, &bitmask_list), first);
+  cr_assert_eq(ccos_allocate_sector(disk, &bitmask_list), CCOS_INVALID_BLOCK);
+  assert_valid_bitmaps(disk);
+
+  ccos_disk_free(disk);
+}
+
+Test(bitmap, allocate_sectors_prefers_contiguous_run) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 512, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
+  cr_assert_gt(bitmask_list.length, 0);
+
+  // A single free block followed by a run of 8 free blocks.
+  mark_all_real_blocks_used(disk);
+  ccos_mark_sector(disk, &bitmask_list, 400, 0);
+  for (uint16_t block = 500; block < 508; ++block) {
+    ccos_mark_sector(disk, &bitmask_list, block, 0);
+  }
+  ccos_disk_allocator(disk)->cursor = 0;
+
+  uint16_t sectors[4] = {0};
+  cr_assert_eq(ccos_allocate_sectors(disk, &bitmask_list, 4, sectors), CCOS_OK);
+  for (uint16_t i = 0; i < 4; ++i) {
+    cr_assert_eq(sectors[i], 500 + i);
+  }
+
+  cr_assert_eq(ccos_allocate_sectors(disk, &bitmask_list, 3, sectors), CCOS_OK);
+  for (uint16_t i = 0; i < 3; ++i) {
+    cr_assert_eq(sectors[i], 504 + i);
+  }
+
+  // Only 400 and 507 are left: too few for 3 blocks, and nothing is allocated on failure.
+  uint8_t* snapshot = NULL;
+  size_t snapshot_size = copy_bitmap_bytes(disk, &snapshot);
+  cr_assert_eq(ccos_allocate_sectors(disk, &bitmask_list, 3, sectors), CCOS_ENOSPC);
+  assert_bitmap_bytes_equal(disk, snapshot, snapshot_size);
+  free(snapshot);
+
+  cr_assert_eq(ccos_allocate_sectors(disk, &bitmask_list, 2, sectors), CCOS_OK);
+  cr_assert_eq(sectors[0], 507);
+  cr_assert_eq(sectors[1], 400);
+  cr_assert_eq(ccos_get_free_sector(disk, &bitmask_list), CCOS_INVALID_BLOCK);
+  assert_valid_bitmaps(disk);
+
+  ccos_disk_free(disk);
+}
+
+Test(bitmap, find_free_run_first_and_best_fit) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 512, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
+  cr_assert_gt(bitmask_list.length, 0);
+
+  // Free runs of 5, 3 and 4 blocks.
+  mark_all_real_blocks_used(disk);
+  for (uint16_t block = 100; block < 105; ++block) {
+    ccos_mark_sector(disk, &bitmask_list, block, 0);
+  }
+  for (uint16_t block = 200; block < 203; ++block) {
+    ccos_mark_sector(disk, &bitmask_list, block, 0);
+  }
+  for (uint16_t block = 300; block < 304; ++block) {
+    ccos_mark_sector(disk, &bitmask_list, block, 0);
+  }
+
+  uint16_t start = 0;
+  cr_assert_eq(ccos_find_free_run(disk, &bitmask_list, 3, CCOS_FIT_FIRST, &start), CCOS_OK);
+  cr_assert_eq(start, 100);
+  cr_assert_eq(ccos_find_free_run(disk, &bitmask_list, 3, CCOS_FIT_BEST, &start), CCOS_OK);
+  cr_assert_eq(start, 200);
+  cr_assert_eq(ccos_find_free_run(disk, &bitmask_list, 4, CCOS_FIT_BEST, &start), CCOS_OK);
+  cr_assert_eq(start, 300);
+  cr_assert_eq(ccos_find_free_run(disk, &bitmask_list, 6, CCOS_FIT_FIRST, &start), CCOS_ENOSPC);
+
+  // Bitmap changes made with ccos_bitmask_write() are visible to the next search.
+  uint8_t* bytes = ccos_get_bitmask_bytes(bitmask_list.bitmask_blocks[0]);
+  const uint8_t free_byte = 0;
+  ccos_bitmask_write(disk, bitmask_list.bitmask_blocks[0], &bytes[400 / 8], &free_byte, sizeof(free_byte));
+  cr_assert_eq(ccos_find_free_run(disk, &bitmask_list, 6, CCOS_FIT_FIRST, &start), CCOS_OK);
+  cr_assert_eq(start, 400);
+
+  ccos_disk_free(disk);
+}
+
+Test(bitmap, summary_follows_marks) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 65528 * 512, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
+  cr_assert_gt(bitmask_list.length, 1);
+
+  size_t block_count = ccos_disk_size(disk) / ccos_disk_sector_size(disk);
+  mark_all_real_blocks_used(disk);
+
+  // Free and allocate random blocks, checking searches against a plain scan.
+  srand(7);
+  for (size_t round = 0; round < 2000; ++round) {
+    size_t block = (size_t)rand() % block_count;
+    ccos_mark_sector(disk, &bitmask_list, (uint16_t)block, (uint8_t)(round % 3 == 0));
+
+    size_t cursor = (size_t)rand() % block_count;
+    size_t expected = cursor;
+    while (expected < block_count && is_block_allocated(disk, &bitmask_list, expected)) {
+      expected++;
+    }
+    if (expected == block_count) {
+      for (expected = 0; expected < cursor && is_block_allocated(disk, &bitmask_list, expected); ++expected) {
+      }
+    }
+
+    ccos_disk_allocator(disk)->cursor = cursor;
+    uint16_t found = ccos_get_free_sector(disk, &bitmask_list);
+    if (expected == cursor && is_block_allocated(disk, &bitmask_list, cursor)) {
+      cr_assert_eq(found, CCOS_INVALID_BLOCK);
+    } else {
+      cr_assert_eq(found, expected);
+    }
+
+    if (round % 20 == 0) {
+      size_t count = 1 + round % 7;
+      size_t run_length = 0;
+      size_t run_start = block_count;
+      for (size_t i = 0; i < block_count && run_start == block_count; ++i) {
+        run_length = is_block_allocated(disk, &bitmask_list, i) ? 0 : run_length + 1;
+        if (run_length == count) {
+          run_start = i + 1 - count;
+        }
+      }
+
+      uint16_t start = 0;
+      ccos_error_t err = ccos_find_free_run(disk, &bitmask_list, count, CCOS_FIT_FIRST, &start);
+      if (run_start == block_count) {
+        cr_assert_eq(err, CCOS_ENOSPC);
+      } else {
+        cr_assert_eq(err, CCOS_OK);
+        cr_assert_eq(start, run_start);
+      }
+    }
+  }
+
+  assert_valid_bitmaps(disk);
+  ccos_disk_free(disk);
+}
+
+Test(bitmap, batched_update_commits_once) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 10 * 1024 * 1024, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
+  cr_assert_gt(bitmask_list.length, 1);
+
+  uint16_t allocated_before = bitmask_list.bitmask_blocks[0]->allocated;
+
+  ccos_begin_bitmask_update(disk);
+  uint16_t first = ccos_allocate_sector(disk, &bitmask_list);
+  ccos_begin_bitmask_update(disk);
+  uint16_t second = ccos_allocate_sector(disk, &bitmask_list);
+  ccos_commit_bitmask_update(disk, &bitmask_list);
+  ccos_mark_sector(disk, &bitmask_list, first, 0);
+  cr_assert_neq(second, CCOS_INVALID_BLOCK);
+  cr_assert_eq(bitmask_list.bitmask_blocks[0]->allocated, allocated_before);
+  ccos_commit_bitmask_update(disk, &bitmask_list);
+
+  for (size_t i = 0; i < bitmask_list.length; ++i) {
+    cr_assert_eq(bitmask_list.bitmask_blocks[i]->allocated, allocated_before + 1);
+  }
+  assert_valid_bitmaps(disk);
+
+  ccos_disk_free(disk);
+}
+
 Test(bitmap, reject_bad_allocated) {
   ccos_disk_t* disk = NULL;
   int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 512, &disk);
@@ -258,6 +508,84 @@ Test(bitmap, validate_allocated_count, .init = cr_redirect_stderr) {
   ccos_disk_free(disk);
 }
 
+Test(bitmap, calc_free_space_uses_allocated_counter, .init = cr_redirect_stderr) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 512, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
+  cr_assert_gt(bitmask_list.length, 0);
+
+  size_t sector_size = ccos_disk_sector_size(disk);
+  size_t free_count = 0;
+  cr_assert_eq(ccos_get_free_sectors_count(disk, &bitmask_list, &free_count), CCOS_OK);
+
+  size_t free_space = 0;
+  cr_assert_eq(ccos_calc_free_space(disk, &free_space), CCOS_OK);
+  cr_assert_eq(free_space, free_count * sector_size);
+
+  // Pending batch updates are taken into account.
+  ccos_begin_bitmask_update(disk);
+  uint16_t block = ccos_get_free_sector(disk, &bitmask_list);
+  cr_assert_neq(block, CCOS_INVALID_BLOCK);
+  ccos_mark_sector(disk, &bitmask_list, block, 1);
+  cr_assert_eq(ccos_calc_free_space(disk, &free_space), CCOS_OK);
+  cr_assert_eq(free_space, (free_count - 1) * sector_size);
+  ccos_commit_bitmask_update(disk, &bitmask_list);
+  cr_assert_eq(ccos_calc_free_space(disk, &free_space), CCOS_OK);
+  cr_assert_eq(free_space, (free_count - 1) * sector_size);
+
+  // The bitmap is not consulted while the counter is in range.
+  bitmask_list.bitmask_blocks[0]->allocated += 10;
+  ccos_update_bitmask_checksum(disk, bitmask_list.bitmask_blocks[0]);
+  cr_assert_eq(ccos_calc_free_space(disk, &free_space), CCOS_OK);
+  cr_assert_eq(free_space, (free_count - 11) * sector_size);
+  cr_assert_stderr_eq_str("");
+
+  ccos_disk_free(disk);
+}
+
+Test(bitmap, verify_free_space_repairs_counter, .init = cr_redirect_stderr) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 512, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  ccos_bitmask_list_t bitmask_list = ccos_find_bitmask_sectors(disk);
+  cr_assert_gt(bitmask_list.length, 0);
+
+  size_t sector_size = ccos_disk_sector_size(disk);
+  size_t free_count = 0;
+  cr_assert_eq(ccos_get_free_sectors_count(disk, &bitmask_list, &free_count), CCOS_OK);
+
+  size_t free_space = 0;
+  cr_assert_eq(ccos_verify_free_space(disk, false, &free_space), CCOS_OK);
+  cr_assert_eq(free_space, free_count * sector_size);
+
+  uint16_t allocated = bitmask_list.bitmask_blocks[0]->allocated;
+  bitmask_list.bitmask_blocks[0]->allocated = 0;
+  ccos_update_bitmask_checksum(disk, bitmask_list.bitmask_blocks[0]);
+
+  cr_assert_eq(ccos_verify_free_space(disk, false, &free_space), CCOS_EINVAL);
+  cr_assert_eq(free_space, free_count * sector_size);
+  cr_assert_eq(bitmask_list.bitmask_blocks[0]->allocated, 0);
+
+  cr_assert_eq(ccos_verify_free_space(disk, true, &free_space), CCOS_OK);
+  cr_assert_eq(free_space, free_count * sector_size);
+  cr_assert_eq(bitmask_list.bitmask_blocks[0]->allocated, allocated);
+  cr_assert_eq(ccos_verify_free_space(disk, false, NULL), CCOS_OK);
+
+  char expected_warning[128];
+  snprintf(expected_warning, sizeof(expected_warning),
+           "Warn: bitmask #0 allocated count (0) mismatches allocated blocks (%u)!\n", allocated);
+  char expected_stderr[256];
+  snprintf(expected_stderr, sizeof(expected_stderr), "%s%s", expected_warning, expected_warning);
+  cr_assert_stderr_eq_str(expected_stderr);
+
+  cr_assert(ccos_validate_disk_bitmap(disk));
+
+  ccos_disk_free(disk);
+}
+
 Test(bitmap, validate_checksum, .init = cr_redirect_stderr) {
   ccos_disk_t* disk = NULL;
   int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 512, &disk);
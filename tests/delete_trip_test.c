@@ -2,6 +2,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -221,3 +222,170 @@ Test(delete_trip, repeated_delete_add_512_byte_sectors) {
 Test(delete_trip, repeated_delete_add_256_byte_sectors) {
   run_delete_trip(CCOS_DISK_FORMAT_BUBMEM, 2 * 1024 * 1024, 256);
 }
+
+// Creates the same tree on every call, so file ids match between images.
+static void create_batch_delete_tree(ccos_disk_t* disk, const uint8_t* data, ccos_inode_t** programs,
+                                     ccos_inode_t** files, ccos_inode_t** sub, ccos_inode_t** root_file) {
+  static const char* names[] = {"Alpha~Data~", "Beta~Data~",    "Gamma~Data~",
+                                "Delta~Data~", "Epsilon~Data~", "Zeta~Run~"};
+  *programs = create_programs_dir(disk);
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+    files[i] = ccos_add_file(disk, *programs, (uint8_t*)data, 100 * i, names[i]);
+    cr_assert_not_null(files[i], "ccos_add_file failed for %s", names[i]);
+  }
+
+  *sub = ccos_create_dir(disk, *programs, "Sub");
+  cr_assert_not_null(*sub);
+  cr_assert_not_null(ccos_add_file(disk, *sub, (uint8_t*)data, 3000, "Inner~Run~"));
+  cr_assert_not_null(ccos_add_file(disk, *sub, (uint8_t*)data, 10, "Other~Run~"));
+
+  *root_file = ccos_add_file(disk, ccos_get_root_dir(disk), (uint8_t*)data, 700, "Top~Run~");
+  cr_assert_not_null(*root_file);
+}
+
+Test(delete_trip, batch_delete_matches_one_by_one) {
+  ccos_disk_t* disk = NULL;
+  ccos_disk_t* single_disk = NULL;
+  cr_assert_eq(ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk), 0);
+  cr_assert_eq(ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &single_disk), 0);
+  uint8_t* data = create_random_data(3000);
+  cr_assert_not_null(data);
+
+  size_t free_space = 0;
+  cr_assert_eq(ccos_calc_free_space(disk, &free_space), CCOS_OK);
+
+  ccos_inode_t* programs = NULL;
+  ccos_inode_t* files[6] = {0};
+  ccos_inode_t* sub = NULL;
+  ccos_inode_t* root_file = NULL;
+  create_batch_delete_tree(disk, data, &programs, files, &sub, &root_file);
+
+  ccos_inode_t* single_programs = NULL;
+  ccos_inode_t* single_files[6] = {0};
+  ccos_inode_t* single_sub = NULL;
+  ccos_inode_t* single_root_file = NULL;
+  create_batch_delete_tree(single_disk, data, &single_programs, single_files, &single_sub, &single_root_file);
+
+  uint16_t sub_files = 0;
+  ccos_inode_t** sub_entries = NULL;
+  cr_assert_eq(ccos_get_dir_contents(disk, sub, &sub_files, &sub_entries), CCOS_OK);
+  cr_assert_eq(sub_files, 2);
+
+  // Files inside deleted directories and repeated files are deleted once.
+  ccos_inode_t* victims[] = {files[5], files[0], sub_entries[1], root_file, sub, files[2], files[0]};
+  block_snapshot_t snapshots[] = {collect_file_blocks(disk, files[5]),       collect_file_blocks(disk, files[0]),
+                                  collect_file_blocks(disk, sub_entries[0]), collect_file_blocks(disk, sub_entries[1]),
+                                  collect_file_blocks(disk, root_file),      collect_file_blocks(disk, sub),
+                                  collect_file_blocks(disk, files[2])};
+  free(sub_entries);
+
+  cr_assert_eq(ccos_delete_files(disk, victims, sizeof(victims) / sizeof(victims[0])), CCOS_OK);
+  for (size_t i = 0; i < sizeof(snapshots) / sizeof(snapshots[0]); ++i) {
+    assert_snapshot_blocks_freed(disk, &snapshots[i]);
+    free(snapshots[i].blocks);
+  }
+
+  ccos_inode_t* single_victims[] = {single_files[5], single_files[0], single_root_file, single_sub, single_files[2]};
+  for (size_t i = 0; i < sizeof(single_victims) / sizeof(single_victims[0]); ++i) {
+    cr_assert_eq(ccos_delete_file(single_disk, single_victims[i]), CCOS_OK);
+  }
+
+  cr_assert(ccos_validate_disk_bitmap(disk));
+  cr_assert_eq(ccos_validate_file(disk, programs), CCOS_OK);
+  cr_assert_eq(ccos_validate_file(disk, ccos_get_root_dir(disk)), CCOS_OK);
+  cr_assert_eq(programs->desc.dir_count, 3);
+  for (size_t i = 1; i < 5; i += 2) {
+    assert_file_contents(disk, files[i], data, 100 * i);
+  }
+
+  ccos_inode_t* dirs[] = {programs, ccos_get_root_dir(disk)};
+  ccos_inode_t* single_dirs[] = {single_programs, ccos_get_root_dir(single_disk)};
+  for (size_t i = 0; i < 2; ++i) {
+    uint8_t* contents = NULL;
+    size_t size = 0;
+    uint8_t* single_contents = NULL;
+    size_t single_size = 0;
+    cr_assert_eq(ccos_read_file(disk, dirs[i], &contents, &size), CCOS_OK);
+    cr_assert_eq(ccos_read_file(single_disk, single_dirs[i], &single_contents, &single_size), CCOS_OK);
+    cr_assert_eq(size, single_size);
+    cr_assert_eq(memcmp(contents, single_contents, size), 0, "Directory contents differ");
+    free(single_contents);
+    free(contents);
+  }
+
+  cr_assert_eq(ccos_delete_file(disk, programs), CCOS_OK);
+  size_t new_free_space = 0;
+  cr_assert_eq(ccos_calc_free_space(disk, &new_free_space), CCOS_OK);
+  cr_assert_eq(new_free_space, free_space);
+
+  free(data);
+  ccos_disk_free(single_disk);
+  ccos_disk_free(disk);
+}
+
+static void collect_subtree_blocks(ccos_disk_t* disk, ccos_inode_t* file, block_snapshot_t* snapshot) {
+  block_snapshot_t blocks = collect_file_blocks(disk, file);
+  for (size_t i = 0; i < blocks.count; ++i) {
+    append_snapshot_block(snapshot, blocks.blocks[i]);
+  }
+  free(blocks.blocks);
+
+  if (!ccos_is_dir(file)) {
+    return;
+  }
+
+  uint16_t entry_count = 0;
+  ccos_inode_t** entries = NULL;
+  cr_assert_eq(ccos_get_dir_contents(disk, file, &entry_count, &entries), CCOS_OK);
+  for (uint16_t i = 0; i < entry_count; ++i) {
+    collect_subtree_blocks(disk, entries[i], snapshot);
+  }
+  free(entries);
+}
+
+Test(delete_trip, subtree_delete_frees_all_descendants) {
+  ccos_disk_t* disk = NULL;
+  cr_assert_eq(ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk), 0);
+  uint8_t* data = create_random_data(2000);
+  cr_assert_not_null(data);
+
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+  ccos_inode_t* keep = ccos_add_file(disk, root, data, 600, "Keep~Run~");
+  cr_assert_not_null(keep);
+  size_t free_space = 0;
+  cr_assert_eq(ccos_calc_free_space(disk, &free_space), CCOS_OK);
+
+  ccos_inode_t* programs = create_programs_dir(disk);
+  ccos_inode_t* dir = programs;
+  char name[CCOS_MAX_FILE_NAME];
+  for (int level = 0; level < 3; ++level) {
+    for (int i = 0; i < 20; ++i) {
+      snprintf(name, sizeof(name), "File%d~Data~", i);
+      cr_assert_not_null(ccos_add_file(disk, dir, data, 100 * (i % 20), name), "ccos_add_file failed for %s", name);
+    }
+
+    snprintf(name, sizeof(name), "Level%d", level);
+    dir = ccos_create_dir(disk, dir, name);
+    cr_assert_not_null(dir);
+  }
+
+  block_snapshot_t snapshot = {0};
+  collect_subtree_blocks(disk, programs, &snapshot);
+  uint16_t root_count = root->desc.dir_count;
+
+  cr_assert_eq(ccos_delete_file(disk, programs), CCOS_OK);
+  assert_snapshot_blocks_freed(disk, &snapshot);
+  free(snapshot.blocks);
+
+  cr_assert(ccos_validate_disk_bitmap(disk));
+  cr_assert_eq(ccos_validate_file(disk, root), CCOS_OK);
+  cr_assert_eq(root->desc.dir_count, root_count - 1);
+  assert_file_contents(disk, keep, data, 600);
+
+  size_t new_free_space = 0;
+  cr_assert_eq(ccos_calc_free_space(disk, &new_free_space), CCOS_OK);
+  cr_assert_eq(new_free_space, free_space);
+
+  free(data);
+  ccos_disk_free(disk);
+}
@@ -4,8 +4,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "ccos_disk.h"
 #include "ccos_format.h"
 #include "ccos_image.h"
+#include "ccos_private.h"
 
 static uint8_t* create_test_data(size_t size) {
   uint8_t* data = malloc(size);
@@ -151,3 +153,350 @@ Test(round_trip, medium_file_several_256_byte_sectors) {
 Test(round_trip, large_file_up_to_one_megabyte_on_256_byte_sectors) {
   assert_round_trip(CCOS_DISK_FORMAT_BUBMEM, 2 * 1024 * 1024, 256, 1024 * 1024, "Large256~Data~");
 }
+
+Test(round_trip, resize_across_content_inodes) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  // Spans the inode block list and two content inodes.
+  const size_t large_size = 300 * 1024;
+  const size_t small_size = 100 * 1024;
+  uint8_t* expected = create_test_data(large_size);
+  cr_assert_not_null(expected, "Failed to allocate test data");
+
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+  cr_assert_not_null(root, "Failed to get root directory");
+
+  size_t free_space_before = 0;
+  cr_assert_eq(ccos_calc_free_space(disk, &free_space_before), CCOS_OK);
+
+  ccos_inode_t* file = ccos_add_file(disk, root, expected, large_size, "Resize~Data~");
+  cr_assert_not_null(file, "ccos_add_file failed");
+  size_t free_space_large = 0;
+  cr_assert_eq(ccos_calc_free_space(disk, &free_space_large), CCOS_OK);
+
+  cr_assert_eq(ccos_write_file(disk, file, expected, small_size), CCOS_OK);
+  cr_assert_eq(ccos_validate_file(disk, file), CCOS_OK);
+  assert_file_contents(disk, file, expected, small_size);
+
+  cr_assert_eq(ccos_write_file(disk, file, expected, 0), CCOS_OK);
+  cr_assert_eq(ccos_validate_file(disk, file), CCOS_OK);
+  cr_assert_eq(file->content_inode_info.block_next, CCOS_INVALID_BLOCK);
+
+  cr_assert_eq(ccos_write_file(disk, file, expected, large_size), CCOS_OK);
+  cr_assert_eq(ccos_validate_file(disk, file), CCOS_OK);
+  assert_file_contents(disk, file, expected, large_size);
+
+  size_t free_space_after = 0;
+  cr_assert_eq(ccos_calc_free_space(disk, &free_space_after), CCOS_OK);
+  cr_assert_eq(free_space_after, free_space_large);
+
+  cr_assert_eq(ccos_delete_file(disk, file), CCOS_OK);
+  cr_assert_eq(ccos_calc_free_space(disk, &free_space_after), CCOS_OK);
+  cr_assert_eq(free_space_after, free_space_before);
+
+  free(expected);
+  ccos_disk_free(disk);
+}
+
+Test(round_trip, file_spans_cover_contents) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  // Spans the inode block list and a content inode, and ends in the middle of a sector.
+  const size_t size = 100 * 1024 + 17;
+  uint8_t* expected = create_test_data(size);
+  cr_assert_not_null(expected, "Failed to allocate test data");
+
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+  cr_assert_not_null(root, "Failed to get root directory");
+
+  ccos_inode_t* file = ccos_add_file(disk, root, expected, size, "Spans~Data~");
+  cr_assert_not_null(file, "ccos_add_file failed");
+
+  ccos_file_span_iterator_t it;
+  cr_assert_eq(ccos_file_spans_begin(disk, file, &it), CCOS_OK);
+
+  size_t offset = 0;
+  const uint8_t* image_begin = ccos_disk_data(disk);
+  const uint8_t* image_end = image_begin + ccos_disk_size(disk);
+  for (;;) {
+    const uint8_t* span = NULL;
+    size_t span_size = 0;
+    cr_assert_eq(ccos_file_spans_next(&it, &span, &span_size), CCOS_OK);
+    if (span_size == 0) {
+      break;
+    }
+
+    cr_assert(span >= image_begin && span + span_size <= image_end, "Span should point into the image data");
+    cr_assert_leq(offset + span_size, size);
+    cr_assert_eq(memcmp(span, expected + offset, span_size), 0);
+    offset += span_size;
+  }
+  cr_assert_eq(offset, size);
+
+  // Directory contents are clipped to the directory length.
+  cr_assert_eq(ccos_file_spans_begin(disk, root, &it), CCOS_OK);
+  const uint8_t* span = NULL;
+  size_t span_size = 0;
+  cr_assert_eq(ccos_file_spans_next(&it, &span, &span_size), CCOS_OK);
+  cr_assert_eq(span_size, root->desc.dir_length);
+  cr_assert_eq(ccos_file_spans_next(&it, &span, &span_size), CCOS_OK);
+  cr_assert_eq(span_size, 0);
+
+  free(expected);
+  ccos_disk_free(disk);
+}
+
+Test(round_trip, pread_ranges) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  const size_t size = 100 * 1024 + 17;
+  uint8_t* expected = create_test_data(size);
+  cr_assert_not_null(expected, "Failed to allocate test data");
+
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+  cr_assert_not_null(root, "Failed to get root directory");
+
+  ccos_inode_t* file = ccos_add_file(disk, root, expected, size, "Pread~Data~");
+  cr_assert_not_null(file, "ccos_add_file failed");
+
+  size_t log_sector_size = ccos_get_log_sector_size(disk);
+  const struct {
+    size_t offset;
+    size_t length;
+  } ranges[] = {
+      {0, 16},
+      {log_sector_size - 3, 10},
+      {5 * log_sector_size, 3 * log_sector_size + 1},
+      {0, size},
+      {size - 5, 100},
+      {size, 10},
+      {size + 100, 10},
+      {7, 0},
+  };
+
+  uint8_t* buf = malloc(size + 100);
+  cr_assert_not_null(buf);
+  for (size_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); ++i) {
+    size_t offset = ranges[i].offset;
+    size_t expected_length = offset >= size ? 0 : (ranges[i].length < size - offset ? ranges[i].length : size - offset);
+
+    size_t bytes_read = SIZE_MAX;
+    cr_assert_eq(ccos_pread(disk, file, offset, buf, ranges[i].length, &bytes_read), CCOS_OK);
+    cr_assert_eq(bytes_read, expected_length, "Range #%zu: read %zu bytes instead of %zu", i, bytes_read,
+                 expected_length);
+    cr_assert_eq(memcmp(buf, expected + (offset < size ? offset : size), bytes_read), 0, "Range #%zu mismatch", i);
+  }
+
+  free(buf);
+  free(expected);
+  ccos_disk_free(disk);
+}
+
+Test(round_trip, file_writer_chunks) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  const size_t size = 150 * 1024 + 3;
+  uint8_t* expected = create_test_data(size);
+  cr_assert_not_null(expected, "Failed to allocate test data");
+
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+  cr_assert_not_null(root, "Failed to get root directory");
+
+  size_t free_space_before = 0;
+  cr_assert_eq(ccos_calc_free_space(disk, &free_space_before), CCOS_OK);
+
+  // Dropped file gives all its sectors back.
+  ccos_file_writer_t writer = {0};
+  cr_assert_eq(ccos_file_writer_open(disk, root, "Dropped~Data~", &writer), CCOS_OK);
+  cr_assert_eq(ccos_file_writer_append(&writer, expected, size), CCOS_OK);
+  ccos_file_writer_abort(&writer);
+
+  size_t free_space = 0;
+  cr_assert_eq(ccos_calc_free_space(disk, &free_space), CCOS_OK);
+  cr_assert_eq(free_space, free_space_before, "Aborted file leaked sectors");
+
+  // Chunk sizes are picked to cross sector and content inode boundaries at different offsets.
+  const size_t chunks[] = {1, 250, 3, 504, 1000, 7, 40000};
+  cr_assert_eq(ccos_file_writer_open(disk, root, "Chunked~Data~", &writer), CCOS_OK);
+  size_t offset = 0;
+  for (size_t i = 0; offset < size; i = (i + 1) % (sizeof(chunks) / sizeof(chunks[0]))) {
+    size_t chunk = chunks[i] < size - offset ? chunks[i] : size - offset;
+    cr_assert_eq(ccos_file_writer_append(&writer, expected + offset, chunk), CCOS_OK);
+    offset += chunk;
+  }
+
+  ccos_inode_t* file = NULL;
+  cr_assert_eq(ccos_file_writer_close(&writer, &file), CCOS_OK);
+  cr_assert_not_null(file);
+  cr_assert_eq(ccos_validate_file(disk, file), CCOS_OK);
+
+  ccos_inode_t* found = NULL;
+  cr_assert_eq(ccos_find_file_by_name(disk, root, "Chunked~Data~", &found), CCOS_OK);
+  cr_assert_eq(found, file);
+
+  uint8_t* data = NULL;
+  size_t data_size = 0;
+  cr_assert_eq(ccos_read_file(disk, file, &data, &data_size), CCOS_OK);
+  cr_assert_eq(data_size, size);
+  cr_assert_eq(memcmp(data, expected, size), 0, "Streamed file contents mismatch");
+
+  free(data);
+  free(expected);
+  ccos_disk_free(disk);
+}
+
+Test(round_trip, pwrite_ranges) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  const size_t size = 10 * 1024 + 5;
+  const size_t max_size = 80 * 1024;
+  uint8_t* expected = calloc(max_size, 1);
+  uint8_t* patch = create_test_data(max_size);
+  cr_assert_not_null(expected, "Failed to allocate test data");
+  cr_assert_not_null(patch, "Failed to allocate test data");
+  memset(expected, 0x5a, size);
+
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+  cr_assert_not_null(root, "Failed to get root directory");
+
+  ccos_inode_t* file = ccos_add_file(disk, root, expected, size, "Pwrite~Data~");
+  cr_assert_not_null(file, "ccos_add_file failed");
+
+  size_t log_sector_size = ccos_get_log_sector_size(disk);
+
+  // Write inside the file, across one sector boundary: only two data sectors are changed.
+  uint16_t* dirty = NULL;
+  size_t dirty_count = 0;
+  size_t offset = 3 * log_sector_size - 2;
+  cr_assert_eq(ccos_pwrite(disk, file, offset, patch, 4, &dirty, &dirty_count), CCOS_OK);
+  memcpy(expected + offset, patch, 4);
+  cr_assert_eq(dirty_count, 2);
+
+  size_t blocks_count = 0;
+  uint16_t* blocks = NULL;
+  cr_assert_eq(ccos_get_file_sectors(disk, file, &blocks_count, &blocks), CCOS_OK);
+  uint16_t low = blocks[2] < blocks[3] ? blocks[2] : blocks[3];
+  uint16_t high = blocks[2] < blocks[3] ? blocks[3] : blocks[2];
+  cr_assert_eq(dirty[0], low);
+  cr_assert_eq(dirty[1], high);
+  free(blocks);
+  free(dirty);
+
+  // Write past the end of the file: the gap is zeroed, the file grows.
+  offset = 40 * 1024 + 1;
+  size_t length = 30 * 1024;
+  cr_assert_eq(ccos_pwrite(disk, file, offset, patch + 100, length, &dirty, &dirty_count), CCOS_OK);
+  memcpy(expected + offset, patch + 100, length);
+  cr_assert_eq(file->desc.file_size, offset + length);
+  cr_assert_eq(ccos_validate_file(disk, file), CCOS_OK);
+
+  bool has_inode = false;
+  for (size_t i = 0; i < dirty_count; ++i) {
+    has_inode |= dirty[i] == file->header.file_id;
+    if (i > 0) {
+      cr_assert_lt(dirty[i - 1], dirty[i], "Dirty sectors list should be sorted and unique");
+    }
+  }
+  cr_assert(has_inode, "Extended file inode should be reported as dirty");
+  free(dirty);
+
+  // Dirty sectors report is optional.
+  cr_assert_eq(ccos_pwrite(disk, file, 0, patch, 1, NULL, NULL), CCOS_OK);
+  memcpy(expected, patch, 1);
+
+  uint8_t* data = NULL;
+  size_t data_size = 0;
+  cr_assert_eq(ccos_read_file(disk, file, &data, &data_size), CCOS_OK);
+  cr_assert_eq(data_size, offset + length);
+  cr_assert_eq(memcmp(data, expected, data_size), 0, "File contents mismatch after pwrite");
+
+  free(data);
+  free(patch);
+  free(expected);
+  ccos_disk_free(disk);
+}
+
+Test(round_trip, truncate_frees_tail) {
+  ccos_disk_t* disk = NULL;
+  int ret = ccos_new_disk_image(CCOS_DISK_FORMAT_COMPASS, 720 * 1024, &disk);
+  cr_assert_eq(ret, 0, "ccos_new_disk_image failed");
+
+  const size_t size = 200 * 1024 + 11;
+  uint8_t* expected = create_test_data(size);
+  cr_assert_not_null(expected, "Failed to allocate test data");
+
+  ccos_inode_t* root = ccos_get_root_dir(disk);
+  cr_assert_not_null(root, "Failed to get root directory");
+
+  size_t free_space_empty = 0;
+  cr_assert_eq(ccos_calc_free_space(disk, &free_space_empty), CCOS_OK);
+
+  ccos_inode_t* file = ccos_add_file(disk, root, expected, size, "Truncate~Data~");
+  cr_assert_not_null(file, "ccos_add_file failed");
+
+  size_t log_sector_size = ccos_get_log_sector_size(disk);
+  size_t inode_sectors = ccos_get_inode_max_sectors(disk);
+  size_t content_inode_sectors = ccos_get_content_inode_max_sectors(disk);
+
+  // Sizes end in the middle of a content inode, right at the end of one, inside the inode list and at zero.
+  const size_t sizes[] = {
+      size - 1,
+      (inode_sectors + content_inode_sectors + 5) * log_sector_size - 7,
+      (inode_sectors + content_inode_sectors) * log_sector_size,
+      3 * log_sector_size + 1,
+      0,
+  };
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    size_t new_size = sizes[i];
+    cr_assert_eq(ccos_truncate(disk, file, new_size), CCOS_OK);
+    cr_assert_eq(file->desc.file_size, new_size);
+    cr_assert_eq(ccos_validate_file(disk, file), CCOS_OK);
+
+    size_t free_space = 0;
+    size_t data_sectors = (new_size + log_sector_size - 1) / log_sector_size;
+    size_t content_inodes =
+        data_sectors > inode_sectors ? (data_sectors - inode_sectors + content_inode_sectors - 1) / content_inode_sectors
+                                     : 0;
+    cr_assert_eq(ccos_calc_free_space(disk, &free_space), CCOS_OK);
+    cr_assert_eq(free_space, free_space_empty - (1 + data_sectors + content_inodes) * ccos_disk_sector_size(disk),
+                 "Unexpected free space after truncating to %zu bytes", new_size);
+
+    uint8_t* data = NULL;
+    size_t data_size = 0;
+    cr_assert_eq(ccos_read_file(disk, file, &data, &data_size), CCOS_OK);
+    cr_assert_eq(data_size, new_size);
+    cr_assert_eq(memcmp(data, expected, data_size), 0, "File contents mismatch after truncating to %zu", new_size);
+    free(data);
+  }
+
+  // Growing the file back fills it with zeroes.
+  const size_t grown_size = 2 * log_sector_size + 3;
+  cr_assert_eq(ccos_truncate(disk, file, grown_size), CCOS_OK);
+  uint8_t* data = NULL;
+  size_t data_size = 0;
+  cr_assert_eq(ccos_read_file(disk, file, &data, &data_size), CCOS_OK);
+  cr_assert_eq(data_size, grown_size);
+  for (size_t i = 0; i < data_size; ++i) {
+    cr_assert_eq(data[i], 0, "Byte %zu of the grown file is not zero", i);
+  }
+  free(data);
+
+  cr_assert_eq(ccos_delete_file(disk, file), CCOS_OK);
+  size_t free_space = 0;
+  cr_assert_eq(ccos_calc_free_space(disk, &free_space), CCOS_OK);
+  cr_assert_eq(free_space, free_space_empty, "Deleted file leaked sectors");
+
+  free(expected);
+  ccos_disk_free(disk);
+}
@@ -4,7 +4,6 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
 #include <time.h>
 
 ccos_date_t ccos_get_datetime(void) {
@@ -38,40 +37,18 @@ void trace_init(int verbose) {
   }
 }
 
-int read_file(const char* path, uint8_t** file_data, size_t* file_size) {
-  if (path == NULL) {
-    fprintf(stderr, "Unable to open file: no path was passed!\n\n");
-    return -1;
-  }
-
-  struct stat st = {};
-  if (stat(path, &st) == -1) {
-    fprintf(stderr, "Unable to stat %s: %s!\n", path, strerror(errno));
-    return -1;
-  }
-
-  FILE* f = fopen(path, "rb");
+int save_new_image(const char* path, ccos_disk_t* disk) {
+  FILE* f = fopen(path, "wb");
   if (f == NULL) {
-    fprintf(stderr, "Unable to open %s: %s!\n", path, strerror(errno));
-    return -1;
-  }
-
-  *file_size = st.st_size;
-
-  *file_data = (uint8_t*)calloc(*file_size, sizeof(uint8_t));
-  if (*file_data == NULL) {
-    fprintf(stderr, "Unable to allocate " SIZE_T " bytes for the file %s contents: %s!\n", *file_size, path,
-            strerror(errno));
-    fclose(f);
+    fprintf(stderr, "Unable to open \"%s\" for writing: %s!\n", path, strerror(errno));
     return -1;
   }
 
-  size_t readed = fread(*file_data, sizeof(uint8_t), *file_size, f);
+  size_t disk_size = ccos_disk_size(disk);
+  size_t written = fwrite(ccos_disk_data(disk), sizeof(uint8_t), disk_size, f);
   fclose(f);
-
-  if (readed != *file_size) {
-    fprintf(stderr, "Unable to read " SIZE_T " bytes from the file %s: %s!\n", *file_size, path, strerror(errno));
-    free(*file_data);
+  if (written != disk_size) {
+    fprintf(stderr, "Write size mismatch: Expected " SIZE_T ", but only " SIZE_T " written!\n", disk_size, written);
     return -1;
   }
 
@@ -79,42 +56,23 @@ int read_file(const char* path, uint8_t** file_data, size_t* file_size) {
 }
 
 int save_image(const char* source_filename, ccos_disk_t* disk, int in_place) {
-  char* dest_filename;
+  // The disk may be mapped from the source image, which must not be truncated then: pages that are not yet copied
+  // would be lost. Only the sectors changed since the image was opened are written over it.
   if (in_place) {
-    dest_filename = (char*)source_filename;
-  } else {
-    const char* out_suffix = ".out";
-    dest_filename = (char*)calloc(strlen(source_filename) + strlen(out_suffix) + 1, sizeof(char));
-    if (dest_filename == NULL) {
-      fprintf(stderr, "Unable to allocate memory for destination file name: %s!\n", strerror(errno));
-      return -1;
-    }
-
-    sprintf(dest_filename, "%s%s", source_filename, out_suffix);
-  }
-
-  FILE* f = fopen(dest_filename, "wb");
-  if (f == NULL) {
-    fprintf(stderr, "Unable to open \"%s\" for writing: %s!\n", dest_filename, strerror(errno));
-  }
-
-  if (!in_place) {
-    free(dest_filename);
-  }
-
-  if (f == NULL) {
-    return -1;
+    return ccos_disk_flush(disk, source_filename) == CCOS_OK ? 0 : -1;
   }
 
-  size_t disk_size = ccos_disk_size(disk);
-  size_t written = fwrite(ccos_disk_data(disk), sizeof(uint8_t), disk_size, f);
-  fclose(f);
-  if (written != disk_size) {
-    fprintf(stderr, "Write size mismatch: Expected " SIZE_T ", but only " SIZE_T " written!\n", disk_size, written);
+  const char* out_suffix = ".out";
+  char* dest_filename = (char*)calloc(strlen(source_filename) + strlen(out_suffix) + 1, sizeof(char));
+  if (dest_filename == NULL) {
+    fprintf(stderr, "Unable to allocate memory for destination file name: %s!\n", strerror(errno));
     return -1;
   }
 
-  return 0;
+  sprintf(dest_filename, "%s%s", source_filename, out_suffix);
+  int res = save_new_image(dest_filename, disk);
+  free(dest_filename);
+  return res;
 }
 
 const char* get_basename(const char* path) {
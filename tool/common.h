@@ -24,27 +24,26 @@ int trace_silent(FILE* stream, const char* format, ...);
 void trace_init(int verbose);
 
 /**
- * @brief      Read file contents from path into memory buffer
+ * @brief      Save memory buffer content to file
  *
- * @param[in]  path        File path to read.
- * @param      file_data   The file data.
- * @param      file_size   The file size.
+ * @param[in]  source_filename  File path to save.
+ * @param[in]  disk             Compass disk image.
+ * @param[in]  in_place         If true, write the sectors changed since the image was opened over the original
+ * target image. Otherwise, save new image under {target_image}.out name.
  *
  * @return     0 on success, -1 otherwise.
  */
-int read_file(const char* path, uint8_t** file_data, size_t* file_size);
+int save_image(const char* source_filename, ccos_disk_t* disk, int in_place);
 
 /**
- * @brief      Save memory buffer content to file
+ * @brief      Save memory buffer content to a new file, replacing the file if it exists
  *
- * @param[in]  source_filename  File path to save.
- * @param[in]  disk             Compass disk image.
- * @param[in]  in_place         If true, override original target image. Otherwise, save new image under
- * {target_image}.out name.
+ * @param[in]  path  File path to save.
+ * @param[in]  disk  Compass disk image.
  *
  * @return     0 on success, -1 otherwise.
  */
-int save_image(const char* source_filename, ccos_disk_t* disk, int in_place);
+int save_new_image(const char* path, ccos_disk_t* disk);
 
 const char* get_basename(const char* path);
 
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <getopt.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -31,6 +32,27 @@ static int is_imd_image(const uint8_t* data) {
   return data[0] == 'I' && data[1] == 'M' && data[2] == 'D' && data[3] == ' ';
 }
 
+#define IMAGE_HEADER_SIZE 0x200
+
+// Read the first sector of the image, which is enough to check its format. Shorter files are padded with zeroes.
+static int read_image_header(const char* path, uint8_t* header) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Unable to open %s: %s!\n", path, strerror(errno));
+    return -1;
+  }
+
+  size_t read = fread(header, sizeof(uint8_t), IMAGE_HEADER_SIZE, f);
+  int error = ferror(f);
+  fclose(f);
+  if (read == 0 || error) {
+    fprintf(stderr, "Unable to read %s!\n", path);
+    return -1;
+  }
+
+  return 0;
+}
+
 static int ccos_check_image(const uint8_t* file_data) {
   if (is_fat_image(file_data)) {
     fprintf(stderr, "FAT image is found; return.\n");
@@ -112,7 +134,7 @@ static void print_usage() {
           "-s, --short-format       Use short format in printing contents\n"
           "                         (80-column compatible, no dates)\n"
           "-d, --dump-dir           Dump image contents into the current directory\n"
-          "-a, --add-file FILE      Add file to the image\n"
+          "-a, --add-file FILE      Add file to the image (\"-\" reads it from stdin)\n"
           "-y, --create-dir NAME    Create new directory\n"
           "-r, --replace-file FILE  Replace file in the image with the given\n"
           "                         file, save changes to IMAGE.out\n"
@@ -122,7 +144,10 @@ static void print_usage() {
           "-z, --delete-file FILE   Delete file from the image\n"
           "-n, --target-name NAME   Replace / delete / copy or add file with the name NAME\n"
           "                         in the image\n"
-          "-l, --in-place           Write changes to the original image\n");
+          "-l, --in-place           Write changes to the original image\n"
+          "\n"
+          "File NAME may also be a path from the root directory, e.g.\n"
+          "Programs~Subject~/Demo~Text~\n");
 }
 
 typedef struct {
@@ -268,26 +293,23 @@ int main(int argc, char** argv) {
     return create_blank_image(disk_options.sector_size, path, new_image_size);
   }
 
-  uint8_t* file_contents = NULL;
-  size_t file_size = 0;
-  if (read_file(path, &file_contents, &file_size) == -1) {
+  uint8_t header[IMAGE_HEADER_SIZE] = {0};
+  if (read_image_header(path, header) == -1) {
     fprintf(stderr, "Unable to read disk image file!\n");
     print_usage();
     return -1;
   }
 
-  if (ccos_check_image(file_contents) == -1) {
+  if (ccos_check_image(header) == -1) {
     fprintf(stderr, "Unable to get superblock: invalid image format!\n");
-    free(file_contents);
     return -1;
   }
 
-  disk = disk_options.sector_size == 256
-    ? ccos_disk_new_bubble(file_contents, file_size, disk_options.superblock, disk_options.bitmap)
-    : ccos_disk_new_extdisk(file_contents, file_size, disk_options.superblock, disk_options.bitmap);
+  // Changes are saved with save_image(), so the image is mapped privately: only the pages which are accessed are read.
+  disk = ccos_disk_open_file(path, CCOS_DISK_MAP_PRIVATE, disk_options.sector_size, disk_options.superblock,
+                             disk_options.bitmap);
   if (disk == NULL) {
     fprintf(stderr, "Unable to initialize disk context!\n");
-    free(file_contents);
     return -1;
   }
 
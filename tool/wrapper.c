@@ -13,7 +13,9 @@
 #include <sys/stat.h>
 
 #define PROGRAMS_DIR_1 "Programs~Subject~"
-#define PROGRAMS_DIR_2 "Programs~subject~"
+
+// Host files are added to the image in chunks of this size.
+#define ADD_FILE_CHUNK_SIZE (64 * 1024)
 
 typedef struct {
   const char* target_name;
@@ -227,36 +229,39 @@ static traverse_callback_result_t dump_dir_tree_on_file(
   snprintf(abspath, PATH_MAX, "%s/%s", dirname, file_name);
   free(file_name);
 
-  size_t file_size = 0;
-  uint8_t* file_data = NULL;
-  if (ccos_read_file(disk, file, &file_data, &file_size) != CCOS_OK) {
-    fprintf(stderr, "Unable to dump file at 0x%x: Unable to get file contents!\n", file->header.file_id);
-    if (file_data != NULL) {
-      free(file_data);
-      return RESULT_ERROR;
-    }
-  }
-
   TRACE("Writing to \"%s\"...", abspath);
 
   FILE* f = fopen(abspath, "wb");
   if (f == NULL) {
     fprintf(stderr, "Unable to open file \"%s\": %s!\n", abspath, strerror(errno));
     free(abspath);
-    free(file_data);
     return RESULT_ERROR;
   }
 
-  if (fwrite(file_data, sizeof(uint8_t), file_size, f) < file_size) {
-    fprintf(stderr, "Unable to write data to \"%s\": %s!\n", abspath, strerror(errno));
-    free(abspath);
-    free(file_data);
-    fclose(f);
-    return RESULT_ERROR;
+  // Write file contents straight from the image sectors.
+  ccos_file_span_iterator_t it;
+  ccos_error_t err = ccos_file_spans_begin(disk, file, &it);
+  while (err == CCOS_OK) {
+    const uint8_t* span = NULL;
+    size_t span_size = 0;
+    err = ccos_file_spans_next(&it, &span, &span_size);
+    if (err != CCOS_OK || span_size == 0) {
+      break;
+    }
+
+    if (fwrite(span, sizeof(uint8_t), span_size, f) < span_size) {
+      fprintf(stderr, "Unable to write data to \"%s\": %s!\n", abspath, strerror(errno));
+      free(abspath);
+      fclose(f);
+      return RESULT_ERROR;
+    }
+  }
+
+  if (err != CCOS_OK) {
+    fprintf(stderr, "Unable to dump file at 0x%x: Unable to get file contents!\n", file->header.file_id);
   }
 
   fclose(f);
-  free(file_data);
   free(abspath);
 
   TRACE("Done!");
@@ -493,8 +498,53 @@ static traverse_callback_result_t find_file_on_file(
   return RESULT_OK;
 }
 
+// Names with a '/' after the type marker (e.g. Programs~Subject~/Demo~Text~) are paths from the root directory, other
+// names are searched in the whole image, and the first file found by the depth-first traversal is returned.
 static int find_filename(ccos_disk_t* disk, ccos_inode_t* root_dir, const char* filename, ccos_inode_t** file,
                          int verbose) {
+  if (strstr(filename, "~/") != NULL) {
+    ccos_error_t err = ccos_lookup_path(disk, filename, file);
+    if (err != CCOS_OK) {
+      if (verbose) {
+        fprintf(stderr, "No file %s in the image: %s.\n", filename, ccos_error_string(err));
+      }
+      return -1;
+    }
+
+    return 0;
+  }
+
+  // Index lookup is case-insensitive, so the files found are matched exactly here. Names with '_' may refer to the
+  // files with '/' in their names, which are matched with '_' instead, so the whole image is searched for them.
+  if (strchr(filename, '_') == NULL) {
+    ccos_inode_t** found = NULL;
+    size_t found_count = 0;
+    ccos_error_t err = ccos_find_files_by_name(disk, filename, &found, &found_count);
+    if (err != CCOS_OK && err != CCOS_ENOENT) {
+      fprintf(stderr, "Unable to find file in image: %s!\n", ccos_error_string(err));
+      return -1;
+    }
+
+    *file = NULL;
+    for (size_t i = 0; i < found_count && *file == NULL; ++i) {
+      const char* name = found[i]->desc.name;
+      size_t length = found[i]->desc.name_length;
+      if (strncmp(name, filename, length) == 0 && memchr(name, '/', length) == NULL) {
+        *file = found[i];
+      }
+    }
+
+    free(found);
+    if (*file == NULL) {
+      if (verbose) {
+        fprintf(stderr, "No file %s in the image.\n", filename);
+      }
+      return -1;
+    }
+
+    return 0;
+  }
+
   find_file_data_t find_file_data = {.target_name = filename, .target_file = 0};
 
   if (traverse_ccos_image(disk, root_dir, "", 0, find_file_on_file, find_file_on_file, &find_file_data) != 0) {
@@ -513,6 +563,16 @@ static int find_filename(ccos_disk_t* disk, ccos_inode_t* root_dir, const char*
   return 0;
 }
 
+static int find_subject(ccos_disk_t* disk, ccos_inode_t* root_dir, const char* name, ccos_inode_t** dir) {
+  ccos_inode_t* found = NULL;
+  if (ccos_find_file_by_name(disk, root_dir, name, &found) != CCOS_OK || !ccos_is_dir(found)) {
+    return -1;
+  }
+
+  *dir = found;
+  return 0;
+}
+
 int replace_file(ccos_disk_t* disk, const char* path, const char* filename, const char* target_name, int in_place) {
   const char* basename;
 
@@ -563,34 +623,17 @@ int replace_file(ccos_disk_t* disk, const char* path, const char* filename, cons
     return -1;
   }
 
-  FILE* output;
-  if (in_place) {
-    output = fopen(path, "wb");
-  } else {
-    char output_path[PATH_MAX];
-    memset(output_path, 0, PATH_MAX);
-    snprintf(output_path, PATH_MAX, "%s.new", path);
-    output = fopen(output_path, "wb");
-  }
-
-  if (output == NULL) {
-    fprintf(stderr, "Unable to open output file for writing: %s!\n", strerror(errno));
-    free(file_contents);
-    return -1;
-  }
-
-  size_t disk_size = ccos_disk_size(disk);
-  size_t res = fwrite(ccos_disk_data(disk), sizeof(uint8_t), disk_size, output);
   free(file_contents);
-  fclose(output);
 
-  if (res != disk_size) {
-    fprintf(stderr, "Unable to write new image: written " SIZE_T ", expected " SIZE_T ": %s!\n", res, disk_size,
-            strerror(errno));
-    return -1;
+  // Only the sectors changed by the replacement are written back to the original image.
+  if (in_place) {
+    return ccos_disk_flush(disk, path) == CCOS_OK ? 0 : -1;
   }
 
-  return 0;
+  char output_path[PATH_MAX];
+  memset(output_path, 0, PATH_MAX);
+  snprintf(output_path, PATH_MAX, "%s.new", path);
+  return save_new_image(output_path, disk);
 }
 
 static int do_copy_file(ccos_disk_t* src, ccos_inode_t* src_root_dir, const char* filename,
@@ -607,11 +650,10 @@ static int do_copy_file(ccos_disk_t* src, ccos_inode_t* src_root_dir, const char
 
   ccos_inode_t* dest_directory = NULL;
 
-  if (find_filename(dest, dest_root_dir, source_dir_name, &dest_directory, 1) == -1) {
+  if (find_subject(dest, dest_root_dir, source_dir_name, &dest_directory) == -1) {
     fprintf(stderr, "Warn: Unable to find directory %s in dest image, will copy to the " PROGRAMS_DIR_1 " instead.\n",
             source_dir_name);
-    if (find_filename(dest, dest_root_dir, PROGRAMS_DIR_1, &dest_directory, 0) == -1 &&
-        find_filename(dest, dest_root_dir, PROGRAMS_DIR_2, &dest_directory, 0) == -1) {
+    if (find_subject(dest, dest_root_dir, PROGRAMS_DIR_1, &dest_directory) == -1) {
       fprintf(stderr, "Warn: Unable to find directory %s in dest image, will copy to the root directory instead\n",
               PROGRAMS_DIR_1);
       dest_directory = dest_root_dir;
@@ -634,20 +676,11 @@ int copy_file(ccos_disk_t* src, const char* target_image, const char* filename,
     return -1;
   }
 
-  uint8_t* dest_data = NULL;
-  size_t dest_size = 0;
-  if (read_file(target_image, &dest_data, &dest_size) == -1) {
-    fprintf(stderr, "Unable to read target disk image file!\n");
-    return -1;
-  }
-
   // TODO: Allow to copy file to disk with different properties.
-  ccos_disk_t* dest = ccos_disk_sector_size(src) == 256
-    ? ccos_disk_new_bubble(dest_data, dest_size, ccos_disk_superblock(src), ccos_disk_bitmap(src))
-    : ccos_disk_new_extdisk(dest_data, dest_size, ccos_disk_superblock(src), ccos_disk_bitmap(src));
+  ccos_disk_t* dest = ccos_disk_open_file(target_image, CCOS_DISK_MAP_PRIVATE, ccos_disk_sector_size(src),
+                                          ccos_disk_superblock(src), ccos_disk_bitmap(src));
   if (dest == NULL) {
     fprintf(stderr, "Unable to initialize target disk context!\n");
-    free(dest_data);
     return -1;
   }
 
@@ -687,32 +720,62 @@ int add_file(ccos_disk_t* disk, const char* image_path, const char* file_path, c
     return -1;
   }
 
-  uint8_t* file_data = NULL;
-  size_t file_size = 0;
-  if (read_file(file_path, &file_data, &file_size) == -1) {
-    fprintf(stderr, "Unable to read target disk image file!\n");
-    return -1;
-  }
-
   ccos_inode_t* root_dir = ccos_get_root_dir(disk);
   if (root_dir == NULL) {
     fprintf(stderr, "Unable to add file to image: Unable to get root directory!\n");
-    free(file_data);
     return -1;
   }
 
   ccos_inode_t* dest_dir = NULL;
 
-  if (find_filename(disk, root_dir, PROGRAMS_DIR_1, &dest_dir, 0) == -1 &&
-      find_filename(disk, root_dir, PROGRAMS_DIR_2, &dest_dir, 0) == -1) {
+  if (find_subject(disk, root_dir, PROGRAMS_DIR_1, &dest_dir) == -1) {
     fprintf(stderr, "Warn: Unable to find directory %s in dest image, will add file to the root directory instead\n",
             PROGRAMS_DIR_1);
     dest_dir = root_dir;
   }
 
-  ccos_inode_t* new_file = ccos_add_file(disk, dest_dir, file_data, file_size, file_name);
-  free(file_data);
-  if (new_file == NULL) {
+  int use_stdin = strcmp(file_path, "-") == 0;
+  FILE* f = use_stdin ? stdin : fopen(file_path, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Unable to open %s: %s!\n", file_path, strerror(errno));
+    return -1;
+  }
+
+  ccos_file_writer_t writer = {0};
+  if (ccos_file_writer_open(disk, dest_dir, file_name, &writer) != CCOS_OK) {
+    fprintf(stderr, "Unable to copy %s to %s!\n", file_name, file_path);
+    if (!use_stdin) {
+      fclose(f);
+    }
+    return -1;
+  }
+
+  uint8_t buffer[ADD_FILE_CHUNK_SIZE];
+  size_t chunk_size = 0;
+  int res = 0;
+  while ((chunk_size = fread(buffer, sizeof(uint8_t), sizeof(buffer), f)) > 0) {
+    if (ccos_file_writer_append(&writer, buffer, chunk_size) != CCOS_OK) {
+      fprintf(stderr, "Unable to write %s to the image!\n", file_path);
+      res = -1;
+      break;
+    }
+  }
+
+  if (res == 0 && ferror(f)) {
+    fprintf(stderr, "Unable to read %s: %s!\n", file_path, strerror(errno));
+    res = -1;
+  }
+
+  if (!use_stdin) {
+    fclose(f);
+  }
+
+  if (res == -1) {
+    ccos_file_writer_abort(&writer);
+    return -1;
+  }
+
+  if (ccos_file_writer_close(&writer, NULL) != CCOS_OK) {
     fprintf(stderr, "Unable to copy %s to %s!\n", file_name, file_path);
     return -1;
   }
@@ -731,30 +794,19 @@ int delete_file(ccos_disk_t* disk, const char* path, const char* filename, int i
     return -1;
   }
 
-  uint8_t* data = NULL;
-  size_t size = 0;
-  if (read_file(path, &data, &size) == -1) {
-    fprintf(stderr, "Unable to read target disk image file!\n");
-    return -1;
-  }
-
   ccos_inode_t* root_dir = ccos_get_root_dir(disk);
   ccos_inode_t* file = NULL;
   if (find_filename(disk, root_dir, filename, &file, 1) != 0) {
     fprintf(stderr, "Unable to find file %s in the image!\n", filename);
-    free(data);
     return -1;
   }
 
   if (ccos_delete_file(disk, file) != CCOS_OK) {
     fprintf(stderr, "Unable to delete file %s!\n", filename);
-    free(data);
     return -1;
   }
 
-  int res = save_image(path, disk, in_place);
-  free(data);
-  return res;
+  return save_image(path, disk, in_place);
 }
 
 int create_directory(ccos_disk_t* disk, char* path, char* directory_name, int in_place) {
@@ -840,7 +892,7 @@ int create_blank_image(uint16_t sector_size, char* path, size_t size) {
     return res;
   }
 
-  res = save_image(path, new_disk, 1);
+  res = save_new_image(path, new_disk);
   ccos_disk_free(new_disk);
   return res;
 }
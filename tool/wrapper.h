@@ -119,7 +119,7 @@ int delete_file(ccos_disk_t* disk, const char* path, const char* filename, int i
  *
  * @param[in]  disk        Compass disk image.
  * @param[in]  image_path  Path to the image to add file.
- * @param[in]  file_path   The path to file to add.
+ * @param[in]  file_path   The path to file to add, or "-" to read file contents from stdin.
  * @param[in]  file_name   The name of file to add.
  * @param[in]  in_place    If true, override original target image. Otherwise, save new image under {target_image}.out
  * name.